@@ -0,0 +1,85 @@
+/*
+  J1708_HAL.h
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Hardware abstraction for the J1708_T4 library.
+    Selects the serial port, clock and GPIO used by every J1708 object.
+    On a Teensy 4.x these come from the Arduino core. Building with
+    J1708_HOST defined (see extras/host) swaps them for a virtual bus,
+    a virtual clock and recorded pins so the library runs on a PC.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#ifndef J1708_HAL_H
+#define J1708_HAL_H
+
+#if defined(J1708_HOST)
+  // Serial: J1708SerialPort on a simulated wired-AND bus
+  //         J1708RxOverrun() reports bytes dropped by a full receive buffer
+  // Clock:  micros(), millis(), elapsedMicros and elapsedMillis on a virtual clock
+  //         J1708Cycles() is the host's monotonic clock in nanoseconds
+  // GPIO:   pinMode() and digitalWrite() recorded per pin
+  // EEPROM: EEPROM.get(), put(), read(), update() on a RAM array
+  #include "J1708_Host.h"
+#else
+  #include <Arduino.h>
+  #include <EEPROM.h>
+  typedef HardwareSerial J1708SerialPort;
+
+  // Receive ring of every Teensy 4.x HardwareSerial before addMemoryForRead (SERIALn_RX_BUFFER_SIZE)
+  #define J1708_SERIAL_RX_BUFFER 64
+  // LPUART behind each HardwareSerial
+  inline IMXRT_LPUART_t *J1708LPUART(J1708SerialPort &serial) {
+    if (&serial==&Serial1) return &IMXRT_LPUART6;
+    if (&serial==&Serial2) return &IMXRT_LPUART4;
+    if (&serial==&Serial3) return &IMXRT_LPUART2;
+    if (&serial==&Serial4) return &IMXRT_LPUART3;
+    if (&serial==&Serial5) return &IMXRT_LPUART8;
+    if (&serial==&Serial6) return &IMXRT_LPUART1;
+    if (&serial==&Serial7) return &IMXRT_LPUART7;
+  #if defined(ARDUINO_TEENSY41)
+    if (&serial==&Serial8) return &IMXRT_LPUART5;
+  #endif
+    return NULL;
+  }
+
+  // Receive overrun: STAT[OR] is set when a byte arrives while the LPUART's receive FIFO is
+  // still full. It is read and cleared here, keeping the configuration bits of STAT and
+  // leaving its other flags alone. The core's idle handling writes STAT back and can clear
+  // OR first, so an overrun may go uncounted, but never the other way round.
+  // Bytes the core drops because its receive ring is full set no flag and are not seen here.
+  // Define J1708_RX_FULL_OVERRUN to also count a completely full ring (it holds capacity-1)
+  // as an overrun. That is a false positive when the ring filled up exactly without a loss.
+  inline bool J1708RxOverrun(J1708SerialPort &serial, int capacity) {
+    IMXRT_LPUART_t *lpuart = J1708LPUART(serial);
+    if (lpuart && (lpuart->STAT & LPUART_STAT_OR)){
+      const uint32_t config = LPUART_STAT_MSBF | LPUART_STAT_RXINV | LPUART_STAT_RWUID | LPUART_STAT_BRK13 | LPUART_STAT_LBKDE;
+      lpuart->STAT = (lpuart->STAT & config) | LPUART_STAT_OR;
+      return true;
+    }
+  #if defined(J1708_RX_FULL_OVERRUN)
+    return serial.available()>=capacity-1;
+  #else
+    return false;
+  #endif
+  }
+
+  // Cortex-M7 DWT cycle counter
+  inline void J1708CyclesBegin() {
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  }
+  inline uint32_t J1708Cycles() { return ARM_DWT_CYCCNT; }
+#endif
+
+#endif
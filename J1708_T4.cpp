@@ -19,7 +19,6 @@
 
 // Dependencies
 #include <J1708_T4.h>
-// #include <EEPROM.h>
 
 // Utility Functions
 String getValue(String data, char separator, int index){
@@ -68,80 +67,355 @@ int string2Hex(String data){
   }
 }
 
+// Profiling Zones
+const char *const J1708ZoneNames[ZoneCount] = {
+  "J1708Rx", "J1708Tx", "J1708Listen", "UpdateNetworkStatistics", "J1708CheckNetwork",
+  "RTS_Handler", "CTS_Handler", "CDP_Handler", "EOM_Handler", "Abort_Handler"
+};
+
+#if defined(J1708_PROFILE)
+J1708ProfileZone J1708Profile[ZoneCount];
+
+void J1708ProfileRecord(uint8_t zone, uint32_t cycles){
+  J1708ProfileZone &z = J1708Profile[zone];
+  if (z.calls==0 || cycles<z.min){
+    z.min = cycles;
+  }
+  if (cycles>z.max){
+    z.max = cycles;
+  }
+  z.total += cycles;
+  z.calls++;
+}
+#endif
+
+void J1708ProfilePrint(){
+#if defined(J1708_PROFILE)
+  Serial.println("PROFILE ZONES");
+#if defined(J1708_HOST)
+  Serial.println("Zone:Calls:Total:Min:Max:Mean (ns)");
+#else
+  Serial.println("Zone:Calls:Total:Min:Max:Mean (cycles)");
+#endif
+  for (int i=0; i<ZoneCount; i++){
+    J1708ProfileZone &z = J1708Profile[i];
+    Serial.print(J1708ZoneNames[i]);Serial.print(":");
+    Serial.print(z.calls);Serial.print(":");
+    Serial.print((unsigned long long)z.total);Serial.print(":");
+    Serial.print(z.min);Serial.print(":");
+    Serial.print(z.max);Serial.print(":");
+    Serial.println(z.calls>0 ? (uint32_t)(z.total/z.calls) : 0);
+  }
+#else
+  Serial.println("Profiling disabled. Build with J1708_PROFILE defined.");
+#endif
+}
+
+void J1708ProfileReset(){
+#if defined(J1708_PROFILE)
+  memset(J1708Profile,0,sizeof(J1708Profile));
+#endif
+}
+
+// Shared Timebase
+static uint32_t J1708Epoch = 0;
+
+uint32_t J1708Time(){
+  return micros()-J1708Epoch;
+}
+
+void J1708TimeReset(){
+  J1708Epoch = micros();
+}
+
+// Persistent Configuration
+uint16_t J1708CRC16(const uint8_t data[], int length){
+  // CRC-16/CCITT-FALSE
+  uint16_t crc = 0xFFFF;
+  for (int i=0; i<length; i++){
+    crc ^= (uint16_t)data[i]<<8;
+    for (int b=0; b<8; b++){
+      crc = (crc & 0x8000) ? (crc<<1)^0x1021 : crc<<1;
+    }
+  }
+  return crc;
+}
+
+static uint16_t J1708ConfigCRC(const J1708Config &config){
+  const uint8_t *start = (const uint8_t *)&config.magic;
+  return J1708CRC16(start,(const uint8_t *)&config.crc-start);
+}
+
+//Slot directory, read from the record headers once and shared by every port
+const static int J1708ConfigMaxSlots = 32;
+static int J1708ConfigSlots = -1;
+static uint32_t J1708ConfigSeq[J1708ConfigMaxSlots];
+static uint8_t J1708ConfigPort[J1708ConfigMaxSlots];   // 0 - free
+static uint32_t J1708ConfigLastSeq = 0;
+static int J1708ConfigLastSlot = -1;
+
+static int J1708ConfigAddress(int slot){
+  return J1708_EEPROM_BASE + slot*sizeof(J1708Config);
+}
+
+static void J1708ConfigScan(){
+  if (J1708ConfigSlots>=0){
+    return;
+  }
+  int bytes = (int)EEPROM.length()-J1708_EEPROM_BASE;
+  if (bytes>J1708_EEPROM_SIZE){
+    bytes = J1708_EEPROM_SIZE;
+  }
+  J1708ConfigSlots = bytes>0 ? bytes/(int)sizeof(J1708Config) : 0;
+  if (J1708ConfigSlots>J1708ConfigMaxSlots){
+    J1708ConfigSlots = J1708ConfigMaxSlots;
+  }
+  for (int i=0; i<J1708ConfigSlots; i++){
+    struct {uint32_t seq; uint16_t magic; uint8_t version; uint8_t port;} header;
+    EEPROM.get(J1708ConfigAddress(i),header);
+    bool used = header.magic==J1708Config::Magic && header.version==J1708Config::Version;
+    J1708ConfigSeq[i] = used ? header.seq : 0;
+    J1708ConfigPort[i] = used ? header.port : 0;
+    if (used && header.seq>=J1708ConfigLastSeq){
+      J1708ConfigLastSeq = header.seq;
+      J1708ConfigLastSlot = i;
+    }
+  }
+}
+
+static bool J1708ConfigNewest(int slot){
+  // True if slot holds the newest record of its port
+  for (int i=0; i<J1708ConfigSlots; i++){
+    if (J1708ConfigPort[i]==J1708ConfigPort[slot] && J1708ConfigSeq[i]>J1708ConfigSeq[slot]){
+      return false;
+    }
+  }
+  return true;
+}
+
+// Command Tokens
+uint8_t J1708Tokenize(const char *command, J1708Args &args){
+  // Single pass over the command. Tokens point into the caller's buffer.
+  args.n = 0;
+  const char *p = command;
+  while (args.n<J1708Args::MaxTokens){
+    while (*p==' ' || *p=='\t' || *p=='\r' || *p=='\n'){
+      p++;
+    }
+    if (*p=='\0'){
+      break;
+    }
+    args.tok[args.n] = p;
+    while (*p!='\0' && *p!=' ' && *p!='\t' && *p!='\r' && *p!='\n'){
+      p++;
+    }
+    args.len[args.n] = p-args.tok[args.n];
+    args.n++;
+  }
+  return args.n;
+}
+
+static int hexNibble(char c){
+  if (c>='0' && c<='9') return c-'0';
+  if (c>='a' && c<='f') return c-'a'+10;
+  if (c>='A' && c<='F') return c-'A'+10;
+  return -1;
+}
+
+bool J1708Args::has(uint8_t i) const {
+  return i<n;
+}
+
+bool J1708Args::is(uint8_t i, const char *text) const {
+  return i<n && strncmp(tok[i],text,len[i])==0 && text[len[i]]=='\0';
+}
+
+int J1708Args::toFlag(uint8_t i) const {
+  if (is(i,"0")) return 0;
+  if (is(i,"1")) return 1;
+  return -1;
+}
+
+int J1708Args::toHex(uint8_t i) const {
+  if (i>=n || len[i]!=2){
+    return -1;
+  }
+  int hi = hexNibble(tok[i][0]);
+  int lo = hexNibble(tok[i][1]);
+  if (hi<0 || lo<0){
+    return -1;
+  }
+  return (hi<<4) | lo;
+}
+
+long J1708Args::toInt(uint8_t i) const {
+  // Tokens end at a separator, so the C conversions stop at the token boundary.
+  return i<n ? strtol(tok[i],NULL,10) : 0;
+}
+
+float J1708Args::toFloat(uint8_t i) const {
+  return i<n ? (float)strtod(tok[i],NULL) : 0.0;
+}
+
+int J1708Args::toHexBytes(uint8_t i, uint8_t out[], int count) const {
+  // Decodes count dot-separated hex bytes straight into out.
+  if (i>=n){
+    return -1;
+  }
+  const char *p = tok[i];
+  const char *end = tok[i]+len[i];
+  for (int k=0; k<count; k++){
+    if (end-p<2){
+      return -1;
+    }
+    int hi = hexNibble(p[0]);
+    int lo = hexNibble(p[1]);
+    if (hi<0 || lo<0 || (p+2<end && p[2]!='.')){
+      return -1;
+    }
+    out[k] = (hi<<4) | lo;
+    p += 3;
+  }
+  return count;
+}
+
 // Setup Functions
-bool J1708::begin(int port_number, int baud, int rx_led, int tx_led){
+// UART Table - every Teensy 4.x hardware serial port and its default LED pins (-1 - none)
+struct J1708UART {
+  int port;
+  J1708SerialPort *serial;
+  int rxLED;
+  int txLED;
+};
+
+static const J1708UART J1708UARTs[] = {
+  {1, &Serial1, -1, -1},
+  {2, &Serial2, -1, -1},
+  {3, &Serial3, 13, 12},
+  {4, &Serial4,  5,  6},
+  {5, &Serial5,  3,  4},
+  {6, &Serial6, -1, -1},
+  {7, &Serial7, -1, -1},
+#if defined(ARDUINO_TEENSY41) || defined(J1708_HOST)
+  {8, &Serial8, -1, -1},
+#endif
+};
+
+bool J1708Core::begin(int port_number, int baud, int rx_led, int tx_led){
   /*
     Setup UART Connection
-    1 - Reserved Print console
-    2 - Reserved Future use
-    3 - Default J1708
-    4 - Secondary J1708
-    5 - Free
-    6 - -
-    7 - -
+    Serial (USB) is the print console. Ports 3 and 4 are used by the examples.
+    Alternate pins are taken from RxPin and TxPin.
   */
-  if (port_number==3){
-    _streamRef = &Serial3;
-    _streamRef->begin(baud);
-    selfPN = port_number;
-  }
-  else if (port_number==4){
-    _streamRef = &Serial4;
-    _streamRef->begin(baud);
-    Serial4.begin(baud);
-    selfPN = port_number;
-    tx_led=6;
-    rx_led=5;
-  }
-  else if (port_number==5){
-    _streamRef = &Serial5;
-    _streamRef->begin(baud);
-    Serial5.begin(baud);
-    selfPN = port_number;
-    tx_led=4;
-    rx_led=3;
+  const J1708UART *uart = NULL;
+  for (unsigned int i=0; i<sizeof(J1708UARTs)/sizeof(J1708UARTs[0]); i++){
+    if (J1708UARTs[i].port==port_number){
+      uart = &J1708UARTs[i];
+      break;
+    }
   }
-  else{
+  if (uart==NULL){
     return false;
   }
+  _streamRef = uart->serial;
+  if (RxPin>=0){
+    _streamRef->setRX(RxPin);
+  }
+  if (TxPin>=0){
+    _streamRef->setTX(TxPin);
+  }
+  if (RxMemorySize>0){
+    _streamRef->addMemoryForRead(RxMemory,RxMemorySize);
+  }
+  RxCapacity = J1708_SERIAL_RX_BUFFER+RxMemorySize;
+  _streamRef->begin(baud);
+  selfPN = port_number;
+  //Persistent Configuration
+  ConfigRestored = J1708ConfigLoad();
   //Rx Pin Configuration
-  RxLED = rx_led;
-  pinMode(RxLED,OUTPUT);
-  digitalWrite(RxLED,RxLEDState);
+  RxLED = rx_led==PinDefault ? uart->rxLED : rx_led;
+  if (RxLED>=0){
+    pinMode(RxLED,OUTPUT);
+    digitalWrite(RxLED,RxLEDState);
+  }
+  else {
+    RxLEDOn = false;
+  }
   //Tx Pin Configuration
-  TxLED = tx_led;
-  pinMode(TxLED,OUTPUT);
-  digitalWrite(TxLED,TxLEDState);
+  TxLED = tx_led==PinDefault ? uart->txLED : tx_led;
+  if (TxLED>=0){
+    pinMode(TxLED,OUTPUT);
+    digitalWrite(TxLED,TxLEDState);
+  }
+  else {
+    TxLEDOn = false;
+  }
   pinMode(SEC_ERR_LED,OUTPUT);
   digitalWrite(SEC_ERR_LED,SEC_ERR_LEDState);
-  selfACL[selfMID]=true;
+  selfACL.set(selfMID);
+  if (!ConfigRestored){
+    //Nothing to save until the defaults are changed
+    J1708Config config;
+    J1708ConfigBuild(config);
+    ConfigSavedCRC = config.crc;
+    ConfigPendingCRC = config.crc;
+  }
+#if defined(J1708_PROFILE)
+  J1708CyclesBegin();
+#endif
   return true;
 }
 
-void J1708::link(J1708 *_j1708Object){
+void J1708Core::link(J1708Core *_j1708Object){
   _j1708Ref = _j1708Object;
   J1708Object_Linked = true;
   Rx_Forwarding = true;
 }
 
-void J1708::unlink(){
+void J1708Core::unlink(){
   J1708Object_Linked = false;
   Rx_Forwarding = false;
-  delete _j1708Ref;
+  _j1708Ref = NULL;
 }
 
 // Primary Functions
-uint8_t J1708::J1708Rx(uint8_t (&J1708RxFrame)[RxBufferSize]){
-  if (_streamRef->available()){
+uint8_t J1708Core::J1708Rx(uint8_t (&J1708RxFrame)[RxBufferSize]){
+  J1708_PROFILE_ZONE(ZoneRx);
+  int waiting = _streamRef->available();
+  bool backlogEnd = false;
+  if (waiting){
+    if (waiting>RxFillMax){
+      RxFillMax = waiting;
+    }
+    if (!ERR11_RxOverrun && ERR11_Before==0 && J1708RxOverrun(*_streamRef,RxCapacity)){
+      //Bytes were lost after the ones waiting. The frame around the gap is dropped.
+      ERR11_Before = waiting;
+      ERR_Counter++;
+      ERR11_Counter++;
+      if (ShowErrors){
+        Serial.print("ERR11:");
+        Serial.print("[");Serial.print(ERR_Counter);Serial.println("] ");
+      }
+    }
     J1708Timer = 0; //Reset the RX message timer for J1708 message framing
     J1708TxTimer = 0;
     J1708ByteCount++; // Increment the recieved byte counts
+    if (J1708ByteCount==1){
+      J1708FrameTime = J1708Time();
+    }
     TotalByteCount++; // Include self transmitted or forwarded messages in calculation
     rx_busy = true;
     
     if (J1708ByteCount < sizeof(J1708RxBuffer)){ //Ensure the RX buffer can handle the new messages
       J1708RxBuffer[J1708ByteCount] = _streamRef->read();
       J1708Checksum += J1708RxBuffer[J1708ByteCount];
+      if (ERR11_Before>0 && --ERR11_Before==0){
+        //Last byte before the gap. Only an idle bus can tell where the damage ends.
+        ERR11_RxOverrun = true;
+      }
+      //A byte that waited behind others has lost the idle time after it, so frames are split by layout
+      RxBacklog |= waiting>1;
+      backlogEnd = RxBacklog && !ERR11_RxOverrun && J1708RxSplit();
     }
     else{
       //This is what we do if we don't have room in the RX buffer., "J1708 Buffer Overflow"
@@ -149,6 +423,7 @@ uint8_t J1708::J1708Rx(uint8_t (&J1708RxFrame)[RxBufferSize]){
       ERR_Counter++;
       ERR2_Counter++;
       J1708ByteCount = 0;
+      RxBacklog = false;
       rx_busy = false;
       J1708TxTimer = 0;
       if (ERR2_MID_Hold<0){
@@ -162,30 +437,41 @@ uint8_t J1708::J1708Rx(uint8_t (&J1708RxFrame)[RxBufferSize]){
   }
 
   //Check to see if a message has been framed?
-  if (J1708Timer > twelvebit && J1708ByteCount > 0){
+  if ((J1708Timer > twelvebit || backlogEnd) && J1708ByteCount > 0){
     J1708FrameLength = J1708ByteCount;
     J1708ByteCount = 0; //reset the counter
+    RxBacklog = false;
+    RX_Split_Counter += backlogEnd;
     
     J1708Checksum -= J1708RxBuffer[J1708FrameLength]; //remove the received Checksum byte (last one)
     J1708Checksum = (~J1708Checksum + 1) & 0xFF; // finish calculating the checksum
     bool J1708ChecksumOK = J1708Checksum == J1708RxBuffer[J1708FrameLength];
     
-    if (ERR2_RxOverflow){
-      //Spilled over data from ERR2
+    if (ERR2_RxOverflow || ERR11_RxOverrun){
+      //Spilled over data from ERR2, or frames merged around the bytes lost by ERR11
       J1708Checksum = 0;
       rx_busy = false;
       ERR2_RxOverflow = false;
-      MIDByteCount[ERR2_MID_Hold] += J1708FrameLength;
+      ERR11_RxOverrun = false;
+      if (MIDByteCount){
+        MIDByteCount[ERR2_MID_Hold>=0 ? ERR2_MID_Hold : J1708RxBuffer[1]] += J1708FrameLength;
+      }
       ERR2_MID_Hold = -1;
       return 0;
     }
 
+    if (CaptureRing && !CaptureFrozen){
+      J1708CaptureAdd(J1708RxBuffer,J1708FrameLength,J1708FrameTime);
+    }
+
     if (J1708ChecksumOK) {
       ERR1_Checksum = false;
       ERR2_RxOverflow = false;
       rx_busy = false;
       RX_Counter++;
-      MIDByteCount[J1708RxBuffer[1]] += J1708FrameLength;
+      if (MIDByteCount){
+        MIDByteCount[J1708RxBuffer[1]] += J1708FrameLength;
+      }
       ERR2_MID_Hold = -1;
       return J1708FrameLength;
     }
@@ -200,7 +486,9 @@ uint8_t J1708::J1708Rx(uint8_t (&J1708RxFrame)[RxBufferSize]){
         Serial.print("ERR1 ");  //debug
         Serial.print("[");Serial.print(ERR_Counter);Serial.println("] ");
       }
-      MIDByteCount[J1708RxBuffer[1]] += J1708FrameLength;
+      if (MIDByteCount){
+        MIDByteCount[J1708RxBuffer[1]] += J1708FrameLength;
+      }
       ERR2_MID_Hold = -1;
       return 0; //data would not be valid, so pretend it didn't come
     }
@@ -210,7 +498,53 @@ uint8_t J1708::J1708Rx(uint8_t (&J1708RxFrame)[RxBufferSize]){
   }
 }
 
-void J1708::J1708AppendChecksum(uint8_t J1708TxData[],const uint8_t &TxFrameLength){
+bool J1708Core::J1708RxSplit(){
+  // True if the frame read so far is a whole J1587 frame: its checksum completes, at least one
+  // parameter ends just before the checksum, and the next waiting byte, if any, can be a J1587 MID
+  // (128-255). This is a guess from the layout, as the idle time between buffered frames is lost:
+  //  - A frame that starts with a shorter frame of valid layout and checksum, followed by a byte
+  //    of 128 or more, is split in two. Each part then fails the echo, ACL and cache checks it would
+  //    have passed as a whole.
+  //  - Frames of MIDs below 128 (J1708 proprietary) have no known layout and are never split.
+  //    Back to back they run together until the bus goes idle or the buffer overflows (ERR2).
+  if (J1708Checksum!=0 || J1708ByteCount<3 || J1708RxBuffer[1]<128){
+    return false;
+  }
+  int next = _streamRef->peek();
+  if (next>=0 && next<128){
+    return false;
+  }
+  int end = J1708ByteCount;   // Index of the checksum
+  int i = 2;
+  while (i<end){
+    uint8_t pid = J1708RxBuffer[i];
+    if (pid==255){
+      //Page 2, the PID follows the escape
+      if (++i>=end){
+        return false;
+      }
+      pid = J1708RxBuffer[i];
+    }
+    if (pid<128){
+      i += 2;
+    }
+    else if (pid<192){
+      i += 3;
+    }
+    else if (pid<254){
+      if (i+1>=end){
+        return false;
+      }
+      i += 2+J1708RxBuffer[i+1];
+    }
+    else {
+      return true;   // PID 254, data to the end of the frame
+    }
+  }
+  return i==end;
+}
+
+void J1708Core::J1708AppendChecksum(uint8_t J1708TxData[],const uint8_t &TxFrameLength){
   uint8_t chk = 0;
   for (int i=0; i<(TxFrameLength-1);i++){
     chk+=J1708TxData[i];
@@ -219,7 +553,8 @@ void J1708::J1708AppendChecksum(uint8_t J1708TxData[],const uint8_t &TxFrameLeng
   J1708TxData[TxFrameLength-1] = chk;
 }
 
-bool J1708::J1708Tx(uint8_t J1708TxData[], const uint8_t &TxFrameLength, const uint8_t &TxFramePriority, bool AutoChecksum){ 
+bool J1708Core::J1708Tx(uint8_t J1708TxData[], const uint8_t &TxFrameLength, const uint8_t &TxFramePriority, bool AutoChecksum){
+  J1708_PROFILE_ZONE(ZoneTx);
   //Max bytes in a J1708 frame is 21.
   tx_busy = true;
   //Append checksum
@@ -255,7 +590,7 @@ bool J1708::J1708Tx(uint8_t J1708TxData[], const uint8_t &TxFrameLength, const u
       tx_busy = false;
       ERR4_Collision = false;
       TX_Counter++;
-      tx_transmitting=true;
+      J1708EchoAdd(J1708TxData,TxFrameLength);
       return 1;
     }
     else{
@@ -287,37 +622,21 @@ bool J1708::J1708Tx(uint8_t J1708TxData[], const uint8_t &TxFrameLength, const u
   return 0;
 }
 
-bool J1708::J1708Send(uint8_t J1708TxData[], const int &TxFrameLength, const int &TxFramePriority){
-  if (N_TxQ_Total < TxQmax){
-    if (TxQueuePenalty > 0){
-      TxQueuePenalty--;
-    }
-    if (N_TxS==TxQmax-1){
-      memcpy(J1708TxQ[N_TxS], J1708TxData, TxFrameLength);
-      J1708TxQLengths[N_TxS] = TxFrameLength;
-      J1708TxQPriorities[N_TxS] = TxFramePriority;
-      N_TxQ_Total++;
-      N_TxS=0;
-      ERR3_Tx_Overflow = false;
-      return 1;
-    }
-    else {
-      memcpy(J1708TxQ[N_TxS], J1708TxData, TxFrameLength);
-      J1708TxQLengths[N_TxS] = TxFrameLength;
-      J1708TxQPriorities[N_TxS] = TxFramePriority;
-      N_TxQ_Total++;
-      N_TxS++;
-      ERR3_Tx_Overflow = false;
-      return 1;
-    }
+bool J1708Core::J1708Send(uint8_t J1708TxData[], const int &TxFrameLength, const int &TxFramePriority, bool AutoChecksum){
+  if (J1708TxQFree()>0 && TxFrameLength>0){
+    memcpy(J1708TxQ[N_TxS], J1708TxData, TxFrameLength);
+    J1708TxQLengths[N_TxS] = TxFrameLength;
+    J1708TxQPriorities[N_TxS] = TxFramePriority;
+    J1708TxQFlags[N_TxS] = AutoChecksum ? TxQAutoChecksum : 0;
+    N_TxQ_Total++;
+    N_TxS = (N_TxS+1) % TxQmax;
+    ERR3_Tx_Overflow = false;
+    return 1;
   }
   else {
     ERR3_Tx_Overflow = true;
     ERR_Counter++;
     ERR3_Counter++;
-    if (TxQueuePenalty < TxQmaxMaxPenalty){
-      TxQueuePenalty ++;
-    }
     if (ShowErrors){
       Serial.print("ERR3:");
       Serial.print("[");Serial.print(ERR_Counter);Serial.println("] ");
@@ -326,1308 +645,3900 @@ bool J1708::J1708Send(uint8_t J1708TxData[], const int &TxFrameLength, const int
   }
 }
 
-bool J1708::RTS_Handler(uint8_t TP_Data[]){
-  //Serial.print("RTS Handler Started [");Serial.print(selfMID);Serial.println("]");
-  uint8_t D_MID=TP_Data[1];
-  if (!TP_Rx_Flag && !TP_Tx_Flag){
-    TP_Rx_NSegments=TP_Data[6];
-    uint16_t TP_Rx_NBytes = ( (uint16_t)TP_Data[8]<<8 ) | ( (uint16_t)TP_Data[7] );
-    //Sanity check
-    if (TP_Rx_NSegments>0 && TP_Rx_NBytes>0){
-      if (TP_Rx_NBytes<=256){
-        //Good to go...
-        uint8_t CTS_message[8] = {selfMID,197,4,D_MID,2,TP_Rx_NSegments,1,0};
-        J1708Send(CTS_message,8,8);
-        TP_Rx_Flag = true;
-        TP_Session_MID = D_MID;
-        TP_Session_Timer = 0;
-        return 1;
-        //Serial.print("RTS Handler Complete [");Serial.print(selfMID);Serial.println("]");
+int J1708Core::J1708TxQFree(){
+  return TxQmax-N_TxQ_Total-N_TxQ_Holes;
+}
+
+int J1708Core::J1708TxQNext(){
+  // Slot of the next frame to send, -1 if none. Without shaping this is the head of the queue.
+  // Otherwise the oldest frame whose buckets hold tokens.
+  if (N_TxQ_Total==0){
+    return -1;
+  }
+  if (!ShapeOn){
+    return N_TxQ;
+  }
+  if (ShapeSweepTimer>=ShapeSweepMillis){
+    J1708ShapeSweep();
+  }
+  uint16_t now = millis();
+  for (int k=0, slot=N_TxQ; k<N_TxQ_Total+N_TxQ_Holes; k++, slot=(slot+1)%TxQmax){
+    if (J1708TxQLengths[slot]==0){
+      continue;
+    }
+    uint8_t mid = J1708TxQ[slot][0];
+    uint8_t priority = J1708TxQPriorities[slot]<=8 ? J1708TxQPriorities[slot] : 8;
+    ShapeBucket *bucket = NULL;
+    if (ShapeMIDs){
+      uint16_t rate, burst;
+      J1708ShapeBudget(mid,rate,burst);
+      if (rate>0){
+        bucket = &ShapeMIDs[mid];
+        J1708ShapeRefill(*bucket,rate,burst,now);
       }
-      else{
-        //Restricting to 256 for now to save memory; Protocol max is 3825-bytes. Abort the request.
-        uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
-        J1708Send(Abort_msg,6,8);
-        TP_Rx_Flag = false;
-        return 0;
+    }
+    ShapeBucket *pbucket = NULL;
+    if (ShapePriority && ShapePriorityRate[priority]>0){
+      pbucket = &ShapePriority[priority];
+      J1708ShapeRefill(*pbucket,ShapePriorityRate[priority],ShapePriorityBurst[priority],now);
+    }
+    if ((bucket && bucket->tokens<=0) || (pbucket && pbucket->tokens<=0)){
+      if (!(J1708TxQFlags[slot] & TxQHeld)){
+        J1708TxQFlags[slot] |= TxQHeld;
+        SHAPE_Held_Counter++;
+        ShapeBucket *blocking = (bucket && bucket->tokens<=0) ? bucket : pbucket;
+        if (blocking->held<0xFFFF){
+          blocking->held++;
+        }
       }
+      continue;
     }
-    else{
-      //Malformed request. Abort.
-      uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
-      J1708Send(Abort_msg,6,8);
-      TP_Rx_Flag = false;
-      return 0;
+    return slot;
+  }
+  return -1;
+}
+
+void J1708Core::J1708TxQRemove(const int &slot){
+  // Called once the frame in slot is on the wire. Its characters are taken from its buckets.
+  if (ShapeOn){
+    int32_t cost = J1708TxQLengths[slot]*1000;   // The queued length includes the checksum
+    uint16_t rate, burst;
+    J1708ShapeBudget(J1708TxQ[slot][0],rate,burst);
+    if (ShapeMIDs && rate>0){
+      ShapeMIDs[J1708TxQ[slot][0]].tokens -= cost;
+    }
+    uint8_t priority = J1708TxQPriorities[slot]<=8 ? J1708TxQPriorities[slot] : 8;
+    if (ShapePriority && ShapePriorityRate[priority]>0){
+      ShapePriority[priority].tokens -= cost;
     }
   }
-  else{
-    //Serial.print("RTS is busy but received request. [");Serial.print(selfMID);Serial.println("]");
-    //Busy with another connection. Abort the request for now.
-    uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
-    J1708Send(Abort_msg,6,8);
-    return 0;
+  N_TxQ_Total--;
+  if (slot!=N_TxQ){
+    //Sent ahead of a held frame. Leave a hole for the head to skip.
+    SHAPE_Bypass_Counter++;
+    J1708TxQLengths[slot] = 0;
+    N_TxQ_Holes++;
+    return;
+  }
+  N_TxQ = (N_TxQ+1) % TxQmax;
+  while (N_TxQ_Holes>0 && J1708TxQLengths[N_TxQ]==0){
+    N_TxQ = (N_TxQ+1) % TxQmax;
+    N_TxQ_Holes--;
   }
 }
 
-bool J1708::CTS_Handler(uint8_t TP_Data[]){
-  //Serial.print("CTS Handler Started [");Serial.print(selfMID);Serial.println("]");
-  uint8_t D_MID=TP_Data[1];
-  if (TP_Tx_Flag && D_MID==TP_Session_MID){
-    uint8_t TP_NSegments=TP_Data[6];
-    uint8_t TP_StartSegment=TP_Data[7];
-    uint8_t TP_NBytes=TP_Tx_NBytes; 
-    int N=0;
+void J1708Core::J1708ShapeReset(){
+  // Fills every bucket to its burst
+  uint16_t now = millis();
+  for (int i=0; i<256 && ShapeMIDs; i++){
+    uint16_t rate, burst;
+    J1708ShapeBudget(i,rate,burst);
+    ShapeMIDs[i].tokens = burst*1000;
+    ShapeMIDs[i].last = now;
+  }
+  for (int i=0; i<9 && ShapePriority; i++){
+    ShapePriority[i].tokens = ShapePriorityBurst[i]*1000;
+    ShapePriority[i].last = now;
+  }
+  ShapeSweepTimer = 0;
+  ShapeOn = ShapeMIDRate>0 || N_ShapeRules>0;
+  for (int i=0; i<9 && ShapePriority; i++){
+    ShapeOn |= ShapePriorityRate[i]>0;
+  }
+}
 
-    //Sanity Check - Is request actually logical relative to RTS
-    if (TP_NSegments <= TP_Tx_NSegments && TP_StartSegment<=TP_Tx_NSegments){
-      //Good to go
-      for (int i=TP_StartSegment; i<TP_NSegments+TP_StartSegment; i++){
-        //Do we have enough data to fill up TP_Default_Segment_Size?
-        if (TP_NBytes>=TP_Default_Segment_Size){
-          //Yes...
-          N = TP_Default_Segment_Size;
-          Q_Lengths[i-1] = N+5+1;
-          Q_Matrix[i-1][0]=selfMID;
-          Q_Matrix[i-1][1]=198;
-          Q_Matrix[i-1][2]=N+2;
-          Q_Matrix[i-1][3]=D_MID;
-          Q_Matrix[i-1][4]=i;
-          for(int j=0; j<N;j++){
-            Q_Matrix[i-1][j+5] = TP_Tx_Buffer[j+(N*(i-1))];
-            TP_NBytes--;
-          }
-        }
-        else{
-          //No, this is the last segment. It has less than the max TP_Default_Segment_Size amount of data. 
-          N = TP_NBytes;
-          Q_Lengths[i-1] = N+5+1;
-          Q_Matrix[i-1][0]=selfMID;
-          Q_Matrix[i-1][1]=198;
-          Q_Matrix[i-1][2]=N+2;
-          Q_Matrix[i-1][3]=D_MID;
-          Q_Matrix[i-1][4]=i;
-          for (int k=0; k<N; k++){
-            Q_Matrix[i-1][k+5] = TP_Tx_Buffer[k+(TP_Default_Segment_Size*(i-1))];
-            TP_NBytes--;
-          }
-        }
-      }
-      //Serial.print("CTS Handler Complete [");Serial.print(selfMID);Serial.println("]");
-      Q_flag = true;
-      return 1;
+void J1708Core::J1708ShapeSweep(){
+  // Bucket times are 16-bit ms. Refilling every bucket well within 65 s keeps a bucket that was
+  // left alone from seeing a wrapped gap and staying held. A longer gap means nothing refilled
+  // the buckets meanwhile, so they are all full.
+  if (ShapeSweepTimer>0xFFFF){
+    J1708ShapeReset();
+    return;
+  }
+  uint16_t now = millis();
+  for (int i=0; i<256 && ShapeMIDs; i++){
+    uint16_t rate, burst;
+    J1708ShapeBudget(i,rate,burst);
+    if (rate>0){
+      J1708ShapeRefill(ShapeMIDs[i],rate,burst,now);
     }
-    //Bad CTS request. Abort the request and session.
-    uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
-    J1708Send(Abort_msg,6,8);
-    TP_Tx_Flag = false;
-    TP_Tx_NBytes=0;
-    TP_Tx_NSegments=0;
-    Q_Counter=0;
-    Q_flag=false;
-    return 0;
   }
-  else{
-    //Serial.print("CTS handler received request but is busy or did not expext CTS. [");Serial.print(selfMID);Serial.println("]");
-    //Not in an active connection or busy with another connection. Abort the request for now.
-    uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
-    J1708Send(Abort_msg,6,8);
-    return 0;
+  for (int i=0; i<9; i++){
+    if (ShapePriority && ShapePriorityRate[i]>0){
+      J1708ShapeRefill(ShapePriority[i],ShapePriorityRate[i],ShapePriorityBurst[i],now);
+    }
   }
+  ShapeSweepTimer = 0;
 }
 
-bool J1708::CDP_Handler(uint8_t TP_Data[]){
-  // Serial.print("CDP Handler Started [");Serial.print(selfMID);Serial.println("]");
-  uint8_t D_MID=TP_Data[1];
-  if (TP_Rx_Flag && TP_Session_MID==D_MID){
-    uint8_t TP_NBytes=TP_Data[3]; 
-    uint8_t TP_SegmentNumber=TP_Data[5];
-    uint8_t TP_Start=(TP_SegmentNumber-1)*TP_Default_Segment_Size;
+void J1708Core::J1708ShapeRefill(ShapeBucket &bucket, const uint16_t &rate, const uint16_t &burst, const uint16_t &now){
+  uint16_t dt = now-bucket.last;
+  if (dt==0){
+    return;
+  }
+  bucket.last = now;
+  int32_t tokens = bucket.tokens + (int32_t)rate*dt;   // rate characters/s for dt ms, in 1/1000 characters
+  bucket.tokens = tokens>(int32_t)burst*1000 ? (int32_t)burst*1000 : tokens;
+}
 
-    //Here is where aditional CTS messages could be sent if malformed
-    //data is received.
-    for (int i=0; i<(TP_NBytes-2); i++){
-      TP_Rx_Buffer[TP_Start+i] = TP_Data[i+6];
-    }
-    if (TP_SegmentNumber==TP_Rx_NSegments){
-      uint8_t EOM_message[6] = {selfMID,197,2,D_MID,3};
-      J1708Send(EOM_message,6,8);
-      //Reset all Variables and Flags
-      TP_Rx_Flag = false;
-      TP_Rx_NBytes=0;
-      TP_Rx_NSegments=0;
-      // Serial.print("CDP Handler Complete [");Serial.print(selfMID);Serial.println("]");
-      return 1;
+void J1708Core::J1708ShapeBudget(const uint8_t &mid, uint16_t &rate, uint16_t &burst){
+  for (int i=0; i<N_ShapeRules; i++){
+    if (ShapeRules[i].mid==mid){
+      rate = ShapeRules[i].rate;
+      burst = ShapeRules[i].burst;
+      return;
     }
-    //Serial.print("CDP Handler is expecting more data Segments. [");Serial.print(selfMID);Serial.println("]");
-    //Request the next batch of data segments or wait.
-    return 0;
   }
-  else{
-    //CDP Received but not in an active session/busy with another one. Abort.
-    TP_Rx_Flag = false;
-    TP_Rx_NBytes=0;
-    TP_Rx_NSegments=0;
-    uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
-    J1708Send(Abort_msg,6,8);
+  rate = ShapeMIDRate;
+  burst = ShapeMIDBurst;
+}
+
+bool J1708Core::J1708SendAt(uint8_t J1708TxData[], const int &TxFrameLength, const int &TxFramePriority, const uint32_t &SendTime){
+  // Holds the frame until micros() reaches SendTime, then queues it with J1708Send.
+  if (J1708TxSched==NULL || N_TxSched>=TxSchedSize || TxFrameLength>21){
+    ERR3_Tx_Overflow = true;
+    ERR_Counter++;
+    ERR3_Counter++;
     return 0;
   }
+  memcpy(J1708TxSched[N_TxSched], J1708TxData, TxFrameLength);
+  J1708TxSchedLengths[N_TxSched] = TxFrameLength;
+  J1708TxSchedPriorities[N_TxSched] = TxFramePriority;
+  J1708TxSchedTimes[N_TxSched] = SendTime;
+  N_TxSched++;
+  return 1;
 }
 
-void J1708::EOM_Handler(uint8_t TP_Data[]){
-  //Serial.print("EOM Handler Started [");Serial.print(selfMID);Serial.println("]");
-  uint8_t D_MID=TP_Data[1];
-  if (TP_Tx_Flag && D_MID==TP_Session_MID){
-    //Reset all TP_Tx variables and Flags. End Session.
-    TP_Tx_Flag = false;
-    TP_Tx_NBytes=0;
-    TP_Tx_NSegments=0;
-    Q_Counter=0;
-    Q_flag=false;
-  }
-  else{
-    //We received an EOM that is not related to our ongoing session.
-    //Tell them to Abort. (not really necessary)
-    uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
-    J1708Send(Abort_msg,6,8);
+void J1708Core::J1708ServiceSchedule(){
+  uint32_t now = micros();
+  int i = 0;
+  while (i<N_TxSched){
+    if ((int32_t)(now-J1708TxSchedTimes[i])>=0 && J1708TxQFree()>0){
+      J1708Send(J1708TxSched[i],J1708TxSchedLengths[i],J1708TxSchedPriorities[i]);
+      //Fill the gap with the last entry. Frames due at the same time keep no particular order.
+      N_TxSched--;
+      if (i!=N_TxSched){
+        memcpy(J1708TxSched[i], J1708TxSched[N_TxSched], J1708TxSchedLengths[N_TxSched]);
+        J1708TxSchedLengths[i] = J1708TxSchedLengths[N_TxSched];
+        J1708TxSchedPriorities[i] = J1708TxSchedPriorities[N_TxSched];
+        J1708TxSchedTimes[i] = J1708TxSchedTimes[N_TxSched];
+      }
+    }
+    else {
+      i++;
+    }
   }
-  //Serial.print("EOM Handler Complete [");Serial.print(selfMID);Serial.println("]");
 }
 
-void J1708::Abort_Handler(uint8_t TP_Data[]){
-  //Serial.print("Abort Handler Started [");Serial.print(selfMID);Serial.println("]");
-  uint8_t D_MID=TP_Data[1];
-  if ((TP_Tx_Flag && D_MID==TP_Session_MID) || (TP_Rx_Flag && D_MID==TP_Session_MID)){
-    //Reset all TP_Tx and TP_Rx variables and flags
-    TP_Rx_Flag = false;
-    TP_Rx_NBytes=0;
-    TP_Rx_NSegments=0;
-    TP_Tx_Flag = false;
-    TP_Tx_NBytes=0;
-    TP_Tx_NSegments=0;
-    Q_Counter=0;
-    Q_flag=false;
-  }
-  else{
-    //We received an Abort that is not related to our ongoing session.
-    //Ignore it.
+bool J1708Core::J1708ReplayAdd(const uint8_t J1708Message[], const uint8_t &MessageLength, const uint32_t &CaptureTime){
+  // J1708Message is the MID and data without checksum, like a line printed by J1708Listen.
+  if (J1708Replay==NULL || N_ReplayTotal>=ReplaySize || MessageLength<1 || MessageLength>20){
+    return false;
   }
-  //Serial.print("Abort Handler Complete [");Serial.print(selfMID);Serial.println("]");
+  uint8_t slot = (N_ReplayHead+N_ReplayTotal) % ReplaySize;
+  memcpy(J1708Replay[slot], J1708Message, MessageLength);
+  J1708ReplayLengths[slot] = MessageLength+1;
+  J1708ReplayTimes[slot] = CaptureTime;
+  N_ReplayTotal++;
+  return true;
 }
 
-bool J1708::J1708CheckChecksum(uint8_t J1708Message[],const uint8_t &FrameLength){
-  uint8_t chk = 0;
-  for (int i=0; i<(FrameLength-1);i++){
-    chk+=J1708Message[i];
-  }
-  chk=((~chk<<24)>>24)+1;
-  if (J1708Message[FrameLength]==chk){
-    return 1;
+bool J1708Core::J1708ReplayAddLine(const char *line){
+  // Accepts a line printed by J1708Listen, e.g. "(1234567) SP3 [5] 80 54 40 BE"
+  // The time is required. Port, length, checksum, busload and MID share fields are skipped.
+  const char *p = line;
+  while (*p==' '){
+    p++;
   }
-  else{
-    return 0;
+  if (*p!='('){
+    return false;
   }
-}
-
-bool J1708::J1708CheckACL(const uint8_t &mid){
-  if (tx_transmitting){
+  char *end;
+  uint32_t captureTime = strtoul(p+1,&end,10);
+  if (end==p+1 || *end!=')'){
     return false;
   }
-  if (selfACL[mid]){
-    if (mid==selfMID){
-      SEC_ERR_Counter++;
-      digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
-      ERR_Counter++;
-      ERR7_Counter++;
-      ERR7_IDCounter[mid]++;
-      if (ERR7_IDCounter[selfMID]<=ERR7_Limit){
-        uint8_t msg[10] = {selfMID,255,255,250,4,1,selfMID,(uint8_t)((ERR7_IDCounter[selfMID]<<8)>>8),(uint8_t)(ERR7_IDCounter[selfMID]>>8),0};
-        J1708Send(msg,10,8);
+  p = end+1;
+  uint8_t msg[20];
+  uint8_t n = 0;
+  while (*p){
+    if (*p==' '){
+      p++;
+    }
+    else if (p[0]=='S' && p[1]=='P'){
+      //Port field
+      while (*p && *p!=' '){
+        p++;
       }
-      else if (ERR7_IDCounter[selfMID]==ERR7_Limit+1){
-        ERR8_Tracker[selfMID] = true;
-        ERR8_Counter++;
-        ERR_Counter++;
-        SEC_ERR_Counter++;
-        digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
+    }
+    else if (*p=='[' && n==0){
+      //Length field
+      while (*p && *p!=' '){
+        p++;
       }
-      if (ERR8_Timer > ERR8_Interval && ERR8_Tracker[selfMID] == true){
-        uint8_t msg[9] = {selfMID,255,255,250,3,2,selfMID,(uint8_t)ERR8_Counter,0};
-        J1708Send(msg,9,3);
-        ERR8_Timer = 0;
+    }
+    else if (isHexadecimalDigit(p[0]) && isHexadecimalDigit(p[1]) && (p[2]==' ' || p[2]=='\0' || p[2]=='\r' || p[2]=='\n')){
+      if (n>=20){
+        return false;
       }
+      msg[n++] = strtoul(p,NULL,16) & 0xFF;
+      p += 2;
+    }
+    else {
+      //Trailing fields
+      break;
+    }
+  }
+  return J1708ReplayAdd(msg,n,captureTime);
+}
+
+void J1708Core::J1708ReplayStart(){
+  if (N_ReplayTotal==0){
+    return;
+  }
+  N_ReplayPos = 0;
+  ReplayBase = micros();
+  ReplayFirstTime = J1708ReplayTimes[N_ReplayHead];
+  ReplayDriftLast = 0;
+  ReplayDriftMax = 0;
+  ReplayDriftTotal = 0;
+  REPLAY_Counter = 0;
+  REPLAY_Retry_Counter = 0;
+  ReplayOn = true;
+}
+
+void J1708Core::J1708ReplayStop(){
+  ReplayOn = false;
+}
+
+void J1708Core::J1708ReplayReset(){
+  ReplayOn = false;
+  N_ReplayHead = 0;
+  N_ReplayTotal = 0;
+  N_ReplayPos = 0;
+}
+
+bool J1708Core::J1708ReplayService(){
+  // Sends the next captured frame once its scheduled time has come and the bus has been idle for 12 bits.
+  // Bypasses the Tx queue and priority delay so relative timing stays within a bit time of the capture.
+  if (N_ReplayPos>=N_ReplayTotal){
+    if (N_ReplayTotal==0 || !ReplayLoop){
+      //Streamed frames may still arrive. Pick them up from the current schedule.
+      return false;
     }
+    //Start the next pass right after the last frame of this one.
+    uint8_t last = (N_ReplayHead+N_ReplayTotal-1) % ReplaySize;
+    ReplayBase += (uint32_t)((J1708ReplayTimes[last]-ReplayFirstTime)/ReplaySpeed) + twelvebit;
+    ReplayFirstTime = J1708ReplayTimes[N_ReplayHead];
+    N_ReplayPos = 0;
+  }
+  uint8_t slot = (N_ReplayHead+N_ReplayPos) % ReplaySize;
+  uint32_t due = ReplayBase + (uint32_t)((J1708ReplayTimes[slot]-ReplayFirstTime)/ReplaySpeed);
+  uint32_t now = micros();
+  if ((int32_t)(now-due)<0 || J1708TxTimer<=twelvebit){
     return false;
   }
+  if (!J1708Tx(J1708Replay[slot],J1708ReplayLengths[slot],8)){
+    //Collision or not sent (ERR4/ERR5). Keep the frame for the next idle bus.
+    REPLAY_Retry_Counter++;
+    return true;
+  }
+  ReplayDriftLast = (int32_t)(now-due);
+  if ((uint32_t)ReplayDriftLast>ReplayDriftMax){
+    ReplayDriftMax = ReplayDriftLast;
+  }
+  ReplayDriftTotal += ReplayDriftLast;
+  REPLAY_Counter++;
+  if (ReplayLoop){
+    N_ReplayPos++;
+  }
+  else {
+    //Streaming. Free the slot for the next frame.
+    N_ReplayHead = (N_ReplayHead+1) % ReplaySize;
+    N_ReplayTotal--;
+  }
   return true;
 }
 
-void J1708::UpdateNetworkStatistics(){
-  if (BusloadTimer>1000){
-    // Two calculation methods see Thesis Chapter 5:
-    //   1.) Absolute Max: Assuming buad of 9600 -> max 10bit characters in one second = 960.0
-    //   2.) Protocol Max: Assuming buad of 9600, J1708 message overhead, 21-byte messages -> max 10bit characters in one second = 903.0
-    busload = (float)TotalByteCount/903.0;
-    
-    for (int i=0;i<=255;i++){
-      MIDShareTracker[i] = (float)MIDByteCount[i]/(float)TotalByteCount;
-      MIDByteCount[i] = 0;
+bool J1708Core::J1708GenAddECU(const uint8_t &mid, const uint8_t pids[], const uint8_t &nPids, const uint16_t &period, const uint8_t &priority){
+  if (GenECUs==NULL || nPids<1 || nPids>GenPIDSize || period==0){
+    return false;
+  }
+  for (int i=0; i<GenECUSize; i++){
+    if (!GenECUs[i].used){
+      GenECU &ecu = GenECUs[i];
+      ecu.used = true;
+      ecu.mid = mid;
+      ecu.priority = priority;
+      memcpy(ecu.pids, pids, nPids);
+      ecu.nPids = nPids;
+      ecu.period = period;
+      //Spread the first broadcasts over one period so ECUs do not start in lockstep
+      ecu.next = micros() + random(period)*1000;
+      ecu.counter = 0;
+      return true;
     }
-    
-    BusloadTimer = 0;
-    TotalByteCount = 0;
   }
+  return false;
 }
 
-void J1708::J1708CheckNetwork(){
-  if (ERR6_Timer > 500){
-    if (busload>maxBusload){
-      ERR6_Counter++;
-      ERR_Counter++;
-      ERR6_HighBusload = true;
-      ERR6_ConsecutiveCounter++;
-      if (ERR6_ConsecutiveCounter>ERR6_ConsecutiveMax){
-        for (int i=0;i<=255;i++){
-          if (MIDShareTracker[i]>maxMIDShare){
-            // Flooding Caught
-            if (selfHostPort==false){
-              // ...on the shared network (ERR9)
-              if (!ERR9_Tracker[i]){
-                ERR9_Tracker[i]=true;
-                ERR9_Counter++;
-                ERR_Counter++;
-                SEC_ERR_Counter++;
-                digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
-                J1708UpdateACL(i,true);
-                uint8_t msg[8] = {selfMID,255,255,250,2,3,(uint8_t)i,0};
-                J1708Send(msg,8,1);
-                // Dual-side alert - Not necessary
-                // if (J1708Object_Linked && Rx_Forwarding){
-                //   _j1708Ref->J1708Send(msg,8,1);
-                // }
-              }
-            }
-            else{
-              // ...on the host network (ERR10)
-              if (!ERR10_Tracker[i]){
-                ERR10_Tracker[i]=true;
-                ERR10_Counter++;
-                ERR_Counter++;
-                SEC_ERR_Counter++;
-                digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
-                J1708UpdateACL(i,true);
-                uint8_t msg[8] = {selfMID,255,255,250,2,4,(uint8_t)i,0};
-                if (J1708Object_Linked && Rx_Forwarding){
-                  _j1708Ref->J1708Send(msg,8,1);
-                }
-                // Dual-side alert - Not necessary
-                // J1708Send(msg,8,1);
-              }
-            }
-          }
-        }
+void J1708Core::J1708GenDefault(){
+  // A small tractor: engine, transmission, brakes and instrument cluster (J1587 MIDs and PIDs)
+  const uint8_t engineFast[] = {190, 92, 84};        // Engine speed, percent load, road speed
+  const uint8_t engineSlow[] = {110, 100, 174, 245}; // Coolant temp, oil pressure, fuel temp, total distance
+  const uint8_t transmission[] = {191, 161, 127};    // Output shaft speed, input shaft speed, oil pressure
+  const uint8_t brakes[] = {49, 84};                 // ABS status, road speed
+  const uint8_t cluster[] = {96, 245};               // Fuel level, total distance
+  J1708GenReset();
+  J1708GenAddECU(128,engineFast,sizeof(engineFast),100);
+  J1708GenAddECU(128,engineSlow,sizeof(engineSlow),1000);
+  J1708GenAddECU(130,transmission,sizeof(transmission),100);
+  J1708GenAddECU(136,brakes,sizeof(brakes),200);
+  J1708GenAddECU(140,cluster,sizeof(cluster),1000);
+}
+
+void J1708Core::J1708GenReset(){
+  GenOn = false;
+  if (GenECUs==NULL){
+    return;
+  }
+  for (int i=0; i<GenECUSize; i++){
+    GenECUs[i].used = false;
+  }
+}
+
+void J1708Core::J1708GenStart(){
+  if (GenECUs==NULL){
+    //Generator compiled out
+    return;
+  }
+  uint32_t now = micros();
+  for (int i=0; i<GenECUSize; i++){
+    if (GenECUs[i].used){
+      GenECUs[i].next = now + random(GenECUs[i].period)*1000;
+    }
+  }
+  GenRate = 1.0;
+  GenControlTimer = 0;
+  GenBurstTimer = 0;
+  GenTPTimer = 0;
+  GEN_Counter = 0;
+  GEN_Skipped_Counter = 0;
+  GenSkippedLast = 0;
+  GEN_Burst_Counter = 0;
+  GEN_TP_Counter = 0;
+  GenOn = true;
+}
+
+void J1708Core::J1708GenStop(){
+  GenOn = false;
+}
+
+uint8_t J1708Core::J1708GenBroadcast(GenECU &ecu){
+  // Packs the ECU's PIDs into frames of at most 20 bytes (MID and data) and queues them.
+  // Values are synthetic ramps, sized by PID class: <128 one byte, 128-191 two bytes, 192-253 counted.
+  uint8_t msg[21];
+  uint8_t n = 1;
+  uint8_t frames = 0;
+  msg[0] = ecu.mid;
+  ecu.counter++;
+  for (int i=0; i<ecu.nPids; i++){
+    uint8_t pid = ecu.pids[i];
+    uint8_t size = pid<128 ? 2 : (pid<192 ? 3 : 6);
+    if (n+size>20){
+      if (J1708Send(msg,n+1,ecu.priority)){
+        frames++;
       }
+      n = 1;
     }
-    else{
-      ERR6_HighBusload = false;
-      ERR6_ConsecutiveCounter = 0;
+    uint8_t value = ecu.counter + pid;
+    msg[n++] = pid;
+    if (pid>=192){
+      msg[n++] = 4;
+      msg[n++] = value;
+      msg[n++] = value>>1;
+      msg[n++] = 0;
+      msg[n++] = 0;
+    }
+    else if (pid>=128){
+      msg[n++] = value;
+      msg[n++] = 0x10;
+    }
+    else {
+      msg[n++] = value;
     }
-    ERR6_Timer = 0;
   }
-  if (TP_Rx_Flag || TP_Tx_Flag){
-    if (TP_Session_Timer > 10000){
-      //Abort the current session
-      TP_Rx_Flag = false;
-      TP_Rx_NBytes=0;
-      TP_Rx_NSegments=0;
-      TP_Tx_Flag = false;
-      TP_Tx_NBytes=0;
-      TP_Tx_NSegments=0;
-      Q_Counter=0;
-      Q_flag=false;
-      uint8_t Abort_msg[6] = {selfMID,197,2,TP_Session_MID,255,0};
-      J1708Send(Abort_msg,6,8);
+  if (n>1 && J1708Send(msg,n+1,ecu.priority)){
+    frames++;
+  }
+  GEN_Counter += frames;
+  return frames;
+}
+
+void J1708Core::J1708GenService(){
+  if (GenECUs==NULL){
+    GenOn = false;
+    return;
+  }
+  //Close the loop on the measured busload, which includes every other node on the bus
+  if (GenTarget>0.0 && GenControlTimer>1000){
+    float ratio = busload>0.01 ? GenTarget/busload : 2.0;
+    if (ratio>2.0){
+      ratio = 2.0;
+    }
+    else if (ratio<0.5){
+      ratio = 0.5;
+    }
+    if (ratio>1.0 && GEN_Skipped_Counter!=GenSkippedLast){
+      //Saturated. Speeding up would only skip more broadcasts.
+      ratio = 1.0;
     }
+    GenSkippedLast = GEN_Skipped_Counter;
+    //Half a step per second keeps the loop from overshooting the one second busload window
+    GenRate *= 1.0 + 0.5*(ratio-1.0);
+    if (GenRate<0.05){
+      GenRate = 0.05;
+    }
+    else if (GenRate>50.0){
+      GenRate = 50.0;
+    }
+    GenControlTimer = 0;
   }
-  if (SECLEDOn){
-    if (ERR8_Counter>0||ERR9_Counter>0||ERR10_Counter>0){
-      if (SEC_ERR_Timer>1000){
-        if (SEC_ERR_LEDState){
-          digitalWrite(SEC_ERR_LED,HIGH);
-          SEC_ERR_LEDState = false;
-        }
-        else{
-          digitalWrite(SEC_ERR_LED,LOW);
-          SEC_ERR_LEDState = true;
-        }
-        SEC_ERR_Timer = 0;
-      }
+  uint32_t now = micros();
+  for (int i=0; i<GenECUSize; i++){
+    GenECU &ecu = GenECUs[i];
+    if (!ecu.used || (int32_t)(now-ecu.next)<0){
+      continue;
     }
-    else if (SEC_ERR_Counter>0){
-      if (SEC_ERR_Timer>500){
-        if (SEC_ERR_LEDState){
-          digitalWrite(SEC_ERR_LED,LOW);
-          SEC_ERR_LEDState = false;
+    uint32_t interval = (uint32_t)(ecu.period*1000.0/(GenTarget>0.0 ? GenRate : 1.0));
+    if (J1708TxQFree()<=TxQmax-TxQmax/2){
+      //The bus is saturated. Let the queue drain rather than overflow it.
+      GEN_Skipped_Counter++;
+    }
+    else {
+      J1708GenBroadcast(ecu);
+    }
+    ecu.next += interval;
+    if ((int32_t)(now-ecu.next)>0){
+      //Fell behind. Do not chase the backlog.
+      ecu.next = now + interval;
+    }
+  }
+  if (GenBurstPeriod>0 && GenBurstTimer>=GenBurstPeriod){
+    uint8_t frames = 0;
+    for (int tries=0; tries<GenECUSize && frames<GenBurstFrames && J1708TxQFree()>2; ){
+      GenECU &ecu = GenECUs[GenNext];
+      GenNext = (GenNext+1) % GenECUSize;
+      if (ecu.used){
+        uint8_t queued = J1708GenBroadcast(ecu);
+        if (queued==0){
+          //Queue full, e.g. of frames held by shaping
+          break;
         }
+        frames += queued;
+        tries = 0;
+      }
+      else {
+        tries++;
       }
     }
+    GEN_Burst_Counter++;
+    GenBurstTimer = 0;
+  }
+  if (GenTPPeriod>0 && GenTPTimer>=GenTPPeriod && !TP_Tx_Flag && !TP_Rx_Flag){
+    uint8_t data[255];
+    for (int i=0; i<GenTPBytes; i++){
+      data[i] = i + GEN_TP_Counter;
+    }
+    if (J1708TransportTx(data,GenTPBytes,GenTPMID)){
+      GEN_TP_Counter++;
+    }
+    GenTPTimer = 0;
   }
 }
 
-void J1708::J1708ResetACL(bool mode){
-  //Reset ACL
-  for (int i=0; i<256;i++){
-    selfACL[i]=mode;
+// Settings saved with the port, bit n of J1708Config::flags. Append only.
+//   Rx_Forwarding is left out, link() sets it.
+bool J1708Core::* const J1708Core::ConfigFlags[] = {
+  &J1708Core::ShowCommand, &J1708Core::ShowRxData, &J1708Core::ShowTime, &J1708Core::ShowPort,
+  &J1708Core::ShowChecksum, &J1708Core::ShowLength, &J1708Core::ShowErrors, &J1708Core::ShowBusload,
+  &J1708Core::ShowMIDShare, &J1708Core::RxLEDOn, &J1708Core::TxLEDOn, &J1708Core::SECLEDOn,
+  &J1708Core::selfHostPort, &J1708Core::GatewaySpecificProcessing, &J1708Core::ParamCacheOn, &J1708Core::ConfigAutosave,
+  &J1708Core::DedupOn, &J1708Core::ShowOwn,
+  NULL
+};
+
+void J1708Core::J1708ConfigBuild(J1708Config &config){
+  memset((void *)&config,0,sizeof(config));
+  config.magic = J1708Config::Magic;
+  config.version = J1708Config::Version;
+  config.port = selfPN;
+  for (int i=0; ConfigFlags[i]; i++){
+    if (this->*ConfigFlags[i]){
+      config.flags |= 1ul<<i;
+    }
   }
+  config.selfMID = selfMID;
+  config.selfMode = selfMode;
+  config.ERR8_Counter = ERR8_Counter;
+  config.ERR9_Counter = ERR9_Counter;
+  config.ERR10_Counter = ERR10_Counter;
+  config.ERR7_Limit = ERR7_Limit;
+  config.maxBusload = maxBusload;
+  config.maxMIDShare = maxMIDShare;
+  config.ParamCacheMaxAge = ParamCacheMaxAge;
+  config.selfACL = selfACL;
+  config.ERR8_Tracker = ERR8_Tracker;
+  config.ERR9_Tracker = ERR9_Tracker;
+  config.ERR10_Tracker = ERR10_Tracker;
+  config.crc = J1708ConfigCRC(config);
 }
 
-void J1708::J1708UpdateACL(const uint8_t &mid, bool set){
-  selfACL[mid] = set;
+void J1708Core::J1708ConfigApply(const J1708Config &config){
+  for (int i=0; ConfigFlags[i]; i++){
+    this->*ConfigFlags[i] = (config.flags>>i) & 1;
+  }
+  selfMID = config.selfMID;
+  selfMode = (nodeMode)config.selfMode;
+  ERR8_Counter = config.ERR8_Counter;
+  ERR9_Counter = config.ERR9_Counter;
+  ERR10_Counter = config.ERR10_Counter;
+  ERR7_Limit = config.ERR7_Limit;
+  maxBusload = config.maxBusload;
+  maxMIDShare = config.maxMIDShare;
+  ParamCacheMaxAge = config.ParamCacheMaxAge;
+  selfACL = config.selfACL;
+  ERR8_Tracker = config.ERR8_Tracker;
+  ERR9_Tracker = config.ERR9_Tracker;
+  ERR10_Tracker = config.ERR10_Tracker;
 }
 
-int J1708::J1708Parse(){
-  if (!Loop_flag){
-    //Save the current message in the RxBuffer to a more stable 32 byte location.
-    //This also frees the J1708RxBuffer to be used in loop() after J1708Parse() is called.
-    //uint8_t Loopbuffer[32]={};
-    memcpy(Loopbuffer, J1708RxBuffer, 21);
-    //Security Message Handling
-    //Performed as early as possible compared to normal handling
-    if (Loopbuffer[2]==255 && Loopbuffer[3]==255 && Loopbuffer[4]==250){
-      uint8_t security_check = Loopbuffer[6];
-      //Spoof Alert
-      if (security_check==1){
-        ERR7_IDCounter[Loopbuffer[7]]++;
-        SEC_ERR_Counter++;
-        digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
-        ERR_Counter++;
-        ERR7_Counter++;
-        return 0;
+bool J1708Core::J1708ConfigLoad(){
+  // Restores the port's newest valid record. One block read unless that record is damaged.
+  J1708ConfigScan();
+  bool tried[J1708ConfigMaxSlots] = {};
+  while (true){
+    int slot = -1;
+    for (int i=0; i<J1708ConfigSlots; i++){
+      if (J1708ConfigPort[i]==selfPN && !tried[i] && (slot<0 || J1708ConfigSeq[i]>J1708ConfigSeq[slot])){
+        slot = i;
       }
-      else if (security_check==2){
-        if (!ERR8_Tracker[Loopbuffer[7]]){
-          SEC_ERR_Counter++;
-          digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
-          ERR_Counter++;
-          ERR8_Counter++;
-          ERR8_Tracker[Loopbuffer[7]] = true;
+    }
+    if (slot<0){
+      return false;
+    }
+    tried[slot] = true;
+    J1708Config config;
+    EEPROM.get(J1708ConfigAddress(slot),config);
+    if (config.crc!=J1708ConfigCRC(config) || config.port!=selfPN){
+      //Damaged record. Never pick it again.
+      J1708ConfigPort[slot] = 0;
+      continue;
+    }
+    J1708ConfigApply(config);
+    ConfigSlot = slot;
+    ConfigSavedCRC = config.crc;
+    ConfigPendingCRC = config.crc;
+    return true;
+  }
+}
+
+bool J1708Core::J1708ConfigSave(){
+  J1708ConfigScan();
+  J1708Config config;
+  J1708ConfigBuild(config);
+  //Next slot in ring order that is free, stale, or an older record of this port
+  int slot = -1;
+  for (int k=1; k<=J1708ConfigSlots; k++){
+    int i = (J1708ConfigLastSlot+k) % J1708ConfigSlots;
+    if (J1708ConfigPort[i]==0 || !J1708ConfigNewest(i)){
+      slot = i;
+      break;
+    }
+  }
+  if (slot<0){
+    CONFIG_Fail_Counter++;
+    return false;
+  }
+  config.seq = ++J1708ConfigLastSeq;
+  EEPROM.put(J1708ConfigAddress(slot),config);
+  J1708ConfigSeq[slot] = config.seq;
+  J1708ConfigPort[slot] = selfPN;
+  J1708ConfigLastSlot = slot;
+  ConfigSlot = slot;
+  ConfigSavedCRC = config.crc;
+  ConfigPendingCRC = config.crc;
+  CONFIG_Save_Counter++;
+  return true;
+}
+
+void J1708Core::J1708ConfigErase(){
+  // Invalidates every record of this port. The next begin() starts from the defaults.
+  J1708ConfigScan();
+  for (int i=0; i<J1708ConfigSlots; i++){
+    if (J1708ConfigPort[i]==selfPN){
+      EEPROM.put(J1708ConfigAddress(i)+offsetof(J1708Config,magic),(uint16_t)0);
+      J1708ConfigPort[i] = 0;
+    }
+  }
+  ConfigSlot = -1;
+}
+
+void J1708Core::J1708ConfigService(){
+  // Saves once the settings have stopped changing for ConfigSaveDelay
+  ConfigTimer = 0;
+  J1708Config config;
+  J1708ConfigBuild(config);
+  if (config.crc==ConfigSavedCRC){
+    ConfigPendingCRC = config.crc;
+    return;
+  }
+  if (config.crc!=ConfigPendingCRC){
+    ConfigPendingCRC = config.crc;
+    ConfigPendingTimer = 0;
+  }
+  else if (ConfigPendingTimer>=ConfigSaveDelay){
+    J1708ConfigSave();
+  }
+}
+
+void J1708Core::J1708CaptureAdd(const uint8_t frame[], const uint8_t &FrameLength, const uint32_t &time){
+  // frame is laid out like J1708RxBuffer. Frames with a bad checksum are kept too.
+  uint16_t need = FrameLength+5;
+  while (CaptureBytes-CaptureUsed<need){
+    //Drop the oldest record
+    uint8_t oldLength = CaptureRing[CaptureTail];
+    CaptureTail = (CaptureTail+oldLength+5) & (CaptureBytes-1);
+    CaptureUsed -= oldLength+5;
+    CaptureFrames--;
+  }
+  uint8_t record[5] = {FrameLength,(uint8_t)time,(uint8_t)(time>>8),(uint8_t)(time>>16),(uint8_t)(time>>24)};
+  for (int i=0; i<5; i++){
+    CaptureRing[CaptureHead] = record[i];
+    CaptureHead = (CaptureHead+1) & (CaptureBytes-1);
+  }
+  for (int i=1; i<=FrameLength; i++){
+    CaptureRing[CaptureHead] = frame[i];
+    CaptureHead = (CaptureHead+1) & (CaptureBytes-1);
+  }
+  CaptureUsed += need;
+  CaptureFrames++;
+
+  if (CaptureTriggered){
+    if (CapturePostLeft>0){
+      CapturePostLeft--;
+    }
+    if (CapturePostLeft==0){
+      CaptureTriggered = false;
+      CaptureFrozen = true;
+      J1708CapturePrint();
+    }
+    return;
+  }
+  if (CaptureMIDs.test(frame[1])){
+    J1708CaptureTrigger("MID");
+  }
+  else if (CapturePatternLength>0 && CapturePatternLength<FrameLength){
+    bool match = true;
+    for (int i=0; i<CapturePatternLength && match; i++){
+      match = (frame[i+1] & CaptureMask[i]) == CapturePattern[i];
+    }
+    if (match){
+      J1708CaptureTrigger("PATTERN");
+    }
+  }
+}
+
+void J1708Core::J1708CaptureTrigger(const char *reason){
+  snprintf(CaptureReason,sizeof(CaptureReason),"%s",reason);
+  CaptureTriggerTime = J1708Time();
+  CAPTURE_Counter++;
+  if (CapturePost==0){
+    CaptureFrozen = true;
+    J1708CapturePrint();
+  }
+  else {
+    CaptureTriggered = true;
+    CapturePostLeft = CapturePost;
+  }
+}
+
+uint32_t J1708Core::J1708ErrorCount(const uint8_t &n){
+  switch (n){
+    case 1: return ERR1_Counter;
+    case 2: return ERR2_Counter;
+    case 3: return ERR3_Counter;
+    case 4: return ERR4_Counter;
+    case 5: return ERR5_Counter;
+    case 6: return ERR6_Counter;
+    case 7: return ERR7_Counter;
+    case 8: return ERR8_Counter;
+    case 9: return ERR9_Counter;
+    case 10: return ERR10_Counter;
+    case 11: return ERR11_Counter;
+    default: return 0;
+  }
+}
+
+void J1708Core::J1708CaptureCheckErrors(){
+  for (uint8_t n=1; n<=ErrorCodes; n++){
+    if (!(CaptureErrMask & (1u<<n))){
+      continue;
+    }
+    uint32_t count = J1708ErrorCount(n);
+    if (count!=CaptureErrSeen[n]){
+      CaptureErrSeen[n] = count;
+      if (CaptureRing && !CaptureTriggered && !CaptureFrozen){
+        char reason[8];
+        sprintf(reason,"ERR%d",n);
+        J1708CaptureTrigger(reason);
+      }
+    }
+  }
+}
+
+void J1708Core::J1708CaptureArm(){
+  // Starts a new window. Frames already in the ring are kept as pre-trigger history.
+  for (uint8_t n=1; n<=ErrorCodes; n++){
+    CaptureErrSeen[n] = J1708ErrorCount(n);
+  }
+  CaptureReason[0] = '\0';
+  CaptureTriggered = false;
+  CaptureFrozen = false;
+}
+
+void J1708Core::J1708CapturePrint(){
+  Serial.print("CAPTURE SP");Serial.println(selfPN);
+  Serial.print("Trigger:");Serial.println(CaptureReason[0] ? CaptureReason : "-");
+  Serial.print("Trigger_Time:");Serial.println(CaptureTriggerTime);
+  uint16_t pos = CaptureTail;
+  for (int k=0; k<CaptureFrames; k++){
+    uint8_t length = CaptureRing[pos];
+    uint32_t time = 0;
+    for (int i=0; i<4; i++){
+      time |= (uint32_t)CaptureRing[(pos+1+i) & (CaptureBytes-1)] << (8*i);
+    }
+    Serial.print("(");Serial.print(time);Serial.print(") ");
+    Serial.print("SP");Serial.print(selfPN);Serial.print(" ");
+    Serial.print("[");Serial.print(length);Serial.print("] ");
+    for (int i=0; i<length; i++){
+      sprintf(hexDisp,"%02X ",CaptureRing[(pos+5+i) & (CaptureBytes-1)]);
+      Serial.print(hexDisp);
+    }
+    Serial.println();
+    pos = (pos+length+5) & (CaptureBytes-1);
+  }
+  Serial.print("END CAPTURE:");Serial.println(CaptureFrames);
+}
+
+bool J1708Core::RTS_Handler(uint8_t TP_Data[]){
+  J1708_PROFILE_ZONE(ZoneRTS);
+  //Serial.print("RTS Handler Started [");Serial.print(selfMID);Serial.println("]");
+  uint8_t D_MID=TP_Data[1];
+  if (!TP_Rx_Flag && !TP_Tx_Flag){
+    TP_Rx_NSegments=TP_Data[6];
+    uint16_t TP_Rx_NBytes = ( (uint16_t)TP_Data[8]<<8 ) | ( (uint16_t)TP_Data[7] );
+    //Sanity check
+    if (TP_Rx_NSegments>0 && TP_Rx_NBytes>0){
+      if (TP_Rx_NBytes<=TPCapacity){
+        //Good to go...
+        uint8_t CTS_message[8] = {selfMID,197,4,D_MID,2,TP_Rx_NSegments,1,0};
+        J1708Send(CTS_message,8,8);
+        TP_Rx_Flag = true;
+        TP_Session_MID = D_MID;
+        TP_Session_Timer = 0;
+        return 1;
+        //Serial.print("RTS Handler Complete [");Serial.print(selfMID);Serial.println("]");
+      }
+      else{
+        //Restricted to TPCapacity (256 max) to save memory; Protocol max is 3825-bytes. Abort the request.
+        //Ports built without transport storage abort every request.
+        uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
+        J1708Send(Abort_msg,6,8);
+        TP_Rx_Flag = false;
+        return 0;
+      }
+    }
+    else{
+      //Malformed request. Abort.
+      uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
+      J1708Send(Abort_msg,6,8);
+      TP_Rx_Flag = false;
+      return 0;
+    }
+  }
+  else{
+    //Serial.print("RTS is busy but received request. [");Serial.print(selfMID);Serial.println("]");
+    //Busy with another connection. Abort the request for now.
+    uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
+    J1708Send(Abort_msg,6,8);
+    return 0;
+  }
+}
+
+bool J1708Core::CTS_Handler(uint8_t TP_Data[]){
+  J1708_PROFILE_ZONE(ZoneCTS);
+  //Serial.print("CTS Handler Started [");Serial.print(selfMID);Serial.println("]");
+  uint8_t D_MID=TP_Data[1];
+  if (TP_Tx_Flag && D_MID==TP_Session_MID){
+    uint8_t TP_NSegments=TP_Data[6];
+    uint8_t TP_StartSegment=TP_Data[7];
+    uint8_t TP_NBytes=TP_Tx_NBytes; 
+    int N=0;
+
+    //Sanity Check - Is request actually logical relative to RTS
+    if (TP_NSegments <= TP_Tx_NSegments && TP_StartSegment<=TP_Tx_NSegments && TP_NSegments+TP_StartSegment-1<=TPSegments){
+      //Good to go
+      for (int i=TP_StartSegment; i<TP_NSegments+TP_StartSegment; i++){
+        //Do we have enough data to fill up TP_Default_Segment_Size?
+        if (TP_NBytes>=TP_Default_Segment_Size){
+          //Yes...
+          N = TP_Default_Segment_Size;
+          Q_Lengths[i-1] = N+5+1;
+          Q_Matrix[i-1][0]=selfMID;
+          Q_Matrix[i-1][1]=198;
+          Q_Matrix[i-1][2]=N+2;
+          Q_Matrix[i-1][3]=D_MID;
+          Q_Matrix[i-1][4]=i;
+          for(int j=0; j<N;j++){
+            Q_Matrix[i-1][j+5] = TP_Tx_Buffer[j+(N*(i-1))];
+            TP_NBytes--;
+          }
+        }
+        else{
+          //No, this is the last segment. It has less than the max TP_Default_Segment_Size amount of data. 
+          N = TP_NBytes;
+          Q_Lengths[i-1] = N+5+1;
+          Q_Matrix[i-1][0]=selfMID;
+          Q_Matrix[i-1][1]=198;
+          Q_Matrix[i-1][2]=N+2;
+          Q_Matrix[i-1][3]=D_MID;
+          Q_Matrix[i-1][4]=i;
+          for (int k=0; k<N; k++){
+            Q_Matrix[i-1][k+5] = TP_Tx_Buffer[k+(TP_Default_Segment_Size*(i-1))];
+            TP_NBytes--;
+          }
+        }
+      }
+      //Serial.print("CTS Handler Complete [");Serial.print(selfMID);Serial.println("]");
+      Q_flag = true;
+      return 1;
+    }
+    //Bad CTS request. Abort the request and session.
+    uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
+    J1708Send(Abort_msg,6,8);
+    TP_Tx_Flag = false;
+    TP_Tx_NBytes=0;
+    TP_Tx_NSegments=0;
+    Q_Counter=0;
+    Q_flag=false;
+    return 0;
+  }
+  else{
+    //Serial.print("CTS handler received request but is busy or did not expext CTS. [");Serial.print(selfMID);Serial.println("]");
+    //Not in an active connection or busy with another connection. Abort the request for now.
+    uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
+    J1708Send(Abort_msg,6,8);
+    return 0;
+  }
+}
+
+bool J1708Core::CDP_Handler(uint8_t TP_Data[]){
+  J1708_PROFILE_ZONE(ZoneCDP);
+  // Serial.print("CDP Handler Started [");Serial.print(selfMID);Serial.println("]");
+  uint8_t D_MID=TP_Data[1];
+  if (TP_Rx_Flag && TP_Session_MID==D_MID){
+    uint8_t TP_NBytes=TP_Data[3]; 
+    uint8_t TP_SegmentNumber=TP_Data[5];
+    uint8_t TP_Start=(TP_SegmentNumber-1)*TP_Default_Segment_Size;
+
+    //Here is where aditional CTS messages could be sent if malformed
+    //data is received.
+    for (int i=0; i<(TP_NBytes-2) && TP_Start+i<TPCapacity; i++){
+      TP_Rx_Buffer[TP_Start+i] = TP_Data[i+6];
+    }
+    if (TP_SegmentNumber==TP_Rx_NSegments){
+      uint8_t EOM_message[6] = {selfMID,197,2,D_MID,3};
+      J1708Send(EOM_message,6,8);
+      //Reset all Variables and Flags
+      TP_Rx_Flag = false;
+      TP_Rx_NBytes=0;
+      TP_Rx_NSegments=0;
+      // Serial.print("CDP Handler Complete [");Serial.print(selfMID);Serial.println("]");
+      return 1;
+    }
+    //Serial.print("CDP Handler is expecting more data Segments. [");Serial.print(selfMID);Serial.println("]");
+    //Request the next batch of data segments or wait.
+    return 0;
+  }
+  else{
+    //CDP Received but not in an active session/busy with another one. Abort.
+    TP_Rx_Flag = false;
+    TP_Rx_NBytes=0;
+    TP_Rx_NSegments=0;
+    uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
+    J1708Send(Abort_msg,6,8);
+    return 0;
+  }
+}
+
+void J1708Core::EOM_Handler(uint8_t TP_Data[]){
+  J1708_PROFILE_ZONE(ZoneEOM);
+  //Serial.print("EOM Handler Started [");Serial.print(selfMID);Serial.println("]");
+  uint8_t D_MID=TP_Data[1];
+  if (TP_Tx_Flag && D_MID==TP_Session_MID){
+    //Reset all TP_Tx variables and Flags. End Session.
+    TP_Tx_Flag = false;
+    TP_Tx_NBytes=0;
+    TP_Tx_NSegments=0;
+    Q_Counter=0;
+    Q_flag=false;
+  }
+  else{
+    //We received an EOM that is not related to our ongoing session.
+    //Tell them to Abort. (not really necessary)
+    uint8_t Abort_msg[6] = {selfMID,197,2,D_MID,255,0};
+    J1708Send(Abort_msg,6,8);
+  }
+  //Serial.print("EOM Handler Complete [");Serial.print(selfMID);Serial.println("]");
+}
+
+void J1708Core::Abort_Handler(uint8_t TP_Data[]){
+  J1708_PROFILE_ZONE(ZoneAbort);
+  //Serial.print("Abort Handler Started [");Serial.print(selfMID);Serial.println("]");
+  uint8_t D_MID=TP_Data[1];
+  if ((TP_Tx_Flag && D_MID==TP_Session_MID) || (TP_Rx_Flag && D_MID==TP_Session_MID)){
+    //Reset all TP_Tx and TP_Rx variables and flags
+    TP_Rx_Flag = false;
+    TP_Rx_NBytes=0;
+    TP_Rx_NSegments=0;
+    TP_Tx_Flag = false;
+    TP_Tx_NBytes=0;
+    TP_Tx_NSegments=0;
+    Q_Counter=0;
+    Q_flag=false;
+  }
+  else{
+    //We received an Abort that is not related to our ongoing session.
+    //Ignore it.
+  }
+  //Serial.print("Abort Handler Complete [");Serial.print(selfMID);Serial.println("]");
+}
+
+bool J1708Core::J1708CheckChecksum(uint8_t J1708Message[],const uint8_t &FrameLength){
+  uint8_t chk = 0;
+  for (int i=0; i<(FrameLength-1);i++){
+    chk+=J1708Message[i];
+  }
+  chk=((~chk<<24)>>24)+1;
+  if (J1708Message[FrameLength]==chk){
+    return 1;
+  }
+  else{
+    return 0;
+  }
+}
+
+void J1708Core::J1708EchoAdd(const uint8_t frame[], const uint8_t &length){
+  if (length>21 || EchoFrames==NULL){
+    return;
+  }
+  if (N_Echo==EchoSize){
+    //Oldest echo overdue. Make room.
+    memmove(EchoFrames[0],EchoFrames[1],sizeof(EchoFrames[0])*(EchoSize-1));
+    memmove(EchoLengths,EchoLengths+1,EchoSize-1);
+    memmove(EchoTimes,EchoTimes+1,sizeof(EchoTimes[0])*(EchoSize-1));
+    N_Echo--;
+    OWN_Lost_Counter++;
+  }
+  memcpy(EchoFrames[N_Echo],frame,length);
+  EchoLengths[N_Echo] = length;
+  EchoTimes[N_Echo] = micros();
+  N_Echo++;
+}
+
+bool J1708Core::J1708EchoMatch(const uint8_t frame[], const uint8_t &length){
+  // True if frame (MID..checksum) is the echo of one sent by this port. It and any older echo are dropped.
+  for (int i=0; i<N_Echo; i++){
+    if (EchoLengths[i]==length && memcmp(EchoFrames[i],frame,length)==0){
+      //Frames of other nodes may be framed before the echo, but own frames echo in order
+      OWN_Lost_Counter += i;
+      N_Echo -= i+1;
+      memmove(EchoFrames[0],EchoFrames[i+1],sizeof(EchoFrames[0])*N_Echo);
+      memmove(EchoLengths,EchoLengths+i+1,N_Echo);
+      memmove(EchoTimes,EchoTimes+i+1,sizeof(EchoTimes[0])*N_Echo);
+      OWN_Counter++;
+      return true;
+    }
+  }
+  J1708EchoExpire();
+  return false;
+}
+
+void J1708Core::J1708EchoExpire(){
+  // An echo is lost once it is overdue and every byte received so far has been framed. Bytes still
+  // waiting after a loop stall may hold it, however late they are read.
+  if (J1708ByteCount>0 || _streamRef->available()>0){
+    return;
+  }
+  uint32_t now = micros();
+  int n = 0;
+  while (n<N_Echo && now-EchoTimes[n]>EchoTimeout){
+    n++;
+  }
+  if (n>0){
+    OWN_Lost_Counter += n;
+    N_Echo -= n;
+    memmove(EchoFrames[0],EchoFrames[n],sizeof(EchoFrames[0])*N_Echo);
+    memmove(EchoLengths,EchoLengths+n,N_Echo);
+    memmove(EchoTimes,EchoTimes+n,sizeof(EchoTimes[0])*N_Echo);
+  }
+}
+
+bool J1708Core::J1708CheckACL(const uint8_t &mid){
+  if (selfACL.test(mid)){
+    if (mid==selfMID){
+      SEC_ERR_Counter++;
+      digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
+      ERR_Counter++;
+      ERR7_Counter++;
+      if (ERR7_IDCounter==NULL){
+        //Spoof counting compiled out
+        return false;
+      }
+      ERR7_IDCounter[mid]++;
+      if (ERR7_IDCounter[selfMID]<=ERR7_Limit){
+        uint8_t msg[10] = {selfMID,255,255,250,4,1,selfMID,(uint8_t)((ERR7_IDCounter[selfMID]<<8)>>8),(uint8_t)(ERR7_IDCounter[selfMID]>>8),0};
+        J1708Send(msg,10,8);
+      }
+      else if (ERR7_IDCounter[selfMID]==ERR7_Limit+1){
+        ERR8_Tracker.set(selfMID);
+        ERR8_Counter++;
+        ERR_Counter++;
+        SEC_ERR_Counter++;
+        digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
+      }
+      if (ERR8_Timer > ERR8_Interval && ERR8_Tracker.test(selfMID)){
+        uint8_t msg[9] = {selfMID,255,255,250,3,2,selfMID,(uint8_t)ERR8_Counter,0};
+        J1708Send(msg,9,3);
+        ERR8_Timer = 0;
+      }
+    }
+    return false;
+  }
+  return true;
+}
+
+void J1708Core::UpdateNetworkStatistics(){
+  J1708_PROFILE_ZONE(ZoneStatistics);
+  if (BusloadTimer>1000){
+    // Two calculation methods see Thesis Chapter 5:
+    //   1.) Absolute Max: Assuming buad of 9600 -> max 10bit characters in one second = 960.0
+    //   2.) Protocol Max: Assuming buad of 9600, J1708 message overhead, 21-byte messages -> max 10bit characters in one second = 903.0
+    busload = (float)TotalByteCount/903.0;
+    
+    memset(TopShares,0,sizeof(TopShares));
+    for (int i=0;i<=255 && MIDShareTracker;i++){
+      MIDShareTracker[i] = (float)MIDByteCount[i]/(float)TotalByteCount;
+      MIDByteCount[i] = 0;
+      //Keep the largest shares, in descending order
+      int k = TopMIDCount;
+      while (k>0 && MIDShareTracker[i]>TopShares[k-1]){
+        k--;
+      }
+      if (k<TopMIDCount){
+        memmove(TopMIDs+k+1,TopMIDs+k,TopMIDCount-k-1);
+        memmove(TopShares+k+1,TopShares+k,sizeof(TopShares[0])*(TopMIDCount-k-1));
+        TopMIDs[k] = i;
+        TopShares[k] = MIDShareTracker[i];
+      }
+    }
+    
+    DedupSavedLoad = (float)DedupWindowBytes/903.0;
+    DedupWindowBytes = 0;
+    BusloadTimer = 0;
+    TotalByteCount = 0;
+  }
+}
+
+void J1708Core::J1708CheckNetwork(){
+  J1708_PROFILE_ZONE(ZoneCheckNetwork);
+  if (ERR6_Timer > 500){
+    if (busload>maxBusload){
+      ERR6_Counter++;
+      ERR_Counter++;
+      ERR6_HighBusload = true;
+      ERR6_ConsecutiveCounter++;
+      if (ERR6_ConsecutiveCounter>ERR6_ConsecutiveMax){
+        //Flood attribution needs the per-MID share (StatsPerMID)
+        for (int i=0;i<=255 && MIDShareTracker;i++){
+          if (MIDShareTracker[i]>maxMIDShare){
+            // Flooding Caught
+            if (selfHostPort==false){
+              // ...on the shared network (ERR9)
+              if (!ERR9_Tracker.test(i)){
+                ERR9_Tracker.set(i);
+                ERR9_Counter++;
+                ERR_Counter++;
+                SEC_ERR_Counter++;
+                digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
+                J1708UpdateACL(i,true);
+                uint8_t msg[8] = {selfMID,255,255,250,2,3,(uint8_t)i,0};
+                J1708Send(msg,8,1);
+                // Dual-side alert - Not necessary
+                // if (J1708Object_Linked && Rx_Forwarding){
+                //   _j1708Ref->J1708Send(msg,8,1);
+                // }
+              }
+            }
+            else{
+              // ...on the host network (ERR10)
+              if (!ERR10_Tracker.test(i)){
+                ERR10_Tracker.set(i);
+                ERR10_Counter++;
+                ERR_Counter++;
+                SEC_ERR_Counter++;
+                digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
+                J1708UpdateACL(i,true);
+                uint8_t msg[8] = {selfMID,255,255,250,2,4,(uint8_t)i,0};
+                if (J1708Object_Linked && Rx_Forwarding){
+                  _j1708Ref->J1708Send(msg,8,1);
+                }
+                // Dual-side alert - Not necessary
+                // J1708Send(msg,8,1);
+              }
+            }
+          }
+        }
+      }
+    }
+    else{
+      ERR6_HighBusload = false;
+      ERR6_ConsecutiveCounter = 0;
+    }
+    ERR6_Timer = 0;
+  }
+  if (TP_Rx_Flag || TP_Tx_Flag){
+    if (TP_Session_Timer > 10000){
+      //Abort the current session
+      TP_Rx_Flag = false;
+      TP_Rx_NBytes=0;
+      TP_Rx_NSegments=0;
+      TP_Tx_Flag = false;
+      TP_Tx_NBytes=0;
+      TP_Tx_NSegments=0;
+      Q_Counter=0;
+      Q_flag=false;
+      uint8_t Abort_msg[6] = {selfMID,197,2,TP_Session_MID,255,0};
+      J1708Send(Abort_msg,6,8);
+    }
+  }
+  if (SECLEDOn){
+    if (ERR8_Counter>0||ERR9_Counter>0||ERR10_Counter>0){
+      if (SEC_ERR_Timer>1000){
+        if (SEC_ERR_LEDState){
+          digitalWrite(SEC_ERR_LED,HIGH);
+          SEC_ERR_LEDState = false;
+        }
+        else{
+          digitalWrite(SEC_ERR_LED,LOW);
+          SEC_ERR_LEDState = true;
+        }
+        SEC_ERR_Timer = 0;
+      }
+    }
+    else if (SEC_ERR_Counter>0){
+      if (SEC_ERR_Timer>500){
+        if (SEC_ERR_LEDState){
+          digitalWrite(SEC_ERR_LED,LOW);
+          SEC_ERR_LEDState = false;
+        }
+      }
+    }
+  }
+}
+
+void J1708Core::J1708ResetACL(bool mode){
+  //Reset ACL
+  selfACL.fill(mode);
+}
+
+void J1708Core::J1708UpdateACL(const uint8_t &mid, bool set){
+  selfACL.set(mid,set);
+}
+
+int J1708Core::ParamCacheSlot(const uint8_t &mid, const uint16_t &pid, bool insert){
+  // Linear probing over a short window keeps both lookups and updates O(1).
+  if (ParamCache==NULL){
+    return -1;
+  }
+  int home = (mid*31 + pid) & (ParamCacheSize-1);
+  int oldest = -1;
+  for (int i=0; i<ParamCacheProbes; i++){
+    int slot = (home+i) & (ParamCacheSize-1);
+    if (!ParamCache[slot].used){
+      return insert ? slot : -1;
+    }
+    if (ParamCache[slot].mid==mid && ParamCache[slot].pid==pid){
+      return slot;
+    }
+    if (oldest<0 || (int32_t)(ParamCache[slot].timestamp-ParamCache[oldest].timestamp)<0){
+      oldest = slot;
+    }
+  }
+  return insert ? oldest : -1;
+}
+
+bool J1708Core::J1708DedupSuppress(const uint8_t J1708Message[], const uint8_t &MessageLength){
+  // J1708Message[0] is the MID, followed by J1587 parameters (no checksum).
+  // True if the frame should not be forwarded. Records the frame otherwise.
+  if (DedupTable==NULL || MessageLength<2){
+    return false;
+  }
+  uint8_t mid = J1708Message[0];
+  uint16_t pid = J1708Message[1];
+  if (pid==255 && MessageLength>2){
+    pid = 256 + J1708Message[2];
+  }
+  if (pid==128 || (pid>=192 && pid<256)){
+    //Requests, transport and variable length parameters are always forwarded
+    return false;
+  }
+  uint32_t hash = 2166136261u;
+  for (int i=0; i<MessageLength; i++){
+    hash = (hash ^ J1708Message[i]) * 16777619u;
+  }
+  uint32_t now = millis();
+  int home = (mid*31 + pid) & (DedupSize-1);
+  int slot = -1;
+  for (int i=0; i<DedupProbes; i++){
+    int k = (home+i) & (DedupSize-1);
+    DedupEntry &e = DedupTable[k];
+    if (!e.used || (e.mid==mid && e.pid==pid)){
+      slot = k;
+      break;
+    }
+    if (slot<0 || (int32_t)(e.timestamp-DedupTable[slot].timestamp)<0){
+      slot = k;
+    }
+  }
+  DedupEntry &e = DedupTable[slot];
+  if (e.used && e.mid==mid && e.pid==pid && e.hash==hash && now-e.timestamp<DedupRefresh){
+    return true;
+  }
+  e.used = true;
+  e.mid = mid;
+  e.pid = pid;
+  e.hash = hash;
+  e.timestamp = now;
+  return false;
+}
+
+void J1708Core::J1708RewriteReset(){
+  if (RewriteMIDMap==NULL){
+    return;
+  }
+  for (int i=0; i<256; i++){
+    RewriteMIDMap[i] = i;
+  }
+  N_RewritePatches = 0;
+  RewritePatchMIDs.fill(false);
+  RewriteOn = false;
+}
+
+void J1708Core::J1708Rewrite(uint8_t J1708Message[], const uint8_t &FrameLength){
+  // J1708Message[0] is the MID, the checksum is at FrameLength-1.
+  // At most RewritePatchSize tests per parameter, so the cost is bounded by the frame length.
+  uint8_t mid = J1708Message[0];
+  uint8_t delta = 0;                       // Sum of the changes, mod 256
+  if (RewritePatchMIDs.test(mid)){
+    int i = 1;
+    int end = FrameLength-1;
+    while (i<end){
+      uint8_t pid = J1708Message[i++];
+      if (pid==255){
+        //Page 2 parameters are not patched. Skip the PID byte and size by class below.
+        if (i>=end){
+          break;
+        }
+        pid = J1708Message[i++];
+        if (pid<128){
+          i += 1;
+        }
+        else if (pid<192){
+          i += 2;
+        }
+        else if (pid<254){
+          i += J1708Message[i]+1;
+        }
+        else {
+          break;
+        }
+        continue;
+      }
+      int n;
+      if (pid<128){
+        n = 1;
+      }
+      else if (pid<192){
+        n = 2;
+      }
+      else if (pid<254){
+        n = J1708Message[i++];
+      }
+      else {
+        n = end-i;
+      }
+      for (int k=0; k<N_RewritePatches; k++){
+        RewritePatch &p = RewritePatches[k];
+        if (p.mid!=mid || p.pid!=pid){
+          continue;
+        }
+        for (int b=0; b<p.len && b<n && i+b<end; b++){
+          uint8_t before = J1708Message[i+b];
+          uint8_t after = (before & ~p.mask[b]) | (p.value[b] & p.mask[b]);
+          J1708Message[i+b] = after;
+          delta += after-before;
+        }
+      }
+      i += n;
+    }
+  }
+  J1708Message[0] = RewriteMIDMap[mid];
+  delta += J1708Message[0]-mid;
+  if (delta!=0){
+    //The bytes of a frame, checksum included, sum to zero
+    J1708Message[FrameLength-1] -= delta;
+    REWRITE_Counter++;
+  }
+}
+
+void J1708Core::J1708CacheUpdate(const uint8_t J1708Message[], const uint8_t &MessageLength){
+  // J1708Message[0] is the MID, followed by J1587 parameters (no checksum).
+  if (ParamCache==NULL){
+    return;
+  }
+  uint8_t mid = J1708Message[0];
+  uint32_t now = millis();
+  int i = 1;
+  while (i<MessageLength){
+    uint16_t pid = J1708Message[i++];
+    if (pid==255){
+      //Page 2 parameter. The next byte is the actual PID.
+      if (i>=MessageLength){
+        return;
+      }
+      pid = 256 + J1708Message[i++];
+    }
+    uint8_t pidLow = pid & 0xFF;
+    int n;
+    if (pidLow<128){
+      n = 1;
+    }
+    else if (pidLow<192){
+      n = 2;
+    }
+    else if (pidLow<254){
+      //Variable length parameter. The next byte is the data length.
+      if (i>=MessageLength){
+        return;
+      }
+      n = J1708Message[i++];
+    }
+    else {
+      //Data link escape. The rest of the frame belongs to this PID.
+      n = MessageLength-i;
+    }
+    if (i+n>MessageLength || n>ParamMaxLength){
+      //Malformed parameter. Stop here.
+      return;
+    }
+    int slot = ParamCacheSlot(mid,pid,true);
+    ParamCache[slot].used = true;
+    ParamCache[slot].mid = mid;
+    ParamCache[slot].pid = pid;
+    ParamCache[slot].len = n;
+    ParamCache[slot].timestamp = now;
+    memcpy(ParamCache[slot].value, J1708Message+i, n);
+    PARAM_Counter++;
+    i += n;
+  }
+}
+
+bool J1708Core::J1708CacheLookup(const uint8_t &mid, const uint16_t &pid, uint8_t value[], uint8_t &len, uint32_t &age){
+  int slot = ParamCacheSlot(mid,pid,false);
+  if (slot<0){
+    return false;
+  }
+  len = ParamCache[slot].len;
+  age = millis()-ParamCache[slot].timestamp;
+  memcpy(value, ParamCache[slot].value, len);
+  return true;
+}
+
+void J1708Core::J1708CacheReset(){
+  for (int i=0; i<ParamCacheSize && ParamCache; i++){
+    ParamCache[i].used = false;
+  }
+  PARAM_Counter = 0;
+}
+
+void J1708Core::J1708CachePrint(int mid, int pid){
+  // Prints every cached value, or only those matching mid/pid when they are >=0.
+  Serial.println("PARAMETER CACHE");
+  Serial.println("MID:PID:Age_ms:Data");
+  uint32_t now = millis();
+  for (int i=0; i<ParamCacheSize && ParamCache; i++){
+    ParamEntry &entry = ParamCache[i];
+    if (!entry.used || (mid>=0 && entry.mid!=mid) || (pid>=0 && entry.pid!=pid)){
+      continue;
+    }
+    //Hex, the notation -q takes. Page 2 PIDs follow their escape, FF.
+    char key[12];
+    sprintf(key,entry.pid>255 ? "%02X:FF.%02X:" : "%02X:%02X:",entry.mid,entry.pid & 0xFF);
+    Serial.print(key);
+    Serial.print(now-entry.timestamp);Serial.print(":");
+    for (int j=0; j<entry.len; j++){
+      sprintf(hexDisp,"%02X ",entry.value[j]);
+      Serial.print(hexDisp);
+    }
+    Serial.println();
+  }
+}
+
+bool J1708Core::J1708AnswerRequest(const uint8_t J1708Message[], const uint8_t &MessageLength){
+  // Answers a PID 128 request for another component with the value cached on the linked port.
+  // J1708Message: <requester MID> 128 <requested PID> <component MID>
+  if (MessageLength!=4 || J1708Message[1]!=128 || !J1708Object_Linked){
+    return false;
+  }
+  uint8_t pid = J1708Message[2];
+  uint8_t mid = J1708Message[3];
+  if (mid==selfMID){
+    //Requests for the gateway itself are handled by J1708Parse
+    return false;
+  }
+  uint8_t value[ParamMaxLength];
+  uint8_t len;
+  uint32_t age;
+  if (!_j1708Ref->J1708CacheLookup(mid,pid,value,len,age) || age>ParamCacheMaxAge){
+    REQ_Forwarded_Counter++;
+    return false;
+  }
+  uint8_t msg[21];
+  uint8_t n = 0;
+  msg[n++] = mid;
+  msg[n++] = pid;
+  if (pid>=192 && pid<254){
+    msg[n++] = len;
+  }
+  if (n+len+1>21){
+    REQ_Forwarded_Counter++;
+    return false;
+  }
+  memcpy(msg+n, value, len);
+  n += len;
+  if (!J1708Send(msg,n+1,8)){
+    REQ_Forwarded_Counter++;
+    return false;
+  }
+  REQ_Answered_Counter++;
+  return true;
+}
+
+int J1708Core::J1708Parse(){
+  if (!Loop_flag){
+    //Save the current message in the RxBuffer to a more stable 32 byte location.
+    //This also frees the J1708RxBuffer to be used in loop() after J1708Parse() is called.
+    //uint8_t Loopbuffer[32]={};
+    memcpy(Loopbuffer, J1708RxBuffer, 21);
+    //Security Message Handling
+    //Performed as early as possible compared to normal handling
+    if (Loopbuffer[2]==255 && Loopbuffer[3]==255 && Loopbuffer[4]==250){
+      uint8_t security_check = Loopbuffer[6];
+      //Spoof Alert
+      if (security_check==1){
+        if (ERR7_IDCounter){
+          ERR7_IDCounter[Loopbuffer[7]]++;
+        }
+        SEC_ERR_Counter++;
+        digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
+        ERR_Counter++;
+        ERR7_Counter++;
+        return 0;
+      }
+      else if (security_check==2){
+        if (!ERR8_Tracker.test(Loopbuffer[7])){
+          SEC_ERR_Counter++;
+          digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
+          ERR_Counter++;
+          ERR8_Counter++;
+          ERR8_Tracker.set(Loopbuffer[7]);
+        }
+        J1708UpdateACL(Loopbuffer[7],true);
+        return 0;
+      }
+      else if (security_check==3){
+        if (!ERR9_Tracker.test(Loopbuffer[7])){
+          SEC_ERR_Counter++;
+          digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
+          ERR_Counter++;
+          ERR9_Counter++;
+        }
+        J1708UpdateACL(Loopbuffer[7],true);
+        return 0;
+      }
+      else if (security_check==4){
+        if (!ERR10_Tracker.test(Loopbuffer[7])){
+          SEC_ERR_Counter++;
+          digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
+          ERR_Counter++;
+          ERR10_Counter++;
+        }
+        J1708UpdateACL(Loopbuffer[7],true);
+        return 0;
+      }
+      else {
+        //Received a malformed Security message
+        //Do nothing...
+        return 0;
+      }
+    }
+    //Normal Message Pre-Processing
+    if (GatewaySpecificProcessing){
+      switch(Loopbuffer[2]){ //PID
+        case 128:
+          //Serial.println("PID 128 Received!"); //debug
+          if (selfMID==Loopbuffer[4]){
+            //Component-Specific Request Parameter handler
+            //Requests for other components are answered from cache in J1708AnswerRequest
+          }
+          return 0;
+          break;
+        case 197:
+          //Serial.println("PID 197 Received!"); //debug
+          if (Loopbuffer[4]==selfMID){
+            switch(Loopbuffer[5]){
+              case 1:
+                //Serial.println("RTS Received!");//debug
+                //Run RTS Handler
+                return 1;
+                break;
+              case 2:
+                //Serial.println("CTS Received!");//debug
+                //Run CTS Handler
+                return 2;
+                break;
+              case 3:
+                //Serial.println("EOM Received!");//debug
+                //Run EOM Handler
+                return 3;
+                break;
+              case 255:
+                //Serial.println("Abort Received!");//debug
+                //Run Abort Handler
+                return 4;
+                break;
+            }
+          }
+          return 0;
+          break;
+        case 198:
+          //Serial.println("PID 198 Received!"); //debug
+          if (Loopbuffer[4]==selfMID){
+            //Serial.println("CDP Received!"); //debug
+            //CDPHandler
+            return 5;
+            break;
+          }
+        default:
+          break;
+      }
+      return 0;
+    }
+    else{
+      return 0;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+void J1708Core::J1708Listen(){
+  J1708_PROFILE_ZONE(ZoneListen);
+  J1708WatchEnter(PhaseRx);
+  if (J1708Rx(J1708RxBuffer)>0){
+    bool own = J1708ListenFrame();
+    //The printing loop used to add the data bytes back into the running
+    //checksum, which brings it to zero for the next frame.
+    J1708Checksum = 0;
+    if (!own || ShowOwn){
+      J1708WatchEnter(PhaseLog);
+      J1708Display(J1708RxBuffer,J1708FrameLength,J1708FrameTime);
+    }
+    if (!own){
+      J1708ListenParse();
+    }
+  }
+  else{
+    J1708ListenTx();
+  }
+  J1708ListenPeriodic();
+}
+
+bool J1708Core::J1708ListenFrame(){
+  // ACL, cache and forwarding of the frame in J1708RxBuffer. True if it is the echo of an own frame,
+  // which is only counted and, if shown, displayed.
+  bool own = N_Echo>0 && J1708EchoMatch(J1708RxBuffer+1,J1708FrameLength);
+  if (!own && J1708CheckACL(J1708RxBuffer[1])){
+    if (ParamCacheOn){
+      J1708CacheUpdate(J1708RxBuffer+1,J1708FrameLength-1);
+    }
+    if (J1708Object_Linked){
+      if (Rx_Forwarding){
+        if (GatewaySpecificProcessing && ParamCacheMaxAge>0 && J1708AnswerRequest(J1708RxBuffer+1,J1708FrameLength-1)){
+          //Request answered locally. Nothing to forward.
+        }
+        else if (DedupOn && J1708DedupSuppress(J1708RxBuffer+1,J1708FrameLength-1)){
+          //Unchanged since it was last forwarded
+          DEDUP_Suppressed_Counter++;
+          DEDUP_Saved_Bytes += J1708FrameLength;
+          DedupWindowBytes += J1708FrameLength;
+        }
+        else if (RewriteOn){
+          //The received checksum is valid and is kept up to date by the rewrite
+          uint8_t frame[RxBufferSize];
+          memcpy(frame,J1708RxBuffer+1,J1708FrameLength);
+          J1708Rewrite(frame,J1708FrameLength);
+          _j1708Ref->J1708Send(frame,J1708FrameLength,0,false);
+          FWD_Counter++;
+        }
+        else {
+          _j1708Ref->J1708Send(J1708RxBuffer+1,J1708FrameLength,0,false);
+          FWD_Counter++;
+        }
+      }
+    }
+  }
+  if (RxLEDOn){
+    if (RxLEDState){
+      RxLEDState = false;
+      digitalWrite(RxLED,RxLEDState);
+    }
+    else{
+      RxLEDState = true;
+      digitalWrite(RxLED,RxLEDState);
+    }
+  }
+  return own;
+}
+
+void J1708Core::J1708ListenParse(){
+  // Transport protocol parsing of the frame in J1708RxBuffer
+  J1708WatchEnter(PhaseParse);
+  if (J1708LoopTimer>P){
+    if (fx!=0){
+      switch(fx){
+        case 1:
+          RTS_Handler(Loopbuffer);
+          break;
+        case 2:
+          CTS_Handler(Loopbuffer);
+          break;
+        case 3:
+          EOM_Handler(Loopbuffer);
+          break;
+        case 4:
+          Abort_Handler(Loopbuffer);
+          break;
+        case 5:
+          CDP_Handler(Loopbuffer);
+          break;
+        default:
+          break;
+      }
+      fx=0;
+      P =C_Rate;
+      Loop_flag = false;
+    }
+    else{
+      P = N_Rate;
+      fx = J1708Parse();
+      if (fx>0){
+        Loop_flag = true;
+      }
+      else{
+        Loop_flag=false;
+      }
+    }
+    J1708LoopTimer = 0;
+  }
+  else {
+    if (fx>0){
+      //Wait Until next scheduled send.
+    }
+    else{
+      fx = J1708Parse();
+      if (fx>0){
+        Loop_flag = true;
+      }
+      else{
+        Loop_flag=false;
+      }
+    }    
+  }
+}
+
+void J1708Core::J1708ListenTx(){
+  // Bus access while no frame is being received, and transport replies
+  if (N_Echo>0 && !rx_busy){
+    J1708EchoExpire();
+  }
+  //Check if a message is in the middle of being received (ie is the line idle?)
+  if (!rx_busy){
+    J1708WatchEnter(PhaseTx);
+    int slot = Q_flag ? -1 : J1708TxQNext();
+    uint8_t priority = slot>=0 ? J1708TxQPriorities[slot] : 8;
+    if (ReplayOn && J1708ReplayService()){
+      // A captured frame was due and has been sent
+    }
+    else if (J1708TxTimer > twelvebit+(onebit*priority*2)){
+      // Transport CTS Messages (queue #1)
+      if (Q_flag){
+        uint8_t Q_Message[Q_Lengths[Q_Counter]] = {};
+        for (int i=0;i<Q_Lengths[Q_Counter];i++){
+          Q_Message[i] = Q_Matrix[Q_Counter][i];
+        }
+        J1708Tx(Q_Message,Q_Lengths[Q_Counter],8);
+        if (Q_Counter+1==TP_Tx_NSegments){
+          Q_flag=false;
+          Q_Counter = 0;
+        }
+        else{
+          Q_Counter++;
+        }
+      }
+      // Tx Queue Logic (queue #2)
+      else if (slot>=0){
+        J1708Tx(J1708TxQ[slot],J1708TxQLengths[slot],J1708TxQPriorities[slot],J1708TxQFlags[slot] & TxQAutoChecksum);
+        J1708TxQRemove(slot);
+      }
+    }
+  }
+  //Is there a relevant message in the loopbuffer that needs to be handled?
+  if (fx!=0){
+    J1708WatchEnter(PhaseParse);
+    switch(fx){
+      case 1:
+        RTS_Handler(Loopbuffer);
+        break;
+      case 2:
+        CTS_Handler(Loopbuffer);
+        break;
+      case 3:
+        EOM_Handler(Loopbuffer);
+        break;
+      case 4:
+        Abort_Handler(Loopbuffer);
+        break;
+      case 5:
+        CDP_Handler(Loopbuffer);
+        break;
+      default:
+        break;
+    }
+    fx=0;
+    P =C_Rate;
+    Loop_flag = false;
+  }
+}
+
+void J1708Core::J1708ListenPeriodic(){
+  //Periodic Tasks
+  J1708WatchEnter(PhaseStats);
+  J1708UpdateStep(StepSchedule);
+  J1708UpdateStep(StepGenerator);
+  J1708UpdateStep(StepNetwork);
+}
+
+void J1708Core::J1708UpdateStep(const uint8_t &step){
+  switch (step){
+    case StepSchedule:
+      if (N_TxSched>0){
+        J1708ServiceSchedule();
+      }
+      break;
+    case StepGenerator:
+      if (GenOn){
+        J1708GenService();
+      }
+      break;
+    case StepNetwork:
+      UpdateNetworkStatistics();
+      J1708CheckNetwork();
+      if (ERR8_Timer > ERR8_Interval && ERR7_IDCounter && ERR7_IDCounter[selfMID]>ERR7_Limit){
+        uint8_t msg[9] = {selfMID,255,255,250,3,2,selfMID,(uint8_t)ERR8_Counter,0};
+        J1708Send(msg,9,3);
+        ERR8_Timer = 0;
+      }
+      break;
+    case StepCapture:
+      if (CaptureErrMask && !CaptureTriggered && !CaptureFrozen){
+        J1708CaptureCheckErrors();
+      }
+      break;
+    case StepConfig:
+      if (ConfigAutosave && ConfigTimer>=ConfigCheckInterval && _streamRef){
+        J1708ConfigService();
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+bool J1708Core::J1708TransportTx(uint8_t TP_Data[], const uint16_t &nBytes, const uint8_t &D_MID){
+  if (!TP_Tx_Flag && !TP_Rx_Flag){
+    if (nBytes>21 && nBytes<256 && nBytes<=TPCapacity){
+      int whole_seg = nBytes/TP_Default_Segment_Size;
+      int part_seg = nBytes%TP_Default_Segment_Size;
+      int seg = whole_seg;
+      if (part_seg>1){
+        seg++;
+      }
+      if (seg>TPSegments){
+        return 0;
+      }
+      TP_Tx_NBytes=nBytes;
+      TP_Tx_NSegments=seg;
+      TP_Session_MID = D_MID;
+      //Load Data into buffer
+      for (int i=0; i<nBytes; i++){
+        TP_Tx_Buffer[i] = TP_Data[i];
+      }
+      uint8_t RTS_message[] = {selfMID,197,5,D_MID,1,(uint8_t)seg,(uint8_t)((nBytes<<8)>>8),(uint8_t)(nBytes>>8),0};
+      J1708Send(RTS_message,9,8);
+      TP_Tx_Flag = true;
+      TP_Session_Timer = 0;
+      return 1;
+    }
+    else{
+      //Small enough message to send in normal frame.
+      return 0;
+    }
+  }
+  else{
+    //Busy with another connection or data too large for TP_Tx_Buffer.
+    return 0;
+  }
+}
+
+void J1708Core::J1708FilterCompile(){
+  FilterMIDOn = false;
+  FilterPIDOn = false;
+  for (int i=0; i<8; i++){
+    FilterMIDOn |= FilterMIDs.bits[i]!=0;
+    FilterPIDOn |= FilterPIDs.bits[i]!=0;
+  }
+  FilterOn = FilterMIDOn || FilterPIDOn || FilterLengths!=0xFFFFFFFF || FilterPatternLength>0;
+}
+
+bool J1708Core::J1708FilterAccept(const uint8_t frame[], const uint8_t &FrameLength){
+  // frame is laid out like J1708RxBuffer. Cheapest tests first.
+  if (FrameLength>31 || !((FilterLengths>>FrameLength) & 1)){
+    return false;
+  }
+  if (FilterMIDOn && !FilterMIDs.test(frame[1])){
+    return false;
+  }
+  if (FilterPatternLength>0){
+    if (FilterPatternLength>=FrameLength){
+      return false;
+    }
+    for (int i=0; i<FilterPatternLength; i++){
+      if ((frame[i+1] & FilterMask[i])!=FilterPattern[i]){
+        return false;
+      }
+    }
+  }
+  if (!FilterPIDOn){
+    return true;
+  }
+  //Any PID of the frame. Data bytes are skipped by PID class.
+  int i = 2;
+  while (i<FrameLength){
+    uint8_t pid = frame[i++];
+    if (FilterPIDs.test(pid)){
+      return true;
+    }
+    if (pid==255){
+      if (i>=FrameLength){
+        return false;
+      }
+      pid = frame[i++];
+    }
+    if (pid<128){
+      i += 1;
+    }
+    else if (pid<192){
+      i += 2;
+    }
+    else if (pid<254){
+      i += (i<FrameLength) ? frame[i]+1 : 1;
+    }
+    else {
+      return false;
+    }
+  }
+  return false;
+}
+
+void J1708Core::J1708Display(const uint8_t frame[], const uint8_t &FrameLength, const uint32_t &time){
+  // Display filter, then sampling, then the merge or the console
+  if (FilterOn && !J1708FilterAccept(frame,FrameLength)){
+    FILTER_Rejected_Counter++;
+    return;
+  }
+  uint16_t suppressed = 0;
+  if (SampleMIDs && SampleMode!=SampleOff){
+    J1708SampleCheck();
+    if (SampleActive){
+      SampleMID &m = SampleMIDs[frame[1]];
+      uint16_t now = millis();
+      bool print = SampleEvery>0 ? m.suppressed+1>=SampleEvery : (uint16_t)(now-m.last)>=SampleInterval;
+      if (!print){
+        if (m.suppressed<0xFFFF){
+          m.suppressed++;
+        }
+        SAMPLE_Suppressed_Counter++;
+        return;
+      }
+      suppressed = m.suppressed;
+      m.suppressed = 0;
+      m.last = now;
+    }
+  }
+  if (_mergeRef){
+    _mergeRef->J1708MergePush(_mergeIndex,frame,FrameLength,time,suppressed);
+  }
+  else {
+    J1708PrintFrame(frame,FrameLength,time,suppressed);
+  }
+}
+
+void J1708Core::J1708SampleCheck(){
+  bool overloaded = SampleMode==SampleAlways || busload>=SampleBusload || Serial.availableForWrite()<SampleTxFree;
+  if (overloaded){
+    SampleHoldTimer = 0;
+    if (!SampleActive){
+      SampleActive = true;
+      SAMPLE_Active_Counter++;
+      for (int i=0; i<256; i++){
+        //Every MID prints its next frame
+        SampleMIDs[i].suppressed = 0;
+        SampleMIDs[i].last = (uint16_t)millis()-SampleInterval;
+      }
+      Serial.print("SAMPLING SP");Serial.print(selfPN);Serial.print(" ON Busload:");Serial.println(busload);
+    }
+  }
+  else if (SampleActive && SampleHoldTimer>=SampleHold){
+    J1708SampleEnd();
+  }
+}
+
+void J1708Core::J1708SampleEnd(){
+  // Back to full output. Frames suppressed since the last printed frame of each MID are summarized.
+  SampleActive = false;
+  Serial.print("SAMPLING SP");Serial.print(selfPN);Serial.print(" OFF Suppressed:");
+  for (int i=0; i<256; i++){
+    if (SampleMIDs[i].suppressed>0){
+      sprintf(hexDisp,"%02X",i);
+      Serial.print(hexDisp);Serial.print("+");Serial.print(SampleMIDs[i].suppressed);Serial.print(" ");
+      SampleMIDs[i].suppressed = 0;
+    }
+  }
+  Serial.println();
+}
+
+void J1708Core::J1708PrintFrame(const uint8_t frame[], const uint8_t &FrameLength, const uint32_t &time, const uint16_t &suppressed){
+  // frame is laid out like J1708RxBuffer: MID at index 1, checksum at FrameLength
+  if (ShowTime){
+    Serial.print("(");
+    Serial.print(time);
+    Serial.print(")");
+    Serial.print(" ");
+  }
+  if (ShowPort){
+    Serial.print("SP");
+    Serial.print(selfPN);
+    Serial.print(" ");
+  }
+  if (ShowLength){
+    Serial.print("[");
+    Serial.print(FrameLength);
+    Serial.print("]");
+    Serial.print(" ");
+  }
+  for (int i = 1; i < FrameLength; i++){ //start at 1 to exclude 0x00 start value
+    if (ShowRxData){
+      sprintf(hexDisp,"%02X ",frame[i]);
+      Serial.print(hexDisp);
+    }
+  }
+  if (ShowChecksum){
+    uint8_t chk = 0;
+    for (int i=1; i<(FrameLength);i++){
+      chk+=frame[i];
+    }
+    chk=((~chk<<24)>>24)+1;
+    Serial.print("C:");
+    Serial.print(chk);
+    Serial.print(" ");
+  }
+  if (ShowBusload){
+    Serial.print("[");Serial.print(busload);Serial.print("] ");
+  }
+  if (ShowMIDShare){
+    Serial.print("[");Serial.print(MIDShareTracker ? MIDShareTracker[frame[1]] : 0.0);Serial.print("] ");
+  }
+  if (suppressed>0){
+    //Frames of this MID not printed since its last printed frame
+    Serial.print("+");Serial.print(suppressed);Serial.print(" ");
+  }
+  if (!ShowTime && !ShowPort && !ShowLength && !ShowRxData && !ShowChecksum && !ShowBusload && !ShowMIDShare){
+    //Nothing will be printed because all flags set false
+  }
+  else{
+    Serial.println();
+  }
+}
+
+void J1708Core::J1708Log(){
+  // This function can replace J1708Listen. It will only print messages to Serial. No other interactions.
+  J1708WatchEnter(PhaseRx);
+  if (J1708Rx(J1708RxBuffer)>0){ //Execute this if the number of recieved bytes is more than zero.
+    J1708LogFrame();
+    //The printing loop used to add the data bytes back into the running
+    //checksum, which brings it to zero for the next frame.
+    J1708Checksum = 0;
+    J1708WatchEnter(PhaseLog);
+    J1708Display(J1708RxBuffer,J1708FrameLength,J1708FrameTime);
+  }
+}
+
+void J1708Core::J1708LogFrame(){
+  if (ParamCacheOn){
+    J1708CacheUpdate(J1708RxBuffer+1,J1708FrameLength-1);
+  }
+  if (RxLEDOn){
+    if (RxLEDState){
+      RxLEDState = false;
+      digitalWrite(RxLED,RxLEDState);
+    }
+    else{
+      RxLEDState = true;
+      digitalWrite(RxLED,RxLEDState);
+    }
+  }
+}
+
+void J1708Core::J1708Update(){
+  J1708WatchPoll();
+  if (N_Deferred>0){
+    //Left by J1708Update(maxMicros). Printed first to keep the order.
+    J1708WatchEnter(PhaseLog);
+    while (N_Deferred>0){
+      J1708DeferredPrint();
+    }
+  }
+  if (selfMode==Gateway){
+    J1708Listen();
+  }
+  else if (selfMode==Observer){
+    J1708Log();
+  }
+  J1708WatchEnter(PhaseStats);
+  J1708UpdateStep(StepCapture);
+  J1708UpdateStep(StepConfig);
+  J1708StatsPeriodic();
+  J1708WatchEnter(PhaseLoop);
+}
+
+void J1708Core::J1708Update(const uint32_t &maxMicros){
+  // Most urgent work first, stopping once maxMicros have passed:
+  //   1. received bytes, handling each frame but its printing (always runs)
+  //   2. bus access for the Tx queue and transport replies (always runs, J1708Tx blocks for one character)
+  //   3. deferred printing (at least one frame if nothing was received)
+  //   4. periodic tasks, resuming with the one after the last that ran (at least one runs)
+  J1708WatchPoll();
+  uint32_t start = WatchPhaseStart;
+  BUDGET_Calls++;
+  bool gateway = selfMode==Gateway;
+  bool received = false;
+  if (gateway || selfMode==Observer){
+    J1708WatchEnter(PhaseRx);
+    do {
+      if (J1708Rx(J1708RxBuffer)>0){
+        received = true;
+        bool own = gateway ? J1708ListenFrame() : (J1708LogFrame(), false);
+        J1708Checksum = 0;
+        if (!own || ShowOwn){
+          J1708Defer();
+        }
+        if (gateway && !own){
+          J1708ListenParse();
+        }
+        J1708WatchEnter(PhaseRx);
+      }
+    } while (_streamRef->available()>0 && micros()-start<maxMicros);
+  }
+  if (gateway){
+    J1708ListenTx();
+  }
+  if (N_Deferred>0){
+    J1708WatchEnter(PhaseLog);
+    //A frame is printed if the last print would still have fit. A call that received nothing prints one
+    //frame even past the budget, so printing cannot starve.
+    if (!received || micros()-start+PrintMicros<=maxMicros){
+      do {
+        uint32_t printStart = micros();
+        J1708DeferredPrint();
+        PrintMicros = micros()-printStart;
+      } while (N_Deferred>0 && micros()-start+PrintMicros<=maxMicros);
+    }
+  }
+  J1708WatchEnter(PhaseStats);
+  do {
+    if (gateway || UpdateStep>=StepCapture){
+      J1708UpdateStep(UpdateStep);
+    }
+    UpdateStep = (UpdateStep+1) % StepCount;
+  } while (UpdateStep!=StepSchedule && micros()-start<maxMicros);
+  J1708StatsPeriodic();
+  J1708WatchEnter(PhaseLoop);
+  uint32_t spent = WatchPhaseStart-start;
+  if (spent>maxMicros){
+    BUDGET_Exceeded_Counter++;
+    if (spent-maxMicros>BUDGET_Overrun_Max){
+      BUDGET_Overrun_Max = spent-maxMicros;
+    }
+  }
+}
+
+void J1708Core::J1708StatsPublish(){
+  // Sole writer of StatsBlock. Readers retry if StatsSeq is odd or changed while they copied.
+  if (StatsBlock==NULL){
+    return;
+  }
+  StatsSeq++;
+  __sync_synchronize();
+  uint32_t sequence = StatsBlock->sequence;
+  J1708StatsFill(*StatsBlock);
+  StatsBlock->sequence = sequence+1;
+  __sync_synchronize();
+  StatsSeq++;
+  StatsTimer = 0;
+}
+
+void J1708Core::J1708StatsFill(J1708Stats &stats){
+  stats.sequence = 0;
+  stats.time = J1708Time();
+  stats.uptime = millis();
+  stats.rx = RX_Counter;
+  stats.tx = TX_Counter;
+  stats.forwarded = FWD_Counter;
+  stats.own = OWN_Counter;
+  stats.ownLost = OWN_Lost_Counter;
+  stats.errors = ERR_Counter;
+  stats.err[0] = 0;
+  for (int n=1; n<=11; n++){
+    stats.err[n] = J1708ErrorCount(n);
+  }
+  stats.securityAlerts = SEC_ERR_Counter;
+  stats.busload = busload;
+  memcpy(stats.topMIDs,TopMIDs,sizeof(stats.topMIDs));
+  memcpy(stats.topShares,TopShares,sizeof(stats.topShares));
+  stats.txQueued = N_TxQ_Total;
+  stats.txFree = J1708TxQFree();
+  stats.rxFillMax = RxFillMax;
+  stats.rxCapacity = RxCapacity;
+  stats.pollMaxPhase = WatchMaxPhase;
+  stats.pollMax = WatchMax;
+  stats.pollP99 = J1708WatchPercentile(99);
+  if (WatchHistogram){
+    memcpy(stats.pollHistogram,WatchHistogram,sizeof(stats.pollHistogram));
+  }
+  else {
+    memset(stats.pollHistogram,0,sizeof(stats.pollHistogram));
+  }
+  stats.stalls = STALL_Counter;
+}
+
+bool J1708Core::J1708StatsRead(J1708Stats &stats){
+  // Current statistics for this context. Without a statistics block they are filled in directly.
+  if (StatsBlock==NULL){
+    J1708StatsFill(stats);
+    return true;
+  }
+  J1708StatsPublish();
+  return snapshot(stats);
+}
+
+bool J1708Core::snapshot(J1708Stats &stats, int tries){
+  // Copies the last published statistics. False if every try overlapped a publish, as happens
+  // to an interrupt that preempted J1708StatsPublish on the same core; try again later.
+  while (StatsBlock && tries-->0){
+    uint32_t seq = StatsSeq;
+    if (seq & 1){
+      continue;
+    }
+    __sync_synchronize();
+    memcpy(&stats,StatsBlock,sizeof(stats));
+    __sync_synchronize();
+    if (StatsSeq==seq){
+      return true;
+    }
+  }
+  return false;
+}
+
+void J1708Core::J1708StatsPeriodic(){
+  //Rate limited, so a busy bus does not copy the block every frame. Compared with the last publish.
+  if (StatsBlock && (StatsTimer>=StatsPublishMillis || (StatsTimer>=StatsChangeMillis
+      && (StatsBlock->rx!=RX_Counter || StatsBlock->tx!=TX_Counter || StatsBlock->forwarded!=FWD_Counter
+          || StatsBlock->errors!=ERR_Counter || StatsBlock->txQueued!=N_TxQ_Total || StatsBlock->own!=OWN_Counter)))){
+    J1708StatsPublish();
+  }
+  if (ExportFormat!=ExportOff && ExportMillis>0 && ExportTimer>=ExportMillis){
+    ExportTimer = 0;
+    J1708Export(ExportFormat);
+  }
+}
+
+static uint8_t *J1708PutLE(uint8_t *p, uint32_t value, int bytes){
+  for (int i=0; i<bytes; i++){
+    *p++ = (uint8_t)(value>>(8*i));
+  }
+  return p;
+}
+
+int J1708Core::J1708Export(uint8_t format){
+  // Writes the current statistics in one Serial.write. Returns the bytes written.
+  J1708Stats stats;
+  if (!J1708StatsRead(stats)){
+    return 0;
+  }
+  int n = 0;
+  if (format==ExportBinary){
+    uint8_t packet[J1708Host::MaxPayload+5];
+    n = J1708ExportBinary(stats,packet);
+    Serial.write(packet,n);
+  }
+  else if (format==ExportJSON){
+    char record[ExportBytes];
+    n = J1708ExportJSON(stats,record,sizeof(record));
+    Serial.write((const uint8_t *)record,n);
+  }
+  EXPORT_Counter += n>0;
+  return n;
+}
+
+int J1708Core::J1708ExportBinary(const J1708Stats &stats, uint8_t packet[]){
+  // Payload of a STATS packet, version 1. Multi-byte fields are little-endian, shares are in 0.01%.
+  uint8_t *p = packet+4;
+  *p++ = ExportVersion;
+  *p++ = selfPN;
+  p = J1708PutLE(p,stats.sequence,4);
+  p = J1708PutLE(p,stats.time,4);
+  p = J1708PutLE(p,stats.uptime,4);
+  p = J1708PutLE(p,stats.rx,4);
+  p = J1708PutLE(p,stats.tx,4);
+  p = J1708PutLE(p,stats.forwarded,4);
+  p = J1708PutLE(p,stats.own,4);
+  p = J1708PutLE(p,stats.ownLost,4);
+  p = J1708PutLE(p,stats.errors,4);
+  for (int n=1; n<=11; n++){
+    p = J1708PutLE(p,stats.err[n],4);
+  }
+  p = J1708PutLE(p,stats.securityAlerts,4);
+  p = J1708PutLE(p,(uint32_t)(stats.busload*10000.0+0.5),2);
+  for (int i=0; i<TopMIDCount; i++){
+    *p++ = stats.topMIDs[i];
+    p = J1708PutLE(p,(uint32_t)(stats.topShares[i]*10000.0+0.5),2);
+  }
+  *p++ = stats.txQueued;
+  *p++ = stats.txFree;
+  p = J1708PutLE(p,stats.rxFillMax,2);
+  p = J1708PutLE(p,stats.rxCapacity,2);
+  *p++ = stats.pollMaxPhase;
+  p = J1708PutLE(p,stats.pollMax,4);
+  p = J1708PutLE(p,stats.pollP99,4);
+  p = J1708PutLE(p,stats.stalls,4);
+  for (int i=0; i<16; i++){
+    p = J1708PutLE(p,stats.pollHistogram[i],4);
+  }
+  return J1708Host::J1708HostSeal(packet,J1708Host::STATS,(uint8_t)stats.sequence,p-(packet+4));
+}
+
+int J1708Core::J1708ExportJSON(const J1708Stats &stats, char record[], int size){
+  // One line with the fields of the binary record, same units.
+  int n = snprintf(record,size,
+    "{\"v\":%u,\"sp\":%d,\"seq\":%lu,\"t\":%lu,\"ms\":%lu,\"rx\":%lu,\"tx\":%lu,\"fwd\":%lu,\"own\":%lu,\"lost\":%lu,\"err\":%lu,\"errs\":[",
+    ExportVersion,selfPN,(unsigned long)stats.sequence,(unsigned long)stats.time,(unsigned long)stats.uptime,
+    (unsigned long)stats.rx,(unsigned long)stats.tx,(unsigned long)stats.forwarded,(unsigned long)stats.own,
+    (unsigned long)stats.ownLost,(unsigned long)stats.errors);
+  for (int i=1; i<=11 && n<size; i++){
+    n += snprintf(record+n,size-n,i==1 ? "%lu" : ",%lu",(unsigned long)stats.err[i]);
+  }
+  if (n<size){
+    n += snprintf(record+n,size-n,"],\"sec\":%lu,\"load\":%lu,\"top\":[",
+      (unsigned long)stats.securityAlerts,(unsigned long)(stats.busload*10000.0+0.5));
+  }
+  for (int i=0; i<TopMIDCount && n<size; i++){
+    n += snprintf(record+n,size-n,i==0 ? "[%u,%lu]" : ",[%u,%lu]",stats.topMIDs[i],(unsigned long)(stats.topShares[i]*10000.0+0.5));
+  }
+  if (n<size){
+    n += snprintf(record+n,size-n,"],\"txq\":%u,\"txfree\":%u,\"rxmax\":%u,\"rxcap\":%u,\"gap\":%lu,\"phase\":\"%s\",\"p99\":%lu,\"stalls\":%lu,\"hist\":[",
+      stats.txQueued,stats.txFree,stats.rxFillMax,stats.rxCapacity,(unsigned long)stats.pollMax,
+      PhaseNames[stats.pollMaxPhase],(unsigned long)stats.pollP99,(unsigned long)stats.stalls);
+  }
+  for (int i=0; i<16 && n<size; i++){
+    n += snprintf(record+n,size-n,i==0 ? "%lu" : ",%lu",(unsigned long)stats.pollHistogram[i]);
+  }
+  if (n<size){
+    n += snprintf(record+n,size-n,"]}\n");
+  }
+  return n<size ? n : size-1;
+}
+
+void J1708Core::J1708Defer(){
+  // Queues the frame in J1708RxBuffer for printing. When full, the oldest is printed now.
+  if (Deferred==NULL){
+    J1708Display(J1708RxBuffer,J1708FrameLength,J1708FrameTime);
+    return;
+  }
+  if (N_Deferred==DeferSize){
+    BUDGET_Forced_Prints++;
+    J1708DeferredPrint();
+  }
+  DeferredFrame &entry = Deferred[(DeferredHead+N_Deferred) % DeferSize];
+  memcpy(entry.data,J1708RxBuffer,J1708FrameLength+1);
+  entry.length = J1708FrameLength;
+  entry.time = J1708FrameTime;
+  N_Deferred++;
+}
+
+void J1708Core::J1708DeferredPrint(){
+  DeferredFrame &entry = Deferred[DeferredHead];
+  J1708Display(entry.data,entry.length,entry.time);
+  DeferredHead = (DeferredHead+1) % DeferSize;
+  N_Deferred--;
+}
+
+const char *const J1708Core::PhaseNames[PhaseCount] = {"loop", "rx", "tx", "parse", "stats", "settings", "log"};
+
+void J1708Core::J1708WatchEnter(const uint8_t &phase){
+  // Ends the running phase and starts another
+  uint32_t now = micros();
+  uint32_t spent = now-WatchPhaseStart;
+  if (spent>WatchHeavyTime){
+    WatchHeavyTime = spent;
+    WatchHeavy = WatchPhase;
+  }
+  WatchPhase = phase;
+  WatchPhaseStart = now;
+}
+
+void J1708Core::J1708WatchPoll(){
+  J1708WatchEnter(PhaseLoop);
+  uint32_t now = WatchPhaseStart;
+  if (WatchPolls++>0){
+    uint32_t gap = now-WatchLastPoll;
+    int k = 0;
+    while (k<WatchBuckets-1 && (gap>>(k+1))>0){
+      k++;
+    }
+    if (WatchHistogram){
+      WatchHistogram[k]++;
+    }
+    if (gap>WatchMax){
+      WatchMax = gap;
+      WatchMaxPhase = WatchHeavy;
+    }
+    if (WatchStall>0 && gap>=WatchStall){
+      STALL_Counter++;
+      if (WatchEvents){
+        if (N_WatchEvents==WatchEventSize){
+          memmove(WatchEvents,WatchEvents+1,sizeof(WatchEvents[0])*(WatchEventSize-1));
+          N_WatchEvents--;
+        }
+        WatchEvents[N_WatchEvents++] = {J1708Time(),gap,WatchHeavy};
+      }
+      if (ShowErrors){
+        Serial.print("STALL SP");Serial.print(selfPN);
+        Serial.print(" Gap:");Serial.print(gap);
+        Serial.print(" Phase:");Serial.println(PhaseNames[WatchHeavy]);
+      }
+    }
+  }
+  WatchLastPoll = now;
+  WatchHeavyTime = 0;
+  WatchHeavy = PhaseLoop;
+}
+
+uint32_t J1708Core::J1708WatchPercentile(const uint8_t &percent){
+  // Upper bound (us) of the bucket holding the given percentile of gaps, 0 if none yet
+  uint32_t total = 0;
+  for (int k=0; k<WatchBuckets && WatchHistogram; k++){
+    total += WatchHistogram[k];
+  }
+  if (total==0){
+    return 0;
+  }
+  uint32_t rank = (total*(uint64_t)percent+99)/100;
+  uint32_t seen = 0;
+  for (int k=0; k<WatchBuckets-1; k++){
+    seen += WatchHistogram[k];
+    if (seen>=rank){
+      return (2u<<k)-1;
+    }
+  }
+  return WatchMax;
+}
+
+void J1708Core::J1708WatchReset(){
+  if (WatchHistogram){
+    memset(WatchHistogram,0,sizeof(WatchHistogram[0])*WatchBuckets);
+  }
+  WatchPolls = 0;
+  WatchMax = 0;
+  WatchMaxPhase = PhaseLoop;
+  N_WatchEvents = 0;
+  STALL_Counter = 0;
+}
+
+bool J1708Core::J1708Pending(){
+  // True while J1708Update has more to do than its periodic tasks
+  if (_streamRef==NULL){
+    return false;
+  }
+  return _streamRef->available()>0 || J1708ByteCount>0 || N_Echo>0 || N_Deferred>0 || Q_flag || Loop_flag || fx>0
+         || N_TxQ_Total>0 || N_TxSched>0 || ReplayOn || GenOn;
+}
+
+bool J1708Core::J1708Settings(String &command){
+  return J1708Settings(command.c_str());
+}
+
+bool J1708Core::J1708Settings(const char *command){
+  // Commands contain 4 fields: cmd spx | sbc | opt | val
+  uint8_t phase = WatchPhase;
+  J1708WatchEnter(PhaseSettings);
+  if (ShowCommand){
+    Serial.println(command);
+  }
+  J1708Args args;
+  J1708Tokenize(command,args);
+  bool result = false;
+  for (const CommandEntry *entry = Commands; entry->cmd; entry++){
+    if (!args.is(0,entry->cmd)){
+      continue;
+    }
+    if (entry->sub && !args.is(2,entry->sub)){
+      continue;
+    }
+    if (entry->opt && !args.is(3,entry->opt)){
+      continue;
+    }
+    result = (this->*(entry->handler))(args,*entry);
+    break;
+  }
+  J1708WatchEnter(phase);
+  return result;
+}
+
+// Command dispatch table. First match wins, NULL matches any token.
+const J1708Core::CommandEntry J1708Core::Commands[] = {
+  {"j1708config", "-E", NULL, &J1708Core::CmdEEPROM,         NULL},
+  {"j1708config", "-g", "-h", &J1708Core::CmdFlag,           &J1708Core::selfHostPort},
+  {"j1708config", "-g", "-f", &J1708Core::CmdFlag,           &J1708Core::Rx_Forwarding},
+  {"j1708config", "-g", "-c", &J1708Core::CmdFlag,           &J1708Core::ParamCacheOn},
+  {"j1708config", "-g", "-p", &J1708Core::CmdFlag,           &J1708Core::GatewaySpecificProcessing},
+  {"j1708config", "-g", "-d", &J1708Core::CmdDedup,          NULL},
+  {"j1708config", "-g", "-D", &J1708Core::CmdDedup,          NULL},
+  {"j1708config", "-g", "-t", &J1708Core::CmdRewrite,        NULL},
+  {"j1708config", "-g", "-w", &J1708Core::CmdRewrite,        NULL},
+  {"j1708config", "-g", "-W", &J1708Core::CmdRewrite,        NULL},
+  {"j1708config", "-g", "-a", &J1708Core::CmdACL,            NULL},
+  {"j1708config", "-g", "-r", &J1708Core::CmdACL,            NULL},
+  {"j1708config", "-g", "-m", &J1708Core::CmdSelfMID,        NULL},
+  {"j1708config", "-g", "-M", &J1708Core::CmdLimit,          NULL},
+  {"j1708config", "-g", "-b", &J1708Core::CmdLimit,          NULL},
+  {"j1708config", "-g", "-q", &J1708Core::CmdLimit,          NULL},
+  {"j1708config", "-h", NULL, &J1708Core::CmdHelp,           NULL},
+  {"j1708config", "-H", "-r", &J1708Core::CmdFlag,           &J1708Core::RxLEDOn},
+  {"j1708config", "-H", "-s", &J1708Core::CmdFlag,           &J1708Core::SECLEDOn},
+  {"j1708config", "-H", "-t", &J1708Core::CmdFlag,           &J1708Core::TxLEDOn},
+  {"j1708config", "-q", NULL, &J1708Core::CmdQuery,          NULL},
+  {"j1708config", "-r", NULL, &J1708Core::CmdReset,          NULL},
+  {"j1708config", "-s", "-a", &J1708Core::CmdShowPreset,     NULL},
+  {"j1708config", "-s", "-d", &J1708Core::CmdShowPreset,     NULL},
+  {"j1708config", "-s", "-n", &J1708Core::CmdShowPreset,     NULL},
+  {"j1708config", "-s", "-D", &J1708Core::CmdFilter,         NULL},
+  {"j1708config", "-s", "-f", &J1708Core::CmdFilter,         NULL},
+  {"j1708config", "-s", "-F", &J1708Core::CmdFilter,         NULL},
+  {"j1708config", "-s", "-L", &J1708Core::CmdFilter,         NULL},
+  {"j1708config", "-s", "-M", &J1708Core::CmdFilter,         NULL},
+  {"j1708config", "-s", "-P", &J1708Core::CmdFilter,         NULL},
+  {"j1708config", "-s", "-B", &J1708Core::CmdSample,         NULL},
+  {"j1708config", "-s", "-I", &J1708Core::CmdSample,         NULL},
+  {"j1708config", "-s", "-N", &J1708Core::CmdSample,         NULL},
+  {"j1708config", "-s", "-S", &J1708Core::CmdSample,         NULL},
+  {"j1708config", "-s", "-A", &J1708Core::CmdShowACL,        NULL},
+  {"j1708config", "-s", "-i", &J1708Core::CmdShowInfo,       NULL},
+  {"j1708config", "-s", "-s", &J1708Core::CmdShowStatistics, NULL},
+  {"j1708config", "-s", "-z", &J1708Core::CmdShowProfile,    NULL},
+  {"j1708config", "-s", "-b", &J1708Core::CmdFlag,           &J1708Core::ShowBusload},
+  {"j1708config", "-s", "-c", &J1708Core::CmdFlag,           &J1708Core::ShowChecksum},
+  {"j1708config", "-s", "-C", &J1708Core::CmdFlag,           &J1708Core::ShowCommand},
+  {"j1708config", "-s", "-e", &J1708Core::CmdFlag,           &J1708Core::ShowErrors},
+  {"j1708config", "-s", "-l", &J1708Core::CmdFlag,           &J1708Core::ShowLength},
+  {"j1708config", "-s", "-m", &J1708Core::CmdFlag,           &J1708Core::ShowMIDShare},
+  {"j1708config", "-s", "-o", &J1708Core::CmdFlag,           &J1708Core::ShowOwn},
+  {"j1708config", "-s", "-p", &J1708Core::CmdFlag,           &J1708Core::ShowPort},
+  {"j1708config", "-s", "-r", &J1708Core::CmdFlag,           &J1708Core::ShowRxData},
+  {"j1708config", "-s", "-T", &J1708Core::CmdFlag,           &J1708Core::ShowTime},
+  {"j1708config", "-s", "-w", &J1708Core::CmdWatch,          NULL},
+  {"j1708config", "-s", "-x", &J1708Core::CmdExport,         NULL},
+  {"j1708capture", "-h", NULL, &J1708Core::CmdHelp,          NULL},
+  {"j1708capture", NULL, NULL, &J1708Core::CmdCapture,       NULL},
+  {"j1708gen",    "-h", NULL, &J1708Core::CmdHelp,           NULL},
+  {"j1708gen",    NULL, NULL, &J1708Core::CmdGen,            NULL},
+  {"j1708replay", "-h", NULL, &J1708Core::CmdHelp,           NULL},
+  {"j1708replay", "-s", NULL, &J1708Core::CmdReplaySpeed,    NULL},
+  {"j1708replay", NULL, NULL, &J1708Core::CmdReplay,         NULL},
+  {"j1708shape",  "-h", NULL, &J1708Core::CmdHelp,           NULL},
+  {"j1708shape",  NULL, NULL, &J1708Core::CmdShape,          NULL},
+  {"j1708send",   "-h", NULL, &J1708Core::CmdHelp,           NULL},
+  {"j1708send",   "-T", NULL, &J1708Core::CmdSendTransport,  NULL},
+  {"j1708send",   NULL, NULL, &J1708Core::CmdSend,           NULL},
+  {NULL,          NULL, NULL, NULL,                      NULL}
+};
+
+bool J1708Core::CmdFlag(const J1708Args &args, const CommandEntry &entry){
+  int value = args.toFlag(4);
+  if (value<0){
+    return false;
+  }
+  this->*(entry.flag) = value;
+  return true;
+}
+
+bool J1708Core::CmdACL(const J1708Args &args, const CommandEntry &entry){
+  int mid = args.toHex(4);
+  if (mid<0){
+    return false;
+  }
+  if (entry.opt[1]=='a'){
+    J1708UpdateACL(mid,true);
+    Serial.print("MID added to blocklist:");Serial.println(mid);
+  }
+  else{
+    J1708UpdateACL(mid,false);
+    Serial.print("MID removed from blocklist:");Serial.println(mid);
+  }
+  return true;
+}
+
+bool J1708Core::CmdSelfMID(const J1708Args &args, const CommandEntry &entry){
+  int mid = args.toHex(4);
+  if (mid<0){
+    return false;
+  }
+  selfMID = (uint8_t)mid;
+  Serial.print("Self_MID changed to ");Serial.println(mid);
+  return true;
+}
+
+bool J1708Core::CmdLimit(const J1708Args &args, const CommandEntry &entry){
+  if (!args.has(4)){
+    return false;
+  }
+  switch (entry.opt[1]){
+    case 'M':
+      maxMIDShare = args.toFloat(4);
+      Serial.print("Max_MID changed to ");Serial.println(maxMIDShare);
+      return true;
+    case 'b':
+      maxBusload = args.toFloat(4);
+      Serial.print("Max_Busload changed to ");Serial.println(maxBusload);
+      return true;
+    case 'q':
+      if (args.toInt(4)<0){
+        return false;
+      }
+      ParamCacheMaxAge = (uint32_t)args.toInt(4);
+      Serial.print("Max_Cache_Age changed to ");Serial.println(ParamCacheMaxAge);
+      return true;
+  }
+  return false;
+}
+
+bool J1708Core::CmdHelp(const J1708Args &args, const CommandEntry &entry){
+  if (args.is(0,"j1708capture")){
+    Serial.print("j1708capture sp<port_no> <option> <params>\n    -a <frames>   frames recorded after the trigger before the ring freezes (default 8)\n    -c            clear triggers\n    -d            print the ring now\n    -e <n> <0|1>  trigger on ERRn (1-11)\n    -g            re-arm after a trigger (keeps the ring)\n    -h            HELP\n    -i            capture status\n    -m <MID> <0|1>              trigger on any frame from MID\n    -p <pattern> <mask>         trigger when frame bytes from the MID on match, e.g. -p 80.00.C5 FF.00.FF\n");
+  }
+  else if (args.is(0,"j1708gen")){
+    Serial.print("j1708gen sp<port_no> <option> <params>\n    -a <MID> <ms> <PID.PID...>  add an ECU broadcasting the PIDs every <ms> (hex MID and PIDs)\n                  e.g. j1708gen sp3 -a 80 100 BE.5C.54\n    -b <ms> <frames>            add a burst of <frames> every <ms> (0-off)\n    -c            clear ECUs\n    -d            default ECUs (engine, transmission, brakes, cluster)\n    -g            start generator\n    -h            HELP\n    -i            generator status\n    -l <float>    hold the busload at a target by scaling every period (0-off)\n    -t <ms> <bytes> <dst.MID>   start a transport session every <ms> (0-off)\n    -x            stop generator\n");
+  }
+  else if (args.is(0,"j1708replay")){
+    Serial.print("j1708replay sp<port_no> <option> <param>\n    -a <line>     add a frame in the format printed by the port (time required)\n                  e.g. j1708replay sp3 -a (1234567) SP3 [5] 80 54 40 BE\n    -c            clear replay buffer\n    -g            start replay\n    -h            HELP\n    -i            replay status and timing drift\n    -l <0|1>      loop the replay buffer\n    -s <float>    speed multiplier\n    -x            stop replay\n");
+  }
+  else if (args.is(0,"j1708shape")){
+    Serial.print("j1708shape sp<port_no> <option> <params>\n    -c            clear all budgets\n    -d <chars/s> <burst>        budget of every MID without a rule (0-off)\n    -h            HELP\n    -i            shaping status, tokens and held frames per bucket\n    -m <MID> <chars/s> <burst>  budget of one MID (0-remove), e.g. -m 80 200 42\n    -p <prio> <chars/s> <burst> budget of one priority 0-8, 0 is forwarded (0-off)\n");
+  }
+  else if (args.is(0,"j1708config")){
+    Serial.print("j1708config sp<port_no> <subcommand>\n  -E EEPROM <option> <value>\n    -a <0|1>      save changes automatically (saved now)\n    -c            erase the saved settings of this port\n    -i            EEPROM status\n    -l            restore the saved settings\n    -s            save now\n  -g GATEWAY <option> <value>\n    -a <MID>      add MID to ACL\n    -b <float>    max allowable busload\n    -c <0|1>      cache latest parameter values\n    -d <0|1>      forward only changed frames (and unchanged ones every refresh interval)\n    -D <ms>       change-only forwarding refresh interval (default 1000)\n    -h <0|1>      designate port as 'host port'\n    -f <0|1>      forward rx data to linked port\n    -m <MID>      change the gateway MID (ACL settings preserved)\n    -M <float>    max allowable MID share of max busload\n    -p <0|1>      process gateway specific requests\n    -q <ms>       answer PID 128 requests from cache (0-off)\n    -r <MID>      remove MID from ACL \n    -t <MID> <MID>  forward frames from the first MID with the second MID\n    -w <MID> <PID> <value> <mask>  patch the data bytes of a PID in forwarded frames, e.g. -w 80 BE 00.10 00.FF\n    -W            clear MID translations and patches\n  -h HELP\n  -H HARDWARE <option> <value>\n    -r <0|1>      rx LED ON/OFF \n    -t <0|1>      tx LED ON/OFF \n    -s <0|1>      security LED ON/OFF \n  -q QUERY <option>\n    -a            all cached parameters\n    <MID> [PID]   cached parameters of a MID\n  -r RESET <option>\n    -a            ACL allow all\n    -b            ACL block all\n    -c            message counters\n    -e            error counters\n    -q            parameter cache\n    -t            message timer (shared by all ports)\n    -z            profiling zones and loop watchdog\n  -s SHOW <option> <value>\n    -a            all\n    -A <0|1>      show ACL\n    -b <0|1>      busload\n    -B <float>    busload that starts sampled logging (default 0.8)\n    -c <0|1>      checksum\n    -C <0|1>      command\n    -d            default\n    -D <pattern> <mask>  only frames whose bytes from the MID on match, e.g. 80.00.BE FF.00.FF\n    -e <0|1>      non-security errors\n    -f            display filter status\n    -F            clear display filters\n    -I <ms>       sampled logging: one frame per MID per interval (default 1000)\n    -l <0|1>      data length\n    -L <min> <max>  only frames of this length (checksum included)\n    -m <0|1>      busload by MID\n    -M <MID> <0|1>  only frames from the selected MIDs\n    -n            none\n    -N <n>        sampled logging: one in n frames per MID instead (0-interval)\n    -o <0|1>      echoes of frames sent by this port\n    -p <0|1>      port\n    -P <PID> <0|1>  only frames carrying a selected PID (FF - page 2)\n    -r <0|1>      rx data\n    -s            statistics\n    -S <0|1|2>    sampled logging off, under load (default), always\n    -T <0|1>      time\n    -w <us>       record J1708Update gaps at least this long as stall events (0-off)\n    -x <b|j|0> [ms]  statistics record in binary or JSON, now or every ms (0-off)\n    -z            profiling zones\n");
+  }
+  else{
+    Serial.print("j1708send sp<port_no> <option> <param1> <param2>\n        SEND MESSAGE\n            <payload_size> <payload>            send data w/o checksum (automatically calculated and appended)\n            EXAMPLE:\n            j1708send sp3 4 DE.AD.be.ef         send a message to port three with MID 0xDE\n\n    -T  SEND TRANSPORT MESSAGE\n            <dst.MID> <payload_size> <payload>  Send a payload using J1587 transport protocol. Automatic RTS\n                                                is sent if possible. Automatic handling. Connection times\n                                                out after 10s. Meanwhile, no other RTSs can be sent. Max\n                                                payload size is 256-bytes.\n            EXAMPLE:\n            j1708send sp3 -T A1 30 01.02.03. ... .29.30 \n            \n    -h  HELP");
+  }
+  return true;
+}
+
+bool J1708Core::CmdQuery(const J1708Args &args, const CommandEntry &entry){
+  if (args.is(3,"-a")){
+    J1708CachePrint();
+    return true;
+  }
+  int mid = args.toHex(3);
+  if (mid<0){
+    return false;
+  }
+  if (args.has(4)){
+    int pid = args.toHex(4);
+    if (pid<0){
+      return false;
+    }
+    J1708CachePrint(mid,pid);
+    return true;
+  }
+  J1708CachePrint(mid);
+  return true;
+}
+
+bool J1708Core::CmdReset(const J1708Args &args, const CommandEntry &entry){
+  if (args.is(3,"-t")){
+    //Reset the message timer shared by all ports
+    J1708TimeReset();
+    return true;
+  }
+  else if (args.is(3,"-a")){
+    //Reset ACL - Allow All
+    J1708ResetACL(false);
+    return true;
+  }
+  else if (args.is(3,"-b")){
+    //Reset ACL - Block All
+    J1708ResetACL(true);
+    return true;
+  }
+  else if (args.is(3,"-c")){
+    //Reset message counters
+    RX_Counter = 0;
+    TX_Counter = 0;
+    FWD_Counter = 0;
+    OWN_Counter = 0;
+    OWN_Lost_Counter = 0;
+    RxFillMax = 0;
+    RX_Split_Counter = 0;
+    return true;
+  }
+  else if (args.is(3,"-z")){
+    //Reset profiling zones and the loop watchdog
+    J1708ProfileReset();
+    J1708WatchReset();
+    return true;
+  }
+  else if (args.is(3,"-q")){
+    //Reset parameter cache
+    J1708CacheReset();
+    return true;
+  }
+  else if (args.is(3,"-e")){
+    //Reset Error Count
+    ERR_Counter = 0;
+    ERR1_Counter = 0; // Checksum Error
+    ERR2_Counter = 0; // Buffer Overflow Error
+    ERR3_Counter = 0; // Transmit Buffer Overflow Error (i.e. Too many messages being sent)
+    ERR4_Counter = 0; // Message Collision Error
+    ERR5_Counter = 0; // Transmit Error (i.e. Disconnected from bus, hardware fault)
+    ERR6_Counter = 0; // High Busload / Flood Error
+    ERR7_Counter = 0; // Spoofed Message Error
+    ERR8_Counter = 0; // Rogue Node Detected Error
+    ERR9_Counter = 0; // Rogue Node Detected Error
+    ERR10_Counter = 0; // Rogue Node Detected Error
+    ERR11_Counter = 0; // Receive Overrun Error
+    for (int i=0;i<256 && ERR7_IDCounter;i++){
+      ERR7_IDCounter[i]=0;
+    }
+    ERR8_Tracker.fill(false);
+    ERR9_Tracker.fill(false);
+    ERR10_Tracker.fill(false);
+    SEC_ERR_Counter = 0;
+    ERR1_Checksum = false;
+    ERR2_RxOverflow = false;
+    ERR3_Tx_Overflow = false;
+    ERR4_Collision = false;
+    ERR5_DataNotSent = false;
+    ERR6_HighBusload = false;
+    ERR11_RxOverrun = false;
+    return true;
+  }
+  return false;
+}
+
+bool J1708Core::CmdShowPreset(const J1708Args &args, const CommandEntry &entry){
+  // -a all, -d default, -n none
+  bool all = entry.opt[1]=='a';
+  bool none = entry.opt[1]=='n';
+  ShowRxData = !none;
+  ShowTime = !none;
+  ShowPort = !none;
+  ShowChecksum = all;
+  ShowLength = !none;
+  ShowErrors = !none;
+  ShowCommand = !none;
+  ShowBusload = all;
+  ShowMIDShare = all;
+  return true;
+}
+
+bool J1708Core::CmdShowACL(const J1708Args &args, const CommandEntry &entry){
+  Serial.println("ACCESS CONTROL LIST");
+  Serial.println("MID:<0-Allowed, 1-Blocked>");
+  int filter = args.toFlag(4);
+  for (int i=0;i<=255;i++){
+    if (filter<0 || selfACL.test(i)==filter){
+      Serial.print(i);Serial.print(":");Serial.println(selfACL.test(i));
+    }
+  }
+  return true;
+}
+
+bool J1708Core::CmdShowInfo(const J1708Args &args, const CommandEntry &entry){
+  Serial.println("SYSTEM INFORMATION");
+  Serial.print("Mode:");Serial.print(selfMode);
+    if (selfMode==0){
+      Serial.println(" (Gateway)");
+    }
+    else if (selfMode==0){
+      Serial.println(" (Rogue)");
+    }
+    else if (selfMode==0){
+      Serial.println(" (Compromised)");
+    }
+    else if (selfMode==0){
+      Serial.println(" (Observer)");
+    }
+    else{
+      Serial.println();
+    }
+  Serial.print("Port:");Serial.println(selfPN);
+  if (J1708Object_Linked){
+    Serial.print("Linked_Port:");Serial.println(_j1708Ref->selfPN);
+  }
+  else{
+    Serial.print("Linked_Port:");Serial.println("-");
+  }
+  Serial.print("Self_MID:");Serial.println(selfMID);
+  Serial.print("Max_Busload:");Serial.println(maxBusload);
+  Serial.print("Max_MID%:");Serial.println(maxMIDShare);
+  Serial.print("TxBucketSize:");Serial.println(TxQmax);
+  Serial.print("TP_Capacity:");Serial.println(TPCapacity);
+  Serial.print("Rx_Buffer_Bytes:");Serial.println(RxCapacity);
+  Serial.print("Port_RAM_Bytes:");Serial.println(PortSize);
+  Serial.print("Max_Cache_Age:");Serial.println(ParamCacheMaxAge);
+  Serial.print("Stats_Export:");
+  if (ExportFormat==ExportOff){
+    Serial.println("Off");
+  }
+  else {
+    Serial.print(ExportFormat==ExportBinary ? "Binary every " : "JSON every ");Serial.print(ExportMillis);Serial.println(" ms");
+  }
+  if (selfHostPort){
+    Serial.print("Host_Port:");Serial.println("True");
+  }
+  else {
+    Serial.print("Host_Port:");Serial.println("False");
+  }
+  if (GatewaySpecificProcessing){
+    Serial.print("Gateway_Prc:");Serial.println("True");
+  }
+  else {
+    Serial.print("Gateway_Prc:");Serial.println("False");
+  }
+  if (Rx_Forwarding){
+    Serial.print("Msg_Forwarding:");Serial.println("True");
+  }
+  else {
+    Serial.print("Msg_Forwarding:");Serial.println("False");
+  }
+  Serial.print("Rewrite:");
+  for (int i=0; i<256 && RewriteMIDMap; i++){
+    if (RewriteMIDMap[i]!=i){
+      sprintf(hexDisp,"%02X",i);
+      Serial.print(hexDisp);Serial.print(">");
+      sprintf(hexDisp,"%02X ",RewriteMIDMap[i]);
+      Serial.print(hexDisp);
+    }
+  }
+  for (int k=0; k<N_RewritePatches; k++){
+    RewritePatch &p = RewritePatches[k];
+    sprintf(hexDisp,"%02X",p.mid);
+    Serial.print(hexDisp);Serial.print("/");
+    sprintf(hexDisp,"%02X",p.pid);
+    Serial.print(hexDisp);Serial.print(":");
+    for (int b=0; b<p.len; b++){
+      sprintf(hexDisp,"%02X",p.value[b]);
+      Serial.print(hexDisp);
+    }
+    Serial.print("&");
+    for (int b=0; b<p.len; b++){
+      sprintf(hexDisp,"%02X",p.mask[b]);
+      Serial.print(hexDisp);
+    }
+    Serial.print(" ");
+  }
+  Serial.println();
+  Serial.print("Change_Only_Forwarding:");Serial.println(DedupOn ? "True" : "False");
+  Serial.print("Dedup_Refresh:");Serial.println(DedupRefresh);
+  return true;
+}
+
+bool J1708Core::CmdShowStatistics(const J1708Args &args, const CommandEntry &entry){
+  //Counters print from one snapshot so they agree with each other
+  J1708Stats stats;
+  if (!J1708StatsRead(stats)){
+    return false;
+  }
+  Serial.println("SYSTEM STATISTICS");
+  Serial.print("Bus_Load:");Serial.print(stats.busload*100.0);Serial.println("%");
+  if (MIDShareTracker){
+    Serial.print("Top_MIDs:");
+    for (int i=0; i<TopMIDCount && stats.topShares[i]>0; i++){
+      Serial.print(" ");Serial.print(stats.topMIDs[i]);Serial.print("=");Serial.print(stats.topShares[i]*100.0);Serial.print("%");
+    }
+    Serial.println();
+  }
+  Serial.print("Total_Error_Count:");Serial.println(stats.errors);
+  for (int n=1; n<=11; n++){
+    Serial.print("  ERR");Serial.print(n);Serial.print("_Count:");Serial.println(stats.err[n]);
+  }
+  Serial.print("Security_Alerts:");Serial.println(stats.securityAlerts);
+  Serial.print("Total_Received_Messages:");Serial.println(stats.rx);
+  Serial.print("Total_Transmitted_Messages:");Serial.println(stats.tx);
+  Serial.print("Total_Forwarded_Messages:");Serial.println(stats.forwarded);
+  Serial.print("Own_Echoes_Matched:");Serial.println(stats.own);
+  Serial.print("Own_Echoes_Lost:");Serial.println(stats.ownLost);
+  Serial.print("Rx_Buffer_Max_Fill:");Serial.print(stats.rxFillMax);Serial.print("/");Serial.println(stats.rxCapacity);
+  Serial.print("Rx_Backlog_Splits:");Serial.println(RX_Split_Counter);
+  Serial.print("Budgeted_Updates:");Serial.println(BUDGET_Calls);
+  Serial.print("Budget_Exceeded:");Serial.println(BUDGET_Exceeded_Counter);
+  Serial.print("Budget_Forced_Prints:");Serial.println(BUDGET_Forced_Prints);
+  Serial.print("Budget_Max_Overrun_Micros:");Serial.println(BUDGET_Overrun_Max);
+  Serial.print("Max_Poll_Gap_Micros:");Serial.print(stats.pollMax);Serial.print(" (");Serial.print(PhaseNames[stats.pollMaxPhase]);Serial.println(")");
+  Serial.print("P99_Poll_Gap_Micros:<=");Serial.println(stats.pollP99);
+  Serial.print("Stall_Events:");Serial.println(stats.stalls);
+  for (int i=0; i<N_WatchEvents; i++){
+    Serial.print("  (");Serial.print(WatchEvents[i].time);Serial.print(") Gap:");Serial.print(WatchEvents[i].gap);
+    Serial.print(" Phase:");Serial.println(PhaseNames[WatchEvents[i].phase]);
+  }
+  Serial.print("Cached_Parameter_Updates:");Serial.println(PARAM_Counter);
+  Serial.print("Requests_Answered_From_Cache:");Serial.println(REQ_Answered_Counter);
+  Serial.print("Requests_Forwarded:");Serial.println(REQ_Forwarded_Counter);
+  Serial.print("Rewritten_Messages:");Serial.println(REWRITE_Counter);
+  Serial.print("Dedup_Suppressed_Messages:");Serial.println(DEDUP_Suppressed_Counter);
+  Serial.print("Dedup_Saved_Bytes:");Serial.println(DEDUP_Saved_Bytes);
+  Serial.print("Dedup_Saved_Bus_Load:");Serial.print(DedupSavedLoad*100.0);Serial.println("%");
+  Serial.print("Display_Filter_Rejected:");Serial.println(FILTER_Rejected_Counter);
+  Serial.print("Sampled_Logging:");Serial.println(SampleActive ? "Active" : "Inactive");
+  Serial.print("Sampled_Logging_Started:");Serial.println(SAMPLE_Active_Counter);
+  Serial.print("Sampled_Logging_Suppressed:");Serial.println(SAMPLE_Suppressed_Counter);
+  Serial.print("Message_Timer_Micros:");Serial.println(J1708Time());
+  Serial.print("System_Timer_Millis:");Serial.println(millis());
+  return true;
+}
+
+bool J1708Core::CmdReplay(const J1708Args &args, const CommandEntry &entry){
+  // j1708replay spX <option> <param>
+  if (args.is(2,"-a")){
+    //The rest of the command is a captured line
+    return args.has(3) && J1708ReplayAddLine(args.tok[3]);
+  }
+  else if (args.is(2,"-c")){
+    J1708ReplayReset();
+    return true;
+  }
+  else if (args.is(2,"-g")){
+    if (N_ReplayTotal==0){
+      return false;
+    }
+    J1708ReplayStart();
+    return true;
+  }
+  else if (args.is(2,"-x")){
+    J1708ReplayStop();
+    return true;
+  }
+  else if (args.is(2,"-l")){
+    int value = args.toFlag(3);
+    if (value<0){
+      return false;
+    }
+    ReplayLoop = value;
+    return true;
+  }
+  else if (args.is(2,"-i")){
+    Serial.println("REPLAY STATUS");
+    Serial.print("Replay_Running:");Serial.println(ReplayOn ? "True" : "False");
+    Serial.print("Replay_Loop:");Serial.println(ReplayLoop ? "True" : "False");
+    Serial.print("Replay_Speed:");Serial.println(ReplaySpeed);
+    Serial.print("Buffered_Frames:");Serial.println(N_ReplayTotal);
+    Serial.print("Replayed_Frames:");Serial.println(REPLAY_Counter);
+    Serial.print("Replay_Retries:");Serial.println(REPLAY_Retry_Counter);
+    Serial.print("Last_Drift_Micros:");Serial.println(ReplayDriftLast);
+    Serial.print("Max_Drift_Micros:");Serial.println(ReplayDriftMax);
+    Serial.print("Mean_Drift_Micros:");Serial.println(REPLAY_Counter>0 ? ReplayDriftTotal/REPLAY_Counter : 0);
+    return true;
+  }
+  return false;
+}
+
+bool J1708Core::CmdReplaySpeed(const J1708Args &args, const CommandEntry &entry){
+  float speed = args.toFloat(3);
+  if (speed<=0.0){
+    return false;
+  }
+  ReplaySpeed = speed;
+  Serial.print("Replay_Speed changed to ");Serial.println(ReplaySpeed);
+  return true;
+}
+
+bool J1708Core::CmdGen(const J1708Args &args, const CommandEntry &entry){
+  // j1708gen spX <option> <params>
+  if (args.is(2,"-a")){
+    //-a <MID> <period_ms> <PID.PID...>
+    int mid = args.toHex(3);
+    long period = args.toInt(4);
+    if (mid<0 || period<=0 || period>65535 || !args.has(5)){
+      return false;
+    }
+    uint8_t pids[GenPIDSize];
+    int nPids = (args.len[5]+1)/3;
+    if (nPids>GenPIDSize || args.toHexBytes(5,pids,nPids)<0){
+      return false;
+    }
+    return J1708GenAddECU(mid,pids,nPids,period);
+  }
+  else if (args.is(2,"-b")){
+    //-b <period_ms> <frames>
+    long period = args.toInt(3);
+    long frames = args.toInt(4);
+    if (period<0 || period>65535 || frames<1 || frames>TxQmax){
+      return false;
+    }
+    GenBurstPeriod = period;
+    GenBurstFrames = frames;
+    return true;
+  }
+  else if (args.is(2,"-c")){
+    J1708GenReset();
+    return true;
+  }
+  else if (args.is(2,"-d")){
+    J1708GenDefault();
+    return true;
+  }
+  else if (args.is(2,"-g")){
+    for (int i=0; i<GenECUSize && GenECUs; i++){
+      if (GenECUs[i].used){
+        J1708GenStart();
+        return true;
+      }
+    }
+    return false;
+  }
+  else if (args.is(2,"-l")){
+    float target = args.toFloat(3);
+    if (target<0.0 || target>1.0){
+      return false;
+    }
+    GenTarget = target;
+    GenRate = 1.0;
+    return true;
+  }
+  else if (args.is(2,"-t")){
+    //-t <period_ms> <bytes> <dst.MID>
+    long period = args.toInt(3);
+    long bytes = args.toInt(4);
+    int mid = args.toHex(5);
+    if (period<0 || period>65535 || bytes<22 || bytes>255 || mid<0){
+      return false;
+    }
+    GenTPPeriod = period;
+    GenTPBytes = bytes;
+    GenTPMID = mid;
+    return true;
+  }
+  else if (args.is(2,"-x")){
+    J1708GenStop();
+    return true;
+  }
+  else if (args.is(2,"-i")){
+    Serial.println("GENERATOR STATUS");
+    Serial.print("Generator_Running:");Serial.println(GenOn ? "True" : "False");
+    Serial.print("Target_Busload:");Serial.println(GenTarget);
+    Serial.print("Busload:");Serial.println(busload);
+    Serial.print("Rate_Multiplier:");Serial.println(GenRate);
+    Serial.print("Burst_Period_Millis:");Serial.println(GenBurstPeriod);
+    Serial.print("Burst_Frames:");Serial.println(GenBurstFrames);
+    Serial.print("TP_Period_Millis:");Serial.println(GenTPPeriod);
+    Serial.print("TP_Bytes:");Serial.println(GenTPBytes);
+    Serial.print("Generated_Frames:");Serial.println(GEN_Counter);
+    Serial.print("Skipped_Broadcasts:");Serial.println(GEN_Skipped_Counter);
+    Serial.print("Bursts:");Serial.println(GEN_Burst_Counter);
+    Serial.print("TP_Sessions:");Serial.println(GEN_TP_Counter);
+    Serial.println("ECUs (MID:Period:PIDs)");
+    for (int i=0; i<GenECUSize && GenECUs; i++){
+      GenECU &ecu = GenECUs[i];
+      if (!ecu.used){
+        continue;
+      }
+      sprintf(hexDisp,"%02X",ecu.mid);
+      Serial.print("  ");Serial.print(hexDisp);Serial.print(":");Serial.print(ecu.period);Serial.print(":");
+      for (int k=0; k<ecu.nPids; k++){
+        sprintf(hexDisp,"%02X ",ecu.pids[k]);
+        Serial.print(hexDisp);
+      }
+      Serial.println();
+    }
+    return true;
+  }
+  return false;
+}
+
+bool J1708Core::CmdFilter(const J1708Args &args, const CommandEntry &entry){
+  // j1708config spX -s <-D|-f|-F|-L|-M|-P> <params>
+  switch (entry.opt[1]){
+    case 'M':
+    case 'P': {
+      //-M <MID> <0|1>, -P <PID> <0|1>
+      int id = args.toHex(4);
+      int value = args.toFlag(5);
+      if (id<0 || value<0){
+        return false;
+      }
+      J1708MIDSet &set = entry.opt[1]=='M' ? FilterMIDs : FilterPIDs;
+      set.set(id,value);
+      break;
+    }
+    case 'L': {
+      //-L <min> <max>, frame length with checksum
+      long lo = args.toInt(4);
+      long hi = args.toInt(5);
+      if (!args.has(5) || lo<0 || hi<lo){
+        return false;
+      }
+      FilterLengths = 0;
+      for (long n=lo; n<=hi && n<32; n++){
+        FilterLengths |= 1ul<<n;
+      }
+      break;
+    }
+    case 'D': {
+      //-D <pattern> <mask>, e.g. 80.00.BE FF.00.FF
+      int n = (args.len[4]+1)/3;
+      if (n<1 || n>FilterPatternSize || args.len[5]!=args.len[4]){
+        return false;
+      }
+      if (args.toHexBytes(4,FilterPattern,n)<0 || args.toHexBytes(5,FilterMask,n)<0){
+        FilterPatternLength = 0;
+        J1708FilterCompile();
+        return false;
+      }
+      for (int i=0; i<n; i++){
+        FilterPattern[i] &= FilterMask[i];
+      }
+      FilterPatternLength = n;
+      break;
+    }
+    case 'F':
+      FilterMIDs.fill(false);
+      FilterPIDs.fill(false);
+      FilterLengths = 0xFFFFFFFF;
+      FilterPatternLength = 0;
+      break;
+    case 'f':
+      Serial.println("DISPLAY FILTER");
+      Serial.print("Filter_On:");Serial.println(FilterOn ? "True" : "False");
+      Serial.print("MIDs:");
+      for (int i=0; i<256; i++){
+        if (FilterMIDs.test(i)){
+          sprintf(hexDisp,"%02X ",i);
+          Serial.print(hexDisp);
         }
-        J1708UpdateACL(Loopbuffer[7],true);
-        return 0;
       }
-      else if (security_check==3){
-        if (!ERR9_Tracker[Loopbuffer[7]]){
-          SEC_ERR_Counter++;
-          digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
-          ERR_Counter++;
-          ERR9_Counter++;
+      Serial.println();
+      Serial.print("PIDs:");
+      for (int i=0; i<256; i++){
+        if (FilterPIDs.test(i)){
+          sprintf(hexDisp,"%02X ",i);
+          Serial.print(hexDisp);
         }
-        J1708UpdateACL(Loopbuffer[7],true);
-        return 0;
       }
-      else if (security_check==4){
-        if (!ERR10_Tracker[Loopbuffer[7]]){
-          SEC_ERR_Counter++;
-          digitalWrite(SEC_ERR_LED,!SEC_ERR_LEDState);
-          ERR_Counter++;
-          ERR10_Counter++;
+      Serial.println();
+      Serial.print("Lengths:");
+      for (int i=0; i<32; i++){
+        if ((FilterLengths>>i) & 1){
+          Serial.print(i);Serial.print(" ");
         }
-        J1708UpdateACL(Loopbuffer[7],true);
-        return 0;
       }
-      else {
-        //Received a malformed Security message
-        //Do nothing...
-        return 0;
+      Serial.println();
+      Serial.print("Pattern:");
+      for (int i=0; i<FilterPatternLength; i++){
+        sprintf(hexDisp,"%02X",FilterPattern[i]);
+        Serial.print(hexDisp);Serial.print("/");
+        sprintf(hexDisp,"%02X ",FilterMask[i]);
+        Serial.print(hexDisp);
       }
+      Serial.println();
+      Serial.print("Rejected:");Serial.println(FILTER_Rejected_Counter);
+      return true;
+  }
+  J1708FilterCompile();
+  return true;
+}
+
+bool J1708Core::CmdRewrite(const J1708Args &args, const CommandEntry &entry){
+  // j1708config spX -g -t <MID> <MID>, -g -w <MID> <PID> <value> <mask>, -g -W
+  if (RewriteMIDMap==NULL){
+    return false;
+  }
+  if (entry.opt[1]=='W'){
+    J1708RewriteReset();
+    return true;
+  }
+  int mid = args.toHex(4);
+  int to = args.toHex(5);
+  if (mid<0 || to<0){
+    return false;
+  }
+  if (entry.opt[1]=='t'){
+    RewriteMIDMap[mid] = to;
+    Serial.print("MID ");Serial.print(mid);Serial.print(" forwarded as ");Serial.println(to);
+  }
+  else {
+    int n = (args.len[6]+1)/3;
+    if (N_RewritePatches>=RewritePatchSize || n<1 || n>RewritePatchBytes || args.len[7]!=args.len[6]){
+      return false;
     }
-    //Normal Message Pre-Processing
-    if (GatewaySpecificProcessing){
-      switch(Loopbuffer[2]){ //PID
-        case 128:
-          //Serial.println("PID 128 Received!"); //debug
-          if (selfMID==Loopbuffer[4]){
-            //Component-Specific Request Parameter handler
-          }
-          return 0;
-          break;
-        case 197:
-          //Serial.println("PID 197 Received!"); //debug
-          if (Loopbuffer[4]==selfMID){
-            switch(Loopbuffer[5]){
-              case 1:
-                //Serial.println("RTS Received!");//debug
-                //Run RTS Handler
-                return 1;
-                break;
-              case 2:
-                //Serial.println("CTS Received!");//debug
-                //Run CTS Handler
-                return 2;
-                break;
-              case 3:
-                //Serial.println("EOM Received!");//debug
-                //Run EOM Handler
-                return 3;
-                break;
-              case 255:
-                //Serial.println("Abort Received!");//debug
-                //Run Abort Handler
-                return 4;
-                break;
-            }
-          }
-          return 0;
-          break;
-        case 198:
-          //Serial.println("PID 198 Received!"); //debug
-          if (Loopbuffer[4]==selfMID){
-            //Serial.println("CDP Received!"); //debug
-            //CDPHandler
-            return 5;
-            break;
-          }
-        default:
-          break;
-      }
-      return 0;
+    RewritePatch &p = RewritePatches[N_RewritePatches];
+    if (args.toHexBytes(6,p.value,n)<0 || args.toHexBytes(7,p.mask,n)<0){
+      return false;
     }
-    else{
-      return 0;
+    p.mid = mid;
+    p.pid = to;
+    p.len = n;
+    N_RewritePatches++;
+    RewritePatchMIDs.set(mid);
+  }
+  RewriteOn = true;
+  return true;
+}
+
+bool J1708Core::CmdDedup(const J1708Args &args, const CommandEntry &entry){
+  // j1708config spX -g -d <0|1>, -g -D <ms>
+  if (DedupTable==NULL){
+    return false;
+  }
+  if (entry.opt[1]=='d'){
+    int value = args.toFlag(4);
+    if (value<0){
+      return false;
     }
-    return 0;
+    DedupOn = value;
+    memset((void *)DedupTable,0,DedupSize*sizeof(DedupEntry));
+    return true;
   }
-  return 0;
+  long ms = args.toInt(4);
+  if (!args.has(4) || ms<1){
+    return false;
+  }
+  DedupRefresh = ms;
+  Serial.print("Dedup_Refresh changed to ");Serial.println(DedupRefresh);
+  return true;
 }
 
-void J1708::J1708Listen(){
-  if (J1708Rx(J1708RxBuffer)>0){
-    if (J1708CheckACL(J1708RxBuffer[1])){
-      if (J1708Object_Linked){
-        if (Rx_Forwarding){
-          _j1708Ref->J1708Send(J1708RxBuffer+1,J1708FrameLength,0);
-          FWD_Counter++;
-        }
+bool J1708Core::CmdSample(const J1708Args &args, const CommandEntry &entry){
+  // j1708config spX -s <-B|-I|-N|-S> <value>
+  if (SampleMIDs==NULL || !args.has(4)){
+    return false;
+  }
+  long value = args.toInt(4);
+  switch (entry.opt[1]){
+    case 'B':
+      SampleBusload = args.toFloat(4);
+      return true;
+    case 'I':
+      if (value<1 || value>60000){
+        return false;
       }
-    }
-    if (RxLEDOn){
-      if (RxLEDState){
-        RxLEDState = false;
-        digitalWrite(RxLED,RxLEDState);
+      SampleInterval = value;
+      return true;
+    case 'N':
+      if (value<0 || value>60000){
+        return false;
       }
-      else{
-        RxLEDState = true;
-        digitalWrite(RxLED,RxLEDState);
-      }
-    }
-    if (ShowTime){
-      Serial.print("(");
-      Serial.print(SerialTimer);
-      Serial.print(")");
-      Serial.print(" ");
-    }
-    if (ShowPort){
-      Serial.print("SP");
-      Serial.print(selfPN);
-      Serial.print(" ");
-    }
-    if (ShowLength){
-      Serial.print("[");
-      Serial.print(J1708FrameLength);
-      Serial.print("]");
-      Serial.print(" ");
-    }
-    for (int i = 1; i < J1708FrameLength; i++){ //start at 1 to exclude 0x00 start value
-      J1708Checksum += J1708RxBuffer[i];
-      if (ShowRxData){
-        sprintf(hexDisp,"%02X ",J1708RxBuffer[i]);
-        Serial.print(hexDisp);
+      SampleEvery = value;
+      return true;
+    case 'S':
+      if (value<SampleOff || value>SampleAlways){
+        return false;
       }
+      SampleMode = value;
+      if (SampleMode==SampleOff && SampleActive){
+        J1708SampleEnd();
+      }
+      return true;
+  }
+  return false;
+}
+
+bool J1708Core::CmdEEPROM(const J1708Args &args, const CommandEntry &entry){
+  // j1708config spX -E <option> <value>
+  if (args.is(3,"-a")){
+    int value = args.toFlag(4);
+    if (value<0){
+      return false;
+    }
+    ConfigAutosave = value;
+    return J1708ConfigSave();
+  }
+  else if (args.is(3,"-c")){
+    J1708ConfigErase();
+    Serial.println("EEPROM settings erased");
+    return true;
+  }
+  else if (args.is(3,"-i")){
+    J1708ConfigScan();
+    Serial.println("EEPROM SETTINGS");
+    Serial.print("Autosave:");Serial.println(ConfigAutosave ? "True" : "False");
+    Serial.print("Restored:");Serial.println(ConfigRestored ? "True" : "False");
+    Serial.print("Slot:");Serial.print(ConfigSlot);Serial.print("/");Serial.println(J1708ConfigSlots);
+    Serial.print("Record_Bytes:");Serial.println((int)sizeof(J1708Config));
+    char crc[5];
+    sprintf(crc,"%04X",ConfigSavedCRC);
+    Serial.print("Saved_CRC:");Serial.println(crc);
+    J1708Config config;
+    J1708ConfigBuild(config);
+    Serial.print("Unsaved_Changes:");Serial.println(config.crc!=ConfigSavedCRC ? "True" : "False");
+    Serial.print("Saves:");Serial.println(CONFIG_Save_Counter);
+    Serial.print("Failed_Saves:");Serial.println(CONFIG_Fail_Counter);
+    return true;
+  }
+  else if (args.is(3,"-l")){
+    if (!J1708ConfigLoad()){
+      Serial.println("No EEPROM settings for this port");
+      return false;
+    }
+    return true;
+  }
+  else if (args.is(3,"-s")){
+    return J1708ConfigSave();
+  }
+  return false;
+}
+
+bool J1708Core::CmdCapture(const J1708Args &args, const CommandEntry &entry){
+  // j1708capture spX <option> <params>
+  if (CaptureRing==NULL){
+    return false;
+  }
+  if (args.is(2,"-e")){
+    //-e <1-11> <0|1>
+    long n = args.toInt(3);
+    int value = args.toFlag(4);
+    if (n<1 || n>ErrorCodes || value<0){
+      return false;
+    }
+    CaptureErrSeen[n] = J1708ErrorCount(n);
+    if (value){
+      CaptureErrMask |= 1u<<n;
+    }
+    else {
+      CaptureErrMask &= ~(1u<<n);
+    }
+    return true;
+  }
+  else if (args.is(2,"-m")){
+    //-m <MID> <0|1>
+    int mid = args.toHex(3);
+    int value = args.toFlag(4);
+    if (mid<0 || value<0){
+      return false;
+    }
+    CaptureMIDs.set(mid,value);
+    return true;
+  }
+  else if (args.is(2,"-p")){
+    //-p <pattern> <mask>, e.g. 80.00.BE 'FF.00.FF'
+    int n = (args.len[3]+1)/3;
+    if (n<1 || n>CapturePatternSize || args.len[4]!=args.len[3]){
+      return false;
+    }
+    if (args.toHexBytes(3,CapturePattern,n)<0 || args.toHexBytes(4,CaptureMask,n)<0){
+      CapturePatternLength = 0;
+      return false;
+    }
+    for (int i=0; i<n; i++){
+      CapturePattern[i] &= CaptureMask[i];
+    }
+    CapturePatternLength = n;
+    return true;
+  }
+  else if (args.is(2,"-a")){
+    //-a <frames after the trigger>
+    long n = args.toInt(3);
+    if (!args.has(3) || n<0 || n>255){
+      return false;
     }
-    if (ShowChecksum){
-      uint8_t chk = 0;
-      for (int i=1; i<(J1708FrameLength);i++){
-        chk+=J1708RxBuffer[i];
+    CapturePost = n;
+    return true;
+  }
+  else if (args.is(2,"-c")){
+    CaptureErrMask = 0;
+    CaptureMIDs.fill(false);
+    CapturePatternLength = 0;
+    return true;
+  }
+  else if (args.is(2,"-d")){
+    J1708CapturePrint();
+    return true;
+  }
+  else if (args.is(2,"-g")){
+    J1708CaptureArm();
+    return true;
+  }
+  else if (args.is(2,"-i")){
+    Serial.println("CAPTURE STATUS");
+    Serial.print("Frozen:");Serial.println(CaptureFrozen ? "True" : "False");
+    Serial.print("Buffered_Frames:");Serial.println(CaptureFrames);
+    Serial.print("Buffered_Bytes:");Serial.println(CaptureUsed);
+    Serial.print("Post_Trigger_Frames:");Serial.println(CapturePost);
+    Serial.print("Triggers_Fired:");Serial.println(CAPTURE_Counter);
+    Serial.print("Last_Trigger:");Serial.println(CaptureReason[0] ? CaptureReason : "-");
+    Serial.print("Error_Triggers:");
+    for (int n=1; n<=ErrorCodes; n++){
+      if (CaptureErrMask & (1u<<n)){
+        Serial.print("ERR");Serial.print(n);Serial.print(" ");
       }
-      chk=((~chk<<24)>>24)+1;
-      Serial.print("C:");
-      Serial.print(chk);
-      Serial.print(" ");
     }
-    if (ShowBusload){
-      Serial.print("[");Serial.print(busload);Serial.print("] ");
+    Serial.println();
+    Serial.print("MID_Triggers:");
+    for (int mid=0; mid<256; mid++){
+      if (CaptureMIDs.test(mid)){
+        sprintf(hexDisp,"%02X ",mid);
+        Serial.print(hexDisp);
+      }
     }
-    if (ShowMIDShare){
-      Serial.print("[");Serial.print(MIDShareTracker[J1708RxBuffer[1]]);Serial.print("] ");
+    Serial.println();
+    Serial.print("Pattern_Trigger:");
+    for (int i=0; i<CapturePatternLength; i++){
+      sprintf(hexDisp,"%02X",CapturePattern[i]);
+      Serial.print(hexDisp);Serial.print("/");
+      sprintf(hexDisp,"%02X ",CaptureMask[i]);
+      Serial.print(hexDisp);
     }
-    if (!ShowTime && !ShowPort && !ShowLength && !ShowRxData && !ShowChecksum && !ShowBusload && !ShowMIDShare){
-      //Nothing will be printed because all flags set false
+    Serial.println();
+    return true;
+  }
+  return false;
+}
+
+bool J1708Core::CmdShape(const J1708Args &args, const CommandEntry &entry){
+  // j1708shape spX <option> <params>
+  if (args.is(2,"-m")){
+    //-m <MID> <chars/s> <burst chars>, rate 0 removes the rule
+    int mid = args.toHex(3);
+    long rate = args.toInt(4);
+    long burst = args.toInt(5);
+    if (ShapeMIDs==NULL || mid<0 || rate<0 || rate>0xFFFF || burst<1 || burst>0xFFFF){
+      return false;
     }
-    else{
-      Serial.println();
+    int i = 0;
+    while (i<N_ShapeRules && ShapeRules[i].mid!=mid){
+      i++;
     }
-    if(!tx_transmitting){
-      if (J1708LoopTimer>P){
-        if (fx!=0){
-          switch(fx){
-            case 1:
-              RTS_Handler(Loopbuffer);
-              break;
-            case 2:
-              CTS_Handler(Loopbuffer);
-              break;
-            case 3:
-              EOM_Handler(Loopbuffer);
-              break;
-            case 4:
-              Abort_Handler(Loopbuffer);
-              break;
-            case 5:
-              CDP_Handler(Loopbuffer);
-              break;
-            default:
-              break;
-          }
-          fx=0;
-          P =C_Rate;
-          Loop_flag = false;
-        }
-        else{
-          P = N_Rate;
-          fx = J1708Parse();
-          if (fx>0){
-            Loop_flag = true;
-          }
-          else{
-            Loop_flag=false;
-          }
-        }
-        J1708LoopTimer = 0;
+    if (rate==0){
+      if (i<N_ShapeRules){
+        ShapeRules[i] = ShapeRules[--N_ShapeRules];
       }
-      else {
-        if (fx>0){
-          //Wait Until next scheduled send.
-        }
-        else{
-          fx = J1708Parse();
-          if (fx>0){
-            Loop_flag = true;
-          }
-          else{
-            Loop_flag=false;
-          }
-        }    
+    }
+    else if (i<ShapeRuleSize){
+      ShapeRules[i] = {(uint8_t)mid,(uint16_t)rate,(uint16_t)burst};
+      if (i==N_ShapeRules){
+        N_ShapeRules++;
       }
     }
-    else{
-      tx_transmitting=false;
+    else {
+      return false;
     }
+    J1708ShapeReset();
+    return true;
   }
-  else{
-    //Check if a message is in the middle of being received (ie is the line idle?)
-    if (!rx_busy){
-      uint8_t priority = J1708TxQPriorities[N_TxQ];
-      if (J1708TxTimer > (twelvebit+(onebit*priority*2)) + TxQueuePenalty*PenaltyTime){
-        // Transport CTS Messages (queue #1)
-        if (Q_flag){
-          uint8_t Q_Message[Q_Lengths[Q_Counter]] = {};
-          for (int i=0;i<Q_Lengths[Q_Counter];i++){
-            Q_Message[i] = Q_Matrix[Q_Counter][i];
-          }
-          J1708Tx(Q_Message,Q_Lengths[Q_Counter],8);
-          if (Q_Counter+1==TP_Tx_NSegments){
-            Q_flag=false;
-            Q_Counter = 0;
-          }
-          else{
-            Q_Counter++;
-          }
-        }
-        // Tx Queue Logic (queue #2)
-        else if (N_TxQ_Total > 0){
-          if (N_TxQ==TxQmax-1){
-            // uint8_t J1708TxBuffer[J1708TxQLengths[N_TxQ]];
-            // for (int i=0;i<J1708TxQLengths[N_TxQ];i++){
-            //   J1708TxBuffer[i] = J1708TxQ[N_TxQ][i];
-            // }
-            //Serial.print("Before: N_TxQ:");Serial.print(N_TxQ);Serial.print(",N_TxQ_Total:");Serial.println(N_TxQ_Total);
-            J1708Tx(J1708TxQ[N_TxQ],J1708TxQLengths[N_TxQ],J1708TxQPriorities[N_TxQ]);
-            N_TxQ=0;
-            N_TxQ_Total--;
-            //Serial.print("After: N_TxQ:");Serial.print(N_TxQ);Serial.print(",N_TxQ_Total:");Serial.println(N_TxQ_Total);
-          }
-          else if (N_TxQ>=0){
-            // uint8_t J1708TxBuffer[J1708TxQLengths[N_TxQ]];
-            // for (int i=0;i<J1708TxQLengths[N_TxQ];i++){
-            //   J1708TxBuffer[i] = J1708TxQ[N_TxQ][i];
-            // }
-            //Serial.print("Before: N_TxQ:");Serial.print(N_TxQ);Serial.print(",N_TxQ_Total:");Serial.println(N_TxQ_Total);
-            J1708Tx(J1708TxQ[N_TxQ],J1708TxQLengths[N_TxQ],J1708TxQPriorities[N_TxQ]);
-            N_TxQ++;
-            N_TxQ_Total--;
-            //Serial.print("After: N_TxQ:");Serial.print(N_TxQ);Serial.print(",N_TxQ_Total:");Serial.println(N_TxQ_Total);
-          }
-        }
+  else if (args.is(2,"-d")){
+    //-d <chars/s> <burst chars>, budget of every MID without a rule
+    long rate = args.toInt(3);
+    long burst = args.toInt(4);
+    if (ShapeMIDs==NULL || rate<0 || rate>0xFFFF || burst<1 || burst>0xFFFF){
+      return false;
+    }
+    ShapeMIDRate = rate;
+    ShapeMIDBurst = burst;
+    J1708ShapeReset();
+    return true;
+  }
+  else if (args.is(2,"-p")){
+    //-p <priority 0-8> <chars/s> <burst chars>, 0 is forwarded traffic
+    long priority = args.toInt(3);
+    long rate = args.toInt(4);
+    long burst = args.toInt(5);
+    if (ShapePriority==NULL || !args.has(3) || priority<0 || priority>8 || rate<0 || rate>0xFFFF || burst<1 || burst>0xFFFF){
+      return false;
+    }
+    ShapePriorityRate[priority] = rate;
+    ShapePriorityBurst[priority] = burst;
+    J1708ShapeReset();
+    return true;
+  }
+  else if (args.is(2,"-c")){
+    N_ShapeRules = 0;
+    ShapeMIDRate = 0;
+    if (ShapePriorityRate){
+      memset(ShapePriorityRate,0,sizeof(ShapePriorityRate[0])*9);
+    }
+    J1708ShapeReset();
+    return true;
+  }
+  else if (args.is(2,"-i")){
+    Serial.println("SHAPING STATUS");
+    Serial.print("Shaping:");Serial.println(ShapeOn ? "True" : "False");
+    Serial.print("Held_Frames:");Serial.println(SHAPE_Held_Counter);
+    Serial.print("Bypassed_Frames:");Serial.println(SHAPE_Bypass_Counter);
+    Serial.print("Queued_Frames:");Serial.println(N_TxQ_Total);
+    Serial.print("Default_MID_Budget:");Serial.print(ShapeMIDRate);Serial.print("/");Serial.println(ShapeMIDBurst);
+    uint16_t now = millis();
+    for (int mid=0; mid<256 && ShapeMIDs; mid++){
+      uint16_t rate, burst;
+      J1708ShapeBudget(mid,rate,burst);
+      if (rate==0 || (ShapeMIDs[mid].held==0 && ShapeMIDs[mid].tokens>=(int32_t)burst*1000)){
+        continue;
       }
+      J1708ShapeRefill(ShapeMIDs[mid],rate,burst,now);
+      sprintf(hexDisp,"%02X",mid);
+      Serial.print("MID_");Serial.print(hexDisp);Serial.print(":");
+      Serial.print(rate);Serial.print("/");Serial.print(burst);
+      Serial.print(" Tokens:");Serial.print(ShapeMIDs[mid].tokens/1000);
+      Serial.print(" Held:");Serial.println(ShapeMIDs[mid].held);
     }
-    //Is there a relevant message in the loopbuffer that needs to be handled?
-    if (fx!=0){
-      switch(fx){
-        case 1:
-          RTS_Handler(Loopbuffer);
-          break;
-        case 2:
-          CTS_Handler(Loopbuffer);
-          break;
-        case 3:
-          EOM_Handler(Loopbuffer);
-          break;
-        case 4:
-          Abort_Handler(Loopbuffer);
-          break;
-        case 5:
-          CDP_Handler(Loopbuffer);
-          break;
-        default:
-          break;
+    for (int i=0; i<9 && ShapePriority; i++){
+      if (ShapePriorityRate[i]==0){
+        continue;
       }
-      fx=0;
-      P =C_Rate;
-      Loop_flag = false;
+      J1708ShapeRefill(ShapePriority[i],ShapePriorityRate[i],ShapePriorityBurst[i],now);
+      Serial.print("Priority_");Serial.print(i);Serial.print(":");
+      Serial.print(ShapePriorityRate[i]);Serial.print("/");Serial.print(ShapePriorityBurst[i]);
+      Serial.print(" Tokens:");Serial.print(ShapePriority[i].tokens/1000);
+      Serial.print(" Held:");Serial.println(ShapePriority[i].held);
+    }
+    return true;
+  }
+  return false;
+}
+
+bool J1708Core::CmdWatch(const J1708Args &args, const CommandEntry &entry){
+  //-s -w <us>, 0-off
+  long stall = args.toInt(4);
+  if (!args.has(4) || stall<0){
+    return false;
+  }
+  WatchStall = stall;
+  return true;
+}
+
+bool J1708Core::CmdExport(const J1708Args &args, const CommandEntry &entry){
+  //-s -x <b|j|0> [ms], without a period the record is written once
+  uint8_t format;
+  if (args.is(4,"b")){
+    format = ExportBinary;
+  }
+  else if (args.is(4,"j")){
+    format = ExportJSON;
+  }
+  else if (args.is(4,"0")){
+    ExportFormat = ExportOff;
+    return true;
+  }
+  else {
+    return false;
+  }
+  long period = args.toInt(5);
+  if (period<0){
+    return false;
+  }
+  if (period==0){
+    return J1708Export(format)>0;
+  }
+  ExportFormat = format;
+  ExportMillis = period;
+  ExportTimer = 0;
+  return true;
+}
+
+bool J1708Core::CmdShowProfile(const J1708Args &args, const CommandEntry &entry){
+  J1708ProfilePrint();
+  return true;
+}
+
+bool J1708Core::CmdSendTransport(const J1708Args &args, const CommandEntry &entry){
+  // j1708send spX -T <dst.MID> <payload_size> <payload>
+  int destinationAddr = args.toHex(3);
+  if (destinationAddr<0 || !args.has(5)){
+    return false;
+  }
+  long payloadsize = args.toInt(4);
+  // Send a long message
+  if (payloadsize>19 && payloadsize<256){
+    uint8_t msg[payloadsize];
+    if (args.toHexBytes(5,msg,payloadsize)<0){
+      return false;
+    }
+    if (J1708TransportTx(msg,payloadsize,(uint8_t)destinationAddr)){
+      return true;
+    }
+  }
+  return false;
+}
+
+bool J1708Core::CmdSend(const J1708Args &args, const CommandEntry &entry){
+  // j1708send spX <payload_size> <payload>
+  if (!args.has(3)){
+    return false;
+  }
+  long msgLen = args.toInt(2);
+  //Send standard Sized Message
+  if (msgLen>0 && msgLen<21){
+    uint8_t msg[msgLen+1];
+    if (args.toHexBytes(3,msg,msgLen)<0){
+      return false;
     }
+    J1708Send(msg,msgLen+1,8);
+    return true;
   }
-  //Periodic Tasks
-  UpdateNetworkStatistics();
-  J1708CheckNetwork();
-  if (ERR8_Timer > ERR8_Interval && ERR7_IDCounter[selfMID]>ERR7_Limit){
-    uint8_t msg[9] = {selfMID,255,255,250,3,2,selfMID,(uint8_t)ERR8_Counter,0};
-    J1708Send(msg,9,3);
-    ERR8_Timer = 0;
+  return false;
+}
+
+// Merged Capture
+bool J1708Merge::attach(J1708Core *port){
+  if (N_Ports>=MaxPorts){
+    return false;
   }
+  port->_mergeRef = this;
+  port->_mergeIndex = N_Ports;
+  ports[N_Ports++] = port;
+  return true;
 }
 
-bool J1708::J1708TransportTx(uint8_t TP_Data[], const uint16_t &nBytes, const uint8_t &D_MID){
-  if (!TP_Tx_Flag && !TP_Rx_Flag){
-    if (nBytes>21 && nBytes<256){
-      int whole_seg = nBytes/TP_Default_Segment_Size;
-      int part_seg = nBytes%TP_Default_Segment_Size;
-      int seg = whole_seg;
-      if (part_seg>1){
-        seg++;
+void J1708Merge::J1708MergePush(uint8_t index, const uint8_t frame[], const uint8_t &FrameLength, const uint32_t &time, const uint16_t &suppressed){
+  while (count[index]==RingSize){
+    //Ring full. Print the earliest frames now, even if a slower port may still deliver an earlier one.
+    J1708MergeEmit(true);
+    MERGE_Forced_Counter++;
+  }
+  Frame &f = rings[index][(head[index]+count[index]) % RingSize];
+  f.time = time;
+  f.length = FrameLength;
+  f.suppressed = suppressed;
+  memcpy(f.data, frame, FrameLength+1);
+  count[index]++;
+}
+
+bool J1708Merge::J1708MergeEmit(bool force){
+  // k-way merge: the earliest ring head is printed once every port with an empty ring
+  // is known to deliver only later frames (idle, or receiving a frame that started later).
+  int first = -1;
+  for (int i=0; i<N_Ports; i++){
+    if (count[i]>0 && (first<0 || (int32_t)(rings[i][head[i]].time-rings[first][head[first]].time)<0)){
+      first = i;
+    }
+  }
+  if (first<0){
+    return false;
+  }
+  Frame &f = rings[first][head[first]];
+  if (!force){
+    uint32_t now = J1708Time();
+    for (int i=0; i<N_Ports; i++){
+      if (count[i]>0){
+        continue;
       }
-      TP_Tx_NBytes=nBytes;
-      TP_Tx_NSegments=seg;
-      TP_Session_MID = D_MID;
-      //Load Data into buffer
-      for (int i=0; i<nBytes; i++){
-        TP_Tx_Buffer[i] = TP_Data[i];
+      uint32_t bound = ports[i]->J1708ByteCount>0 ? ports[i]->J1708FrameTime : now;
+      if ((int32_t)(bound-f.time)<0){
+        return false;
       }
-      uint8_t RTS_message[] = {selfMID,197,5,D_MID,1,(uint8_t)seg,(uint8_t)((nBytes<<8)>>8),(uint8_t)(nBytes>>8),0};
-      J1708Send(RTS_message,9,8);
-      TP_Tx_Flag = true;
-      TP_Session_Timer = 0;
-      return 1;
-    }
-    else{
-      //Small enough message to send in normal frame.
-      return 0;
     }
   }
-  else{
-    //Busy with another connection or data too large for TP_Tx_Buffer.
-    return 0;
+  ports[first]->J1708PrintFrame(f.data,f.length,f.time,f.suppressed);
+  head[first] = (head[first]+1) % RingSize;
+  count[first]--;
+  MERGE_Counter++;
+  return true;
+}
+
+void J1708Merge::J1708MergeUpdate(){
+  while (J1708MergeEmit(false)){
   }
 }
 
-void J1708::J1708Log(){
-  // This function can replace J1708Listen. It will only print messages to Serial. No other interactions.
-  if (J1708Rx(J1708RxBuffer)>0){ //Execute this if the number of recieved bytes is more than zero.
-    if (RxLEDOn){
-      if (RxLEDState){
-        RxLEDState = false;
-        digitalWrite(RxLED,RxLEDState);
-      }
-      else{
-        RxLEDState = true;
-        digitalWrite(RxLED,RxLEDState);
-      }
-    }
-    if (ShowTime){
-      Serial.print("(");
-      Serial.print(SerialTimer);
-      Serial.print(")");
-      Serial.print(" ");
-    }
-    if (ShowPort){
-      Serial.print("SP");
-      Serial.print(selfPN);
-      Serial.print(" ");
-    }
-    if (ShowLength){
-      Serial.print("[");
-      Serial.print(J1708FrameLength);
-      Serial.print("]");
-      Serial.print(" ");
-    }
-    for (int i = 1; i < J1708FrameLength; i++){ //start at 1 to exclude 0x00 start value
-      J1708Checksum += J1708RxBuffer[i];
-      if (ShowRxData){
-        sprintf(hexDisp,"%02X ",J1708RxBuffer[i]);
-        Serial.print(hexDisp);
-      }
-    }
-    if (ShowChecksum){
-      uint8_t chk = 0;
-      for (int i=1; i<(J1708FrameLength);i++){
-        chk+=J1708RxBuffer[i];
+// Port Group
+bool J1708Group::add(J1708Core *port){
+  if (N_Ports>=MaxPorts){
+    return false;
+  }
+  ports[N_Ports++] = port;
+  return true;
+}
+
+void J1708Group::J1708GroupUpdate(){
+  if (SweepTimer>=SweepMillis){
+    ready = (1u<<N_Ports)-1;
+    SweepTimer = 0;
+    SWEEP_Counter++;
+  }
+  else {
+    ready = 0;
+    for (int i=0; i<N_Ports; i++){
+      if (ports[i]->J1708Pending()){
+        ready |= 1u<<i;
       }
-      chk=((~chk<<24)>>24)+1;
-      Serial.print("C:");
-      Serial.print(chk);
-      Serial.print(" ");
-    }
-    if (ShowBusload){
-      Serial.print("[");Serial.print(busload);Serial.print("] ");
     }
-    if (ShowMIDShare){
-      Serial.print("[");Serial.print(MIDShareTracker[J1708RxBuffer[1]]);Serial.print("] ");
-    }
-    if (!ShowTime && !ShowPort && !ShowLength && !ShowRxData && !ShowChecksum && !ShowBusload && !ShowMIDShare){
-      //Nothing will be printed because all flags set false
+  }
+  uint8_t pending = ready;
+  while (pending){
+    int i = __builtin_ctz(pending);
+    pending &= pending-1;
+    if (BudgetMicros>0){
+      ports[i]->J1708Update(BudgetMicros);
     }
-    else{
-      Serial.println();
+    else {
+      ports[i]->J1708Update();
     }
+    UPDATE_Counter++;
   }
 }
 
-void J1708::J1708Update(){
-  if (selfMode==Gateway){
-    J1708Listen();
+// Binary Host Protocol
+bool J1708Host::attach(J1708Core *port){
+  if (N_Ports>=MaxPorts){
+    return false;
   }
-  else if (selfMode==Observer){
-    J1708Log();
+  ports[N_Ports++] = port;
+  return true;
+}
+
+J1708Core *J1708Host::FindPort(uint8_t port_number){
+  for (int i=0; i<N_Ports; i++){
+    if (ports[i]->selfPN==port_number){
+      return ports[i];
+    }
   }
+  return NULL;
 }
 
-bool J1708::J1708Settings(String &command){
-  // Commands contain 4 fields: cmd spx | sbc | opt | val
-  if (ShowCommand){
-    Serial.println(command);
+bool J1708Host::J1708HostRx(uint8_t c){
+  // Returns true if the byte belongs to a binary packet. Other bytes are left to the text command parser.
+  if (state!=Idle && PacketTimer>PacketTimeout){
+    //Incomplete packet. Drop it.
+    state = Idle;
+    ERR_Counter++;
   }
-  String temp;
-  if (getValue(command,' ',0)=="j1708config"){
-    temp = getValue(command,' ',2);
-    if (temp=="-g"){
-      if (getValue(command,' ',3)=="-h"){
-        if (getValue(command,' ',4)=="0"){
-          selfHostPort = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          selfHostPort = true;
-          return true;
-        }
-        return false;
-      }
-      else if (getValue(command,' ',3)=="-f"){
-        if (getValue(command,' ',4)=="0"){
-          Rx_Forwarding = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          Rx_Forwarding = true;
-          return true;
-        }
+  PacketTimer = 0;
+  switch (state){
+    case Idle:
+      if (c!=Sync){
         return false;
       }
-      else if (getValue(command,' ',3)=="-a"){
-        if (getValue(command,' ',4)>0){
-          int temp = string2Hex(getValue(command,' ',4));
-          if (temp>=0){
-            J1708UpdateACL(temp,true);
-            Serial.print("MID added to blocklist:");Serial.println(temp);
-            return true;
-          }
-          else{
-            return false;
-          }
-        }
-      }
-      else if (getValue(command,' ',3)=="-m"){
-        if (getValue(command,' ',4)>0){
-          int temp = string2Hex(getValue(command,' ',4));
-          if (temp>=0){
-            selfMID = (uint8_t)temp;
-            Serial.print("Self_MID changed to ");Serial.println(temp);
-            return true;
-          }
-          else{
-            return false;
-          }
-        }
-      }
-      else if (getValue(command,' ',3)=="-M"){
-        if (getValue(command,' ',4)>0){
-          temp = getValue(command,' ',4);
-          float target = (float)temp.toFloat();
-          if (temp>=0){
-            maxMIDShare = target;
-            Serial.print("Max_MID changed to ");Serial.println(target);
-            return true;
-          }
-          else{
-            return false;
-          }
-        }
-      }
-      else if (getValue(command,' ',3)=="-b"){
-        if (getValue(command,' ',4)>0){
-          temp = getValue(command,' ',4);
-          float target = (float)temp.toFloat();
-          if (temp>=0){
-            maxBusload = target;
-            Serial.print("Max_Busload changed to ");Serial.println(target);
-            return true;
-          }
-          else{
-            return false;
-          }
-        }
-      }
-      else if (getValue(command,' ',3)=="-r"){
-        if (getValue(command,' ',4)>0){
-          int temp = string2Hex(getValue(command,' ',4));
-          if (temp>=0){
-            J1708UpdateACL(temp,false);
-            Serial.print("MID removed from blocklist:");Serial.println(temp);
-            return true;
-          }
-          else{
-            return false;
-          }
-        }
+      rxSum = 0;
+      state = Type;
+      return true;
+    case Type:
+      rxType = c;
+      state = Seq;
+      break;
+    case Seq:
+      rxSeq = c;
+      state = Length;
+      break;
+    case Length:
+      rxLength = c;
+      rxCount = 0;
+      state = rxLength>0 ? Payload : Checksum;
+      break;
+    case Payload:
+      rxPayload[rxCount++] = c;
+      if (rxCount==rxLength){
+        state = Checksum;
       }
-      if (getValue(command,' ',3)=="-p"){
-        if (getValue(command,' ',4)=="0"){
-          GatewaySpecificProcessing = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          GatewaySpecificProcessing = true;
-          return true;
-        }
-        return false;
+      break;
+    case Checksum:
+      rxSum += c;
+      state = Idle;
+      if (rxSum!=0){
+        ERR_Counter++;
+        uint8_t ack[3] = {BadPacket,0,0};
+        J1708HostTx(ACK,rxSeq,ack,3);
+        return true;
       }
-      return false;
-    }
-    else if (temp=="-h"){
-      Serial.print("j1708config sp<port_no> <subcommand>\n  -g GATEWAY <option> <value>\n    -a <MID>      add MID to ACL\n    -b <float>    max allowable busload\n    -h <0|1>      designate port as 'host port'\n    -f <0|1>      forward rx data to linked port\n    -m <MID>      change the gateway MID (ACL settings preserved)\n    -M <float>    max allowable MID share of max busload\n    -p <0|1>      process gateway specific requests\n    -r <MID>      remove MID from ACL \n  -h HELP\n  -H HARDWARE <option> <value>\n    -r <0|1>      rx LED ON/OFF \n    -t <0|1>      tx LED ON/OFF \n    -s <0|1>      security LED ON/OFF \n  -r RESET <option>\n    -a            ACL allow all\n    -b            ACL block all\n    -c            message counters\n    -e            error counters\n    -t            message timer\n  -s SHOW <option> <value>\n    -a            all\n    -A <0|1>      show ACL\n    -b <0|1>      busload\n    -c <0|1>      checksum\n    -C <0|1>      command\n    -d            default\n    -e <0|1>      non-security errors\n    -l <0|1>      data length\n    -m <0|1>      busload by MID\n    -n            none\n    -p <0|1>      port\n    -r <0|1>      rx data\n    -s            statistics\n    -T <0|1>      time\n");
+      RX_Counter++;
+      HandlePacket();
       return true;
+  }
+  rxSum += c;
+  return true;
+}
+
+void J1708Host::J1708HostTx(uint8_t type, uint8_t seq, const uint8_t payload[], uint8_t len){
+  // Assembled in one buffer and written in one call so it is never split by other Serial output.
+  uint8_t packet[MaxPayload+5];
+  memcpy(packet+4,payload,len);
+  _hostRef->write(packet,J1708HostSeal(packet,type,seq,len));
+}
+
+int J1708Host::J1708HostSeal(uint8_t packet[], uint8_t type, uint8_t seq, uint8_t len){
+  // Adds the header and checksum around a payload already at packet[4]. Returns the packet length.
+  uint8_t sum = type+seq+len;
+  packet[0] = Sync;
+  packet[1] = type;
+  packet[2] = seq;
+  packet[3] = len;
+  for (int i=0; i<len; i++){
+    sum += packet[4+i];
+  }
+  packet[4+len] = (uint8_t)(~sum+1);
+  return len+5;
+}
+
+void J1708Host::HandlePacket(){
+  if (rxType==PING){
+    uint32_t now = micros();
+    uint8_t time[4] = {(uint8_t)now,(uint8_t)(now>>8),(uint8_t)(now>>16),(uint8_t)(now>>24)};
+    J1708HostTx(TIME,rxSeq,time,4);
+    return;
+  }
+  uint8_t accepted = 0;
+  uint8_t status = UnknownType;
+  if (rxType==SEND){
+    status = HandleSend(accepted);
+  }
+  else if (rxType==REPLAY){
+    status = HandleReplay(accepted);
+  }
+  //Every ACK carries the free queue slots of each port so the host can pace itself.
+  uint8_t ack[3+MaxPorts*4];
+  uint8_t n = 0;
+  ack[n++] = status;
+  ack[n++] = accepted;
+  ack[n++] = N_Ports;
+  for (int i=0; i<N_Ports; i++){
+    ack[n++] = ports[i]->selfPN;
+    ack[n++] = ports[i]->J1708TxQFree();
+    ack[n++] = ports[i]->J1708TxSched ? J1708Core::TxSchedSize-ports[i]->N_TxSched : 0;
+    ack[n++] = ports[i]->J1708Replay ? J1708Core::ReplaySize-ports[i]->N_ReplayTotal : 0;
+  }
+  J1708HostTx(ACK,rxSeq,ack,n);
+}
+
+uint8_t J1708Host::HandleSend(uint8_t &accepted){
+  // Frames are queued in order. The first one that cannot be queued stops the batch.
+  if (rxLength<1){
+    return BadPacket;
+  }
+  uint8_t count = rxPayload[0];
+  int i = 1;
+  for (int k=0; k<count; k++){
+    if (i+7>rxLength){
+      return BadPacket;
     }
-    else if (temp=="-H"){
-      if (getValue(command,' ',3)=="-r"){
-        if (getValue(command,' ',4)=="0"){
-          RxLEDOn = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          RxLEDOn = true;
-          return true;
-        }
-        return false;
-      }
-      if (getValue(command,' ',3)=="-s"){
-        if (getValue(command,' ',4)=="0"){
-          SECLEDOn = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          SECLEDOn = true;
-          return true;
-        }
-        return false;
-      }
-      else if (getValue(command,' ',3)=="-t"){
-        if (getValue(command,' ',4)=="0"){
-          TxLEDOn = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          TxLEDOn = true;
-          return true;
-        }
-        return false;
-      }
-      return false;
+    J1708Core *port = FindPort(rxPayload[i]);
+    uint8_t priority = rxPayload[i+1];
+    uint32_t sendTime = (uint32_t)rxPayload[i+2] | ((uint32_t)rxPayload[i+3]<<8) | ((uint32_t)rxPayload[i+4]<<16) | ((uint32_t)rxPayload[i+5]<<24);
+    uint8_t len = rxPayload[i+6];
+    i += 7;
+    if (port==NULL){
+      return BadPort;
     }
-    else if (temp=="-r"){
-      if (getValue(command,' ',3)=="-t"){
-        //Reset Serial Timer
-        SerialTimer = 0;
-        return true;
-      }
-      else if (getValue(command,' ',3)=="-a"){
-        //Reset ACL - Allow All
-        J1708ResetACL(false);
-        return true;
-      }
-      else if (getValue(command,' ',3)=="-b"){
-        //Reset ACL - Block All
-        J1708ResetACL(true);
-        return true;
-      }
-      else if (getValue(command,' ',3)=="-c"){
-        //Reset message counters
-        RX_Counter = 0;
-        TX_Counter = 0;
-        FWD_Counter = 0;
-        return true;
-      }
-      else if (getValue(command,' ',3)=="-e"){
-        //Reset Error Count
-        ERR_Counter = 0;
-        ERR1_Counter = 0; // Checksum Error
-        ERR2_Counter = 0; // Buffer Overflow Error
-        ERR3_Counter = 0; // Transmit Buffer Overflow Error (i.e. Too many messages being sent)
-        ERR4_Counter = 0; // Message Collision Error
-        ERR5_Counter = 0; // Transmit Error (i.e. Disconnected from bus, hardware fault)
-        ERR6_Counter = 0; // High Busload / Flood Error
-        ERR7_Counter = 0; // Spoofed Message Error
-        ERR8_Counter = 0; // Rogue Node Detected Error
-        ERR9_Counter = 0; // Rogue Node Detected Error
-        ERR10_Counter = 0; // Rogue Node Detected Error
-        for (int i=0;i<256;i++){
-          ERR7_IDCounter[i]=0;
-          ERR8_Tracker[i]=false;
-          ERR9_Tracker[i]=false;
-          ERR10_Tracker[i]=false;
-        }
-        SEC_ERR_Counter = 0;
-        ERR1_Checksum = false;
-        ERR2_RxOverflow = false;
-        ERR3_Tx_Overflow = false;
-        ERR4_Collision = false;
-        ERR5_DataNotSent = false;
-        ERR6_HighBusload = false;
-        return true;
-      }
-      return false;
+    //J1708 priorities are 1-8, and the Tx wait grows with the priority
+    if (priority<1 || priority>8){
+      return BadPriority;
     }
-    else if (temp=="-s"){
-      temp = (getValue(command,' ',3));
-      if (temp=="-a"){
-        ShowRxData = true;
-        ShowTime = true;
-        ShowPort = true;
-        ShowChecksum = true;
-        ShowLength = true;
-        ShowErrors = true;
-        ShowCommand = true;
-        ShowBusload = true;
-        ShowMIDShare = true;
-        return true;
-      }
-      else if (temp=="-A"){
-      Serial.println("ACCESS CONTROL LIST");
-      Serial.println("MID:<0-Allowed, 1-Blocked>");
-        if (getValue(command,' ',4)=="0"){
-          for (int i=0;i<=255;i++){
-            if (selfACL[i]==0){
-              Serial.print(i);Serial.print(":");Serial.println(selfACL[i]);
-            }
-          }
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          for (int i=0;i<=255;i++){
-            if (selfACL[i]==1){
-              Serial.print(i);Serial.print(":");Serial.println(selfACL[i]);
-            }
-          }
-          return true;
-        }
-        else{
-          for (int i=0;i<=255;i++){
-            Serial.print(i);Serial.print(":");Serial.println(selfACL[i]);
-          }
-          return true;
-        }
-      }
-      else if (temp=="-b"){
-        if (getValue(command,' ',4)=="0"){
-          ShowBusload = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          ShowBusload = true;
-          return true;
-        }
-        return false;
-      }
-      else if (temp=="-c"){
-        if (getValue(command,' ',4)=="0"){
-          ShowChecksum = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          ShowChecksum = true;
-          return true;
-        }
-        return false;
-      }
-      else if (temp=="-C"){
-        if (getValue(command,' ',4)=="0"){
-          ShowCommand = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          ShowCommand = true;
-          return true;
-        }
-        return false;
-      }
-      if (temp=="-d"){
-        ShowRxData = true;
-        ShowTime = true;
-        ShowPort = true;
-        ShowChecksum = false;
-        ShowLength = true;
-        ShowErrors = true;
-        ShowCommand = true;
-        ShowBusload = false;
-        ShowMIDShare = false;
-        return true;
-      }
-      else if (temp=="-e"){
-        if (getValue(command,' ',4)=="0"){
-          ShowErrors = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          ShowErrors = true;
-          return true;
-        }
-        return false;
-      }
-      else if (temp=="-i"){
-        Serial.println("SYSTEM INFORMATION");
-        Serial.print("Mode:");Serial.print(selfMode);
-          if (selfMode==0){
-            Serial.println(" (Gateway)");
-          }
-          else if (selfMode==0){
-            Serial.println(" (Rogue)");
-          }
-          else if (selfMode==0){
-            Serial.println(" (Compromised)");
-          }
-          else if (selfMode==0){
-            Serial.println(" (Observer)");
-          }
-          else{
-            Serial.println();
-          }
-        Serial.print("Port:");Serial.println(selfPN);
-        if (J1708Object_Linked){
-          Serial.print("Linked_Port:");Serial.println(_j1708Ref->selfPN);
-        }
-        else{
-          Serial.print("Linked_Port:");Serial.println("-");
-        }
-        Serial.print("Self_MID:");Serial.println(selfMID);
-        Serial.print("Max_Busload:");Serial.println(maxBusload);
-        Serial.print("Max_MID%:");Serial.println(maxMIDShare);
-        Serial.print("TxBucketSize:");Serial.println(TxQmax);
-        if (selfHostPort){
-          Serial.print("Host_Port:");Serial.println("True");
-        }
-        else {
-          Serial.print("Host_Port:");Serial.println("False");
-        }
-        if (GatewaySpecificProcessing){
-          Serial.print("Gateway_Prc:");Serial.println("True");
-        }
-        else {
-          Serial.print("Gateway_Prc:");Serial.println("False");
-        }
-        if (Rx_Forwarding){
-          Serial.print("Msg_Forwarding:");Serial.println("True");
-        }
-        else {
-          Serial.print("Msg_Forwarding:");Serial.println("False");
-        }
-        return true;
-      }
-      else if (temp=="-l"){
-        if (getValue(command,' ',4)=="0"){
-          ShowLength = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          ShowLength = true;
-          return true;
-        }
-        return false;
-      }
-      else if (temp=="-n"){
-        ShowRxData = false;
-        ShowTime = false;
-        ShowPort = false;
-        ShowChecksum = false;
-        ShowLength = false;
-        ShowErrors = false;
-        ShowCommand = false;
-        ShowBusload = false;
-        ShowMIDShare = false;
-        return true;
-      }
-      else if (temp=="-m"){
-        if (getValue(command,' ',4)=="0"){
-          ShowMIDShare = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          ShowMIDShare = true;
-          return true;
-        }
-        return false;
-      }
-      else if (temp=="-p"){
-        if (getValue(command,' ',4)=="0"){
-          ShowPort = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          ShowPort = true;
-          return true;
-        }
-        return false;
-      }
-      else if (temp=="-r"){
-        if (getValue(command,' ',4)=="0"){
-          ShowRxData = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          ShowRxData = true;
-          return true;
-        }
-        return false;
-      }
-      else if (temp=="-s"){
-        Serial.println("SYSTEM STATISTICS");
-        Serial.print("Bus_Load:");Serial.print(busload*100.0);Serial.println("%");
-        Serial.print("Total_Error_Count:");Serial.println(ERR_Counter);
-        Serial.print("  ERR1_Count:");Serial.println(ERR1_Counter);
-        Serial.print("  ERR2_Count:");Serial.println(ERR2_Counter);
-        Serial.print("  ERR3_Count:");Serial.println(ERR3_Counter);
-        Serial.print("  ERR4_Count:");Serial.println(ERR4_Counter);
-        Serial.print("  ERR5_Count:");Serial.println(ERR5_Counter);
-        Serial.print("  ERR6_Count:");Serial.println(ERR6_Counter);
-        Serial.print("  ERR7_Count:");Serial.println(ERR7_Counter);
-        Serial.print("  ERR8_Count:");Serial.println(ERR8_Counter);
-        Serial.print("  ERR9_Count:");Serial.println(ERR9_Counter);
-        Serial.print("  ERR10_Count:");Serial.println(ERR10_Counter);
-        Serial.print("Security_Alerts:");Serial.println(SEC_ERR_Counter);
-        Serial.print("Total_Received_Messages:");Serial.println(RX_Counter);
-        Serial.print("Total_Transmitted_Messages:");Serial.println(TX_Counter);
-        Serial.print("Total_Forwarded_Messages:");Serial.println(FWD_Counter);
-        Serial.print("Message_Timer_Micros:");Serial.println(SerialTimer);
-        Serial.print("System_Timer_Millis:");Serial.println(millis());
-        return true;
-      }
-      else if (temp=="-T"){
-        if (getValue(command,' ',4)=="0"){
-          ShowTime = false;
-          return true;
-        }
-        else if (getValue(command,' ',4)=="1"){
-          ShowTime = true;
-          return true;
-        }
-        return false;
-      }
-      return false;
+    if (len<1 || len>20 || i+len>rxLength){
+      return BadLength;
     }
-    return false;
+    uint8_t msg[21];
+    memcpy(msg, rxPayload+i, len);
+    i += len;
+    bool queued;
+    if (sendTime==0){
+      queued = port->J1708Send(msg,len+1,priority);
+    }
+    else {
+      queued = port->J1708SendAt(msg,len+1,priority,sendTime);
+    }
+    if (!queued){
+      return QueueFull;
+    }
+    accepted++;
   }
-  else if (getValue(command,' ',0)=="j1708send"){
-    temp = getValue(command,' ',2);
-    if (temp=="-h"){
-      Serial.print("j1708send sp<port_no> <option> <param1> <param2>\n        SEND MESSAGE\n            <payload_size> <payload>            send data w/o checksum (automatically calculated and appended)\n            EXAMPLE:\n            j1708send sp3 4 DE.AD.be.ef         send a message to port three with MID 0xDE\n\n    -T  SEND TRANSPORT MESSAGE\n            <dst.MID> <payload_size> <payload>  Send a payload using J1587 transport protocol. Automatic RTS\n                                                is sent if possible. Automatic handling. Connection times\n                                                out after 10s. Meanwhile, no other RTSs can be sent. Max\n                                                payload size is 256-bytes.\n            EXAMPLE:\n            j1708send sp3 -T A1 30 01.02.03. ... .29.30 \n            \n    -h  HELP");
-      return true;
+  return OK;
+}
+
+uint8_t J1708Host::HandleReplay(uint8_t &accepted){
+  // Appends captured frames to one port's replay buffer. Start the replay with "j1708replay spX -g".
+  if (rxLength<2){
+    return BadPacket;
+  }
+  J1708Core *port = FindPort(rxPayload[0]);
+  if (port==NULL){
+    return BadPort;
+  }
+  uint8_t count = rxPayload[1];
+  int i = 2;
+  for (int k=0; k<count; k++){
+    if (i+5>rxLength){
+      return BadPacket;
     }
-    else if (temp=="-T"){
-      if (getValue(command,' ',3)>0){
-        int temp = string2Hex(getValue(command,' ',3));
-        if (temp>=0){
-          uint8_t destinationAddr = (uint8_t)temp;
-          String temp = getValue(command,' ',4);
-          if (temp>0 && getValue(command,' ',5)>0){
-            int payloadsize = (int)temp.toInt();
-            String payload = getValue(command,' ',5);
-            // Send a long message
-            if (payloadsize>19 && payloadsize<256){
-              uint8_t msg[payloadsize];
-              uint8_t byte_i;
-              for (int i=0;i<payloadsize;i++){
-                if (getValue(payload,'.',i)>0){
-                  byte_i = string2Hex(getValue(payload,'.',i));
-                  if (byte_i>=0){
-                    // This byte was a well formated HEX string
-                    // Add it to buffer
-                    msg[i] = byte_i;
-                  }
-                  else {
-                    return false;
-                  }
-                }
-                else{
-                  return false;
-                }
-              }
-              if (J1708TransportTx(msg,payloadsize,destinationAddr)){
-                return true;
-              }
-              return false;
-            }
-            return false;
-          }
-          return false;
-        }
-        return false;
-      }
-      return false;
+    uint32_t captureTime = (uint32_t)rxPayload[i] | ((uint32_t)rxPayload[i+1]<<8) | ((uint32_t)rxPayload[i+2]<<16) | ((uint32_t)rxPayload[i+3]<<24);
+    uint8_t len = rxPayload[i+4];
+    i += 5;
+    if (len<1 || len>20 || i+len>rxLength){
+      return BadLength;
     }
-    else if (temp>0 && getValue(command,' ',3)>0){
-      int msgLen = (int)temp.toInt();
-      String payload = getValue(command,' ',3);
-      //Send standard Sized Message
-      if (msgLen>0 && msgLen<21){
-        uint8_t msg[msgLen+1];
-        int byte_i;
-        for (int i=0;i<msgLen;i++){
-          if (getValue(payload,'.',i)>0){
-            byte_i = string2Hex(getValue(payload,'.',i));
-            if (byte_i>=0){
-              // This byte was a well formated HEX string
-              // Add it to buffer
-              msg[i] = (uint8_t)byte_i;
-            }
-            else{
-              return false;
-            }
-          }
-          else {
-            return false;
-          }
-        }
-        J1708Send(msg,msgLen+1,8);
-        return true;
-      }
-      return false;
+    if (!port->J1708ReplayAdd(rxPayload+i,len,captureTime)){
+      return QueueFull;
     }
-    return false;
+    i += len;
+    accepted++;
   }
-  return false;
+  return OK;
 }
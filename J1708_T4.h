@@ -22,7 +22,7 @@
 #define J1708_T4_H
 
 // Dependencies
-#include <Arduino.h>
+#include "J1708_HAL.h"
 
 // Utility Functions
 String getValue(String data, char separator, int index);
@@ -31,15 +31,192 @@ uint32_t hex2int(char *hex);
 
 int string2Hex(String data);
 
+// Profiling Zones
+//   Build with J1708_PROFILE defined to time the hot functions. Each zone keeps
+//   call count and total/min/max cycles (nanoseconds on the host) in one table
+//   shared by every port. Zones are inclusive of the zones they call.
+//   Without J1708_PROFILE the zones and the table are compiled out.
+enum J1708Zone {
+  ZoneRx, ZoneTx, ZoneListen, ZoneStatistics, ZoneCheckNetwork,
+  ZoneRTS, ZoneCTS, ZoneCDP, ZoneEOM, ZoneAbort,
+  ZoneCount
+};
+
+#if defined(J1708_PROFILE)
+struct J1708ProfileZone {
+  uint32_t calls;
+  uint64_t total;
+  uint32_t min;
+  uint32_t max;
+};
+extern J1708ProfileZone J1708Profile[ZoneCount];
+
+void J1708ProfileRecord(uint8_t zone, uint32_t cycles);
+
+struct J1708ProfileScope {
+  uint8_t zone;
+  uint32_t start;
+  J1708ProfileScope(uint8_t z) : zone(z), start(J1708Cycles()) {}
+  ~J1708ProfileScope() { J1708ProfileRecord(zone, J1708Cycles()-start); }
+};
+#define J1708_PROFILE_ZONE(zone) J1708ProfileScope _profileScope(zone)
+#else
+#define J1708_PROFILE_ZONE(zone)
+#endif
+
+extern const char *const J1708ZoneNames[ZoneCount];
+
+void J1708ProfilePrint();
+
+void J1708ProfileReset();
+
+// Shared Timebase - micros() since the last J1708TimeReset(), used for the
+// frame timestamps of every port so captures of different ports line up.
+uint32_t J1708Time();
+
+void J1708TimeReset();
+
+// Command Tokens - views into a command buffer, nothing is copied
+struct J1708Args {
+  const static int MaxTokens = 8;
+  const char *tok[MaxTokens];
+  uint8_t len[MaxTokens];
+  uint8_t n = 0;
+
+  bool has(uint8_t i) const;
+  bool is(uint8_t i, const char *text) const;
+  int toFlag(uint8_t i) const;           // "0"|"1" -> 0|1, otherwise -1
+  int toHex(uint8_t i) const;            // Two hex digits -> 0-255, otherwise -1
+  long toInt(uint8_t i) const;
+  float toFloat(uint8_t i) const;
+  int toHexBytes(uint8_t i, uint8_t out[], int count) const; // "de.ad.be.ef" -> bytes decoded or -1
+};
+
+uint8_t J1708Tokenize(const char *command, J1708Args &args);
+
+// MID Set - one bit per MID
+struct J1708MIDSet {
+  uint32_t bits[8] = {};
+  bool test(const uint8_t &mid) const { return (bits[mid>>5]>>(mid&31)) & 1; }
+  void set(const uint8_t &mid, bool value=true) {
+    if (value) bits[mid>>5] |= (1ul<<(mid&31));
+    else bits[mid>>5] &= ~(1ul<<(mid&31));
+  }
+  void fill(bool value) { memset(bits, value ? 0xFF : 0x00, sizeof(bits)); }
+};
+
+// Port Features - optional storage of a J1708Port. Code for a missing feature
+// stays in the shared core and does nothing.
+enum J1708Feature {
+  FeatureSecurity  = 0x01,  // ERR7 spoof counters per MID
+  FeatureCache     = 0x02,  // Parameter cache
+  FeatureSchedule  = 0x04,  // J1708SendAt
+  FeatureReplay    = 0x08,  // Replay buffer
+  FeatureGenerator = 0x10,  // Traffic generator ECUs
+  FeatureCapture   = 0x20,  // Pre-trigger capture ring
+  FeatureSampling  = 0x40,  // Adaptive sampled logging
+  FeatureDedup     = 0x80,  // Change-only forwarding
+  FeatureRewrite   = 0x100, // MID translation and byte patches on the forwarding path
+  FeatureShaping   = 0x200, // Per-MID transmit token buckets
+  FeatureEcho      = 0x400, // Own-echo matching (any port that transmits)
+  FeatureWatch     = 0x800, // Loop watchdog histogram and stall events
+  FeatureBudget    = 0x1000,// Deferred printing of J1708Update(maxMicros)
+  FeatureSnapshot  = 0x2000,// Seqlock statistics block for snapshot()
+  FeatureDefault   = FeatureSecurity | FeatureEcho, // What earlier releases kept in every port
+  FeatureAll       = 0xFFFF
+};
+
+// Statistics Levels
+enum J1708StatsLevel {
+  StatsBusload = 0,         // Busload only
+  StatsPerMID  = 1          // Busload and per-MID share (needed for ERR9/ERR10 flood attribution)
+};
+
+// Persistent Configuration
+//   Settings, ACL and the ERR8-10 trackers of every port are journaled to
+//   EEPROM as fixed-size records. Each save goes to the next free slot, so
+//   writes rotate over the region, and the newest record of every port is
+//   never overwritten. begin() restores the port's newest valid record.
+//   Define J1708_EEPROM_BASE/J1708_EEPROM_SIZE to move or resize the region.
+#ifndef J1708_EEPROM_BASE
+#define J1708_EEPROM_BASE 0
+#endif
+#ifndef J1708_EEPROM_SIZE
+#define J1708_EEPROM_SIZE 1080      // Teensy 4.0 EEPROM
+#endif
+
+struct J1708Config {
+  uint32_t seq;                     // Save order across all ports, newest wins
+  uint16_t magic;                   // CRC covers magic to the end of the payload
+  uint8_t version;
+  uint8_t port;
+  uint32_t flags;                   // J1708Core::ConfigFlags, bit n - entry n
+  uint8_t selfMID;
+  uint8_t selfMode;
+  uint16_t ERR8_Counter;
+  uint16_t ERR9_Counter;
+  uint16_t ERR10_Counter;
+  uint32_t ERR7_Limit;
+  float maxBusload;
+  float maxMIDShare;
+  uint32_t ParamCacheMaxAge;
+  J1708MIDSet selfACL;
+  J1708MIDSet ERR8_Tracker;
+  J1708MIDSet ERR9_Tracker;
+  J1708MIDSet ERR10_Tracker;
+  uint16_t crc;
+
+  const static uint16_t Magic = 0x4A38;
+  const static uint8_t Version = 1; // Bump whenever the layout changes
+};
+
+uint16_t J1708CRC16(const uint8_t data[], int length);
+
+//Statistics Snapshot - the counters of one port, consistent with each other. The port publishes them
+//  under a sequence lock (odd while being written) from J1708Update. J1708Core::snapshot() copies them
+//  without ever blocking the port, so it can be called from an interrupt, another core or a DMA setup.
+struct J1708Stats {
+  uint32_t sequence;                // Publish count
+  uint32_t time;                    // J1708Time() when published
+  uint32_t uptime;                  // millis()
+  uint32_t rx;
+  uint32_t tx;
+  uint32_t forwarded;
+  uint32_t own;                     // Echoes of own frames
+  uint32_t ownLost;
+  uint32_t errors;                  // All ERRn
+  uint32_t err[12];                 // err[n] - ERRn, err[0] unused
+  uint32_t securityAlerts;
+  float busload;
+  uint8_t topMIDs[4];               // Largest MID shares of the last busload second, StatsPerMID only
+  float topShares[4];
+  uint8_t txQueued;
+  uint8_t txFree;
+  uint16_t rxFillMax;
+  uint16_t rxCapacity;
+  uint8_t pollMaxPhase;             // J1708Core::watchPhase
+  uint32_t pollMax;                 // us
+  uint32_t pollP99;                 // us, upper bound
+  uint32_t pollHistogram[16];       // J1708Core::WatchHistogram
+  uint32_t stalls;
+};
+
+struct J1708Merge;
+
 //J1708 Object Definition
-struct J1708 {
+//  J1708Core holds the logic and the fixed-size state of one port. The large
+//  buffers are owned by J1708Port (below), which sizes them at compile time.
+struct J1708Core {
   //Constructor
   // J1708();
 
-  //Teensy 4.0 Hardware Definitions
-  int RxLED = 13; //High-LEDON, Low-LEDOFF
-  int TxLED = 12; //High-LEDON, Low-LEDOFF
+  //Teensy 4.x Hardware Definitions
+  const static int PinDefault = -2; //begin(): use the LED pin from the UART table
+  int RxLED = 13; //High-LEDON, Low-LEDOFF, -1 - none
+  int TxLED = 12; //High-LEDON, Low-LEDOFF, -1 - none
   int SEC_ERR_LED = 9;
+  int RxPin = -1; //Alternate UART Rx pin (setRX), set before begin(). -1 - default pin
+  int TxPin = -1; //Alternate UART Tx pin (setTX), set before begin(). -1 - default pin
 
   // Enums
   enum nodeMode {Gateway, Rogue, Compromised, Observer};
@@ -58,16 +235,17 @@ struct J1708 {
   bool ERR4_Collision = false;
   bool ERR5_DataNotSent = false;
   bool ERR6_HighBusload = false;
+  bool ERR11_RxOverrun = false;
+  int ERR11_Before = 0;             // Bytes received before the ones an overrun lost, still to be read
+  bool RxBacklog = false;           // The current frame has bytes that waited behind others
   bool rx_busy = false;
   bool tx_busy = false;
-  bool tx_transmitting = false;
   bool J1708Object_Linked = false;
   int ERR2_MID_Hold = -1;
 
   //Timers
   elapsedMicros J1708Timer;         //Set up a microsecond timer to run after each byte is received.
   elapsedMicros J1708TxTimer;       //Set up a microsecond timer to run for Tx network access timing.
-  elapsedMicros SerialTimer;        //Set up a microsecond timer when data is printed on Serial 1.
   elapsedMillis J1708LoopTimer;     //Set up a microsecond timer to run after each byte is received.
   elapsedMillis BusloadTimer;       //Busload calculation timer
   elapsedMillis ERR6_Timer;         //ERR6 Periodic Send Timer
@@ -85,11 +263,12 @@ struct J1708 {
   bool ShowErrors = true;
   bool ShowBusload = false;
   bool ShowMIDShare = false;
+  bool ShowOwn = true;               // Echoes of frames sent by this port
   bool Rx_Forwarding = false;
   bool RxLEDOn = true;
   bool TxLEDOn = true;
   bool SECLEDOn = true;
-  bool selfACL[256];
+  J1708MIDSet selfACL;              //Blocked MIDs
   uint8_t selfMID = 120;            //0x78 - Change this to define the gateway MID
   nodeMode selfMode = Gateway;
   bool selfHostPort = false;
@@ -97,17 +276,15 @@ struct J1708 {
   float maxBusload = 1.0;           //Don't forget to add "."
   float maxMIDShare = 1.0;          //Don't forget to add "."
   bool GatewaySpecificProcessing = false; //Allows the gateway to respond to requests (false means it will only perform normal fucntionality)
-  int TxQmax = 32;  // Indicates TxQueue size. Can be used to size the leaky bucket 32 MAX
-  uint8_t TxQueuePenalty = 0;
-  const static uint8_t TxQmaxMaxPenalty = 1; 
-  const static uint32_t PenaltyTime = 1000; // Leaky Bucket: P = PenaltyTime*TxQueuePenalty microseconds
+  int TxQmax = 0;   // Indicates TxQueue size. Set by J1708Port from its TxQDepth.
 
   //Variables
   uint32_t idleTime = 1250;
   float busload; // approx: character_count/(9600/10) % max_characters/s
   uint32_t TotalByteCount = 0;
-  uint32_t MIDByteCount[256];
+  uint32_t *MIDByteCount = NULL;    //[256], StatsPerMID only
   uint8_t J1708FrameLength = 0;
+  uint32_t J1708FrameTime = 0;      // J1708Time() at the first byte of the current frame
   uint32_t J1708ByteCount;
   uint8_t J1708Checksum = 0;
   uint8_t TP_Rx_NBytes=0;
@@ -131,14 +308,16 @@ struct J1708 {
   uint32_t ERR6_ConsecutiveCounter = 0;
   uint8_t ERR6_ConsecutiveMax = 4; // approx. n/2 seconds of consecutive high busload
   uint32_t ERR7_Counter = 0; // Spoofed Message Error
-  uint16_t ERR7_IDCounter[256];
+  uint16_t *ERR7_IDCounter = NULL;  //[256], FeatureSecurity only
   uint16_t ERR8_Counter = 0; // Rogue Node Detected Error
   const static int ERR8_Interval = 10000;
-  bool ERR8_Tracker[256];
+  J1708MIDSet ERR8_Tracker;
   uint16_t ERR9_Counter = 0; // Compromised Node Error
-  bool ERR9_Tracker[256];
+  J1708MIDSet ERR9_Tracker;
   uint16_t ERR10_Counter = 0; // Compromised Host Error
-  bool ERR10_Tracker[256];
+  uint32_t ERR11_Counter = 0; // Receive Overrun Error (bytes lost by a full serial receive buffer)
+  const static uint8_t ErrorCodes = 11; // ERR1 to ERR11
+  J1708MIDSet ERR10_Tracker;
   uint32_t SEC_ERR_Counter = 0;
   uint32_t RX_Counter = 0;
   uint32_t TX_Counter = 0;
@@ -146,6 +325,7 @@ struct J1708 {
   uint8_t N_TxQ = 0;
   uint8_t N_TxS = 0;
   uint8_t N_TxQ_Total = 0;
+  uint8_t N_TxQ_Holes = 0;              // Slots between head and tail already sent out of order (length 0)
   int selfPN;
 
   // Timing Constants (microseconds)
@@ -159,34 +339,417 @@ struct J1708 {
   //Global Buffers & Arrays
   const static int RxBufferSize = 22;
   uint8_t J1708RxBuffer[RxBufferSize]; //Buffer for unprinted Rx frames
-  uint8_t J1708TxQ[32][21];        //Buffer for queued Tx frames
-  int J1708TxQLengths[32];     //Buffer for queued Tx frame lengths
-  uint8_t J1708TxQPriorities[32];  //Buffer for queued Tx frame priorities
+  uint8_t (*J1708TxQ)[21] = NULL;        //Buffer for queued Tx frames [TxQmax]
+  int *J1708TxQLengths = NULL;           //Buffer for queued Tx frame lengths
+  uint8_t *J1708TxQPriorities = NULL;    //Buffer for queued Tx frame priorities
+  uint8_t *J1708TxQFlags = NULL;         //Buffer for queued Tx frame flags (TxQAutoChecksum, TxQHeld)
+  enum txQFlag {
+    TxQAutoChecksum = 0x01,              // Checksum computed when sent (off - already valid)
+    TxQHeld = 0x02                       // Waited for shaping tokens
+  };
+  //Own-traffic echo - frames put on the wire by J1708Tx, oldest first, until the bus echoes them back
+  const static int EchoSize = 4;
+  const static uint32_t EchoTimeout = 50000; // us, longest frame plus idle time with margin
+  uint8_t (*EchoFrames)[21] = NULL;     //[EchoSize], FeatureEcho only
+  uint8_t *EchoLengths = NULL;
+  uint32_t *EchoTimes = NULL;
+  uint8_t N_Echo = 0;
+  uint32_t OWN_Counter = 0;              // Echoes of own frames
+  uint32_t OWN_Lost_Counter = 0;         // Own frames whose echo never matched
+
+  //Statistics Snapshot - see J1708Stats. Published every StatsPublishMillis, and after StatsChangeMillis
+  //  when a main counter changed.
+  const static int TopMIDCount = 4;
+  const static uint32_t StatsPublishMillis = 100;
+  const static uint32_t StatsChangeMillis = 10;
+  uint8_t TopMIDs[TopMIDCount] = {};
+  float TopShares[TopMIDCount] = {};
+  volatile uint32_t StatsSeq = 0;        // Odd while StatsBlock is being written
+  J1708Stats *StatsBlock = NULL;         // FeatureSnapshot only
+  elapsedMillis StatsTimer;
+
+  //Statistics Export - a snapshot as one STATS packet of the binary host protocol, or one JSON line
+  enum exportFormat {ExportOff, ExportBinary, ExportJSON};
+  const static uint8_t ExportVersion = 1;
+  const static int ExportBytes = 768;    // Longest JSON record
+  uint8_t ExportFormat = ExportOff;
+  uint32_t ExportMillis = 0;             // Period, 0 - only on request
+  elapsedMillis ExportTimer;
+  uint32_t EXPORT_Counter = 0;
+
+  //Budgeted Update - J1708Update(maxMicros) drains received bytes, then gets bus access, then prints
+  //  and runs periodic tasks while time is left. Printing and periodic tasks resume on the next call.
+  enum updateStep {StepSchedule, StepGenerator, StepNetwork, StepCapture, StepConfig, StepCount};
+  const static int DeferSize = 4;
+  struct DeferredFrame {
+    uint8_t data[RxBufferSize];          // Laid out like J1708RxBuffer
+    uint8_t length;
+    uint32_t time;
+  };
+  DeferredFrame *Deferred = NULL;        //[DeferSize], FeatureBudget only. Without it frames print at once
+  uint8_t DeferredHead = 0;
+  uint8_t N_Deferred = 0;
+  uint8_t UpdateStep = StepSchedule;     // Next periodic task
+  uint32_t BUDGET_Calls = 0;
+  uint32_t BUDGET_Exceeded_Counter = 0;  // Calls that ran past maxMicros
+  uint32_t BUDGET_Forced_Prints = 0;     // Frames printed early because Deferred was full
+  uint32_t BUDGET_Overrun_Max = 0;       // Longest time a call ran past its budget, us
+  uint32_t PrintMicros = 0;              // Time the last deferred print took
   char hexDisp[4]; //Character display buffer
-  uint8_t TP_Tx_Buffer[256] = {}; //Transport Protocol Buffer
-  uint8_t TP_Rx_Buffer[256] = {}; //Transport Protocol Buffer
   uint8_t Loopbuffer[21];
-  uint8_t TP_TxMessageQueue[10][21]; //Max sendable bytes in J1587 TP Protocol: 3825
-  uint8_t Q_Matrix[20][21];
-  uint8_t Q_Lengths[20];
-  uint8_t Q_Message[] = {};
-  float MIDShareTracker[256];
+  uint32_t PortSize = 0;                 //sizeof the J1708Port holding this core
+  uint8_t *RxMemory = NULL;              //Added to the serial receive buffer by begin() [RxMemorySize]
+  uint16_t RxMemorySize = 0;
+  uint16_t RxCapacity = J1708_SERIAL_RX_BUFFER; //Serial receive buffer in bytes
+  uint16_t RxFillMax = 0;                //Most bytes waiting in the serial receive buffer
+  uint32_t RX_Split_Counter = 0;         //Frames split by layout after waiting in the receive buffer
+  uint16_t TPCapacity = 0;               //Max transport message size (bytes). 0 - Transport disabled
+  uint8_t TPSegments = 0;                //Q_Matrix rows
+  uint8_t *TP_Tx_Buffer = NULL;          //Transport Protocol Buffer [TPCapacity]
+  uint8_t *TP_Rx_Buffer = NULL;          //Transport Protocol Buffer [TPCapacity]
+  uint8_t (*Q_Matrix)[21] = NULL;        //Transport data segments waiting to be sent [TPSegments]
+  uint8_t *Q_Lengths = NULL;
+  const static int TxSchedSize = 8;
+  uint8_t (*J1708TxSched)[21] = NULL;          //Buffer for frames waiting for their scheduled send time [TxSchedSize]
+  uint8_t *J1708TxSchedLengths = NULL;
+  uint8_t *J1708TxSchedPriorities = NULL;
+  uint32_t *J1708TxSchedTimes = NULL;          //micros() at which the frame is moved to the Tx queue
+  uint8_t N_TxSched = 0;
+
+  //Replay - captured frames sent again with their original relative timing
+  const static int ReplaySize = 32;
+  uint8_t (*J1708Replay)[21] = NULL;           //Captured frames (MID and data, checksum slot reserved) [ReplaySize]
+  uint8_t *J1708ReplayLengths = NULL;
+  uint32_t *J1708ReplayTimes = NULL;           //Capture timestamps (micros), as printed by J1708Listen
+  uint8_t N_ReplayHead = 0;
+  uint8_t N_ReplayTotal = 0;
+  uint8_t N_ReplayPos = 0;                     //Next frame, relative to N_ReplayHead
+  bool ReplayOn = false;
+  bool ReplayLoop = false;
+  float ReplaySpeed = 1.0;                     //Don't forget to add "."
+  uint32_t ReplayBase = 0;                     //micros() matching the first frame of the current pass
+  uint32_t ReplayFirstTime = 0;                //Capture timestamp of the first frame of the current pass
+  uint32_t REPLAY_Counter = 0;
+  uint32_t REPLAY_Retry_Counter = 0;           //Sends lost to a collision or ERR5, tried again
+  int32_t ReplayDriftLast = 0;                 //Actual minus scheduled send time (micros)
+  uint32_t ReplayDriftMax = 0;
+  uint32_t ReplayDriftTotal = 0;
+  float *MIDShareTracker = NULL;               //[256], StatsPerMID only
+
+  //Traffic Generator - an emulated ECU population queued through J1708Send
+  const static int GenECUSize = 8;
+  const static int GenPIDSize = 8;
+  struct GenECU {
+    bool used;
+    uint8_t mid;
+    uint8_t priority;
+    uint8_t pids[GenPIDSize];              // Broadcast together, packed into as few frames as fit
+    uint8_t nPids;
+    uint16_t period;                       // Nominal broadcast period (ms)
+    uint32_t next;                         // micros() of the next broadcast
+    uint8_t counter;                       // Advances the synthetic values on every broadcast
+  };
+  GenECU *GenECUs = NULL;                  //[GenECUSize]
+  bool GenOn = false;
+  float GenTarget = 0.0;                   // Busload held by scaling every period. 0 - Off (nominal periods)
+  float GenRate = 1.0;                     // Broadcast rate multiplier set by the busload loop
+  uint16_t GenBurstPeriod = 0;             // ms between bursts. 0 - Off
+  uint8_t GenBurstFrames = 8;              // Frames queued back-to-back per burst
+  uint16_t GenTPPeriod = 0;                // ms between transport sessions. 0 - Off
+  uint8_t GenTPBytes = 64;
+  uint8_t GenTPMID = 0;                    // Destination of the transport sessions
+  uint8_t GenNext = 0;                     // Next ECU of a burst
+  elapsedMillis GenControlTimer;
+  elapsedMillis GenBurstTimer;
+  elapsedMillis GenTPTimer;
+  uint32_t GEN_Counter = 0;                // Generated frames queued
+  uint32_t GEN_Skipped_Counter = 0;        // Broadcasts skipped because the Tx queue was half full
+  uint32_t GenSkippedLast = 0;             // GEN_Skipped_Counter at the last busload loop step
+  uint32_t GEN_Burst_Counter = 0;
+  uint32_t GEN_TP_Counter = 0;
+
+  //Capture Ring - the last frames received, frozen and printed when a trigger fires
+  //  Records: <length> <time[4]> <MID ... checksum>, oldest dropped first
+  const static int CaptureBytes = 512;     // Ring size (must be a power of 2), about 35 frames of 10 bytes
+  uint8_t *CaptureRing = NULL;             //[CaptureBytes]
+  uint16_t CaptureHead = 0;                // Next byte written
+  uint16_t CaptureTail = 0;                // Oldest record
+  uint16_t CaptureUsed = 0;
+  uint8_t CaptureFrames = 0;
+  bool CaptureFrozen = false;              // Recording stopped until re-armed
+  bool CaptureTriggered = false;           // Recording the frames after the trigger
+  uint8_t CapturePost = 8;                 // Frames recorded after the trigger
+  uint8_t CapturePostLeft = 0;
+  uint16_t CaptureErrMask = 0;             // Bit n - trigger on ERRn
+  uint32_t CaptureErrSeen[ErrorCodes+1] = {};  // ERRn counts when last checked
+  J1708MIDSet CaptureMIDs;                 // Trigger on any frame from these MIDs
+  const static int CapturePatternSize = 8;
+  uint8_t CapturePattern[CapturePatternSize];  // Trigger when (frame[i] & mask[i]) == pattern[i], from the MID on
+  uint8_t CaptureMask[CapturePatternSize];
+  uint8_t CapturePatternLength = 0;        // 0 - Off
+  char CaptureReason[8] = "";              // Trigger that froze the ring, e.g. "ERR7", "MID", "PATTERN"
+  uint32_t CaptureTriggerTime = 0;         // J1708Time() of the trigger
+  uint32_t CAPTURE_Counter = 0;            // Triggers fired
+
+  //Display Filter - frames rejected here are not printed. Forwarding, statistics and capture are unaffected.
+  //  J1708FilterCompile() turns the rules into FilterOn so an unfiltered port pays a single test.
+  bool FilterOn = false;                   // Any rule set
+  bool FilterMIDOn = false;                // Any MID selected
+  bool FilterPIDOn = false;                // Any PID selected
+  J1708MIDSet FilterMIDs;                  // Frames from these MIDs are shown
+  J1708MIDSet FilterPIDs;                  // Frames carrying any of these PIDs are shown (FF - any page 2 PID)
+  uint32_t FilterLengths = 0xFFFFFFFF;     // Bit n - frames of length n are shown
+  const static int FilterPatternSize = 8;
+  uint8_t FilterPattern[FilterPatternSize];  // Shown when (frame[i] & mask[i]) == pattern[i], from the MID on
+  uint8_t FilterMask[FilterPatternSize];
+  uint8_t FilterPatternLength = 0;         // 0 - Off
+  uint32_t FILTER_Rejected_Counter = 0;
+
+  //Sampled Logging - under load, print only a subset of the frames with a count of those skipped
+  //  Sampling starts when the busload reaches SampleBusload or the console has less than
+  //  SampleTxFree bytes free, and stops once neither has happened for SampleHold ms.
+  enum sampleMode {SampleOff, SampleAuto, SampleAlways};
+  struct SampleMID {
+    uint16_t suppressed;                   // Frames not printed since the last printed one
+    uint16_t last;                         // millis() of the last printed frame, low 16 bits
+  };
+  SampleMID *SampleMIDs = NULL;            //[256]
+  uint8_t SampleMode = SampleAuto;
+  bool SampleActive = false;
+  float SampleBusload = 0.8;
+  int SampleTxFree = 64;
+  uint16_t SampleInterval = 1000;          // One frame per MID per interval (ms)...
+  uint16_t SampleEvery = 0;                // ...or one in every N frames per MID. 0 - use SampleInterval
+  const static uint32_t SampleHold = 2000;
+  elapsedMillis SampleHoldTimer;
+  uint32_t SAMPLE_Suppressed_Counter = 0;  // Frames not printed while sampling
+  uint32_t SAMPLE_Active_Counter = 0;      // Times sampling started
+
+  //Persistent Configuration (see J1708Config)
+  bool ConfigAutosave = true;              // Save changes once they have been stable for ConfigSaveDelay
+  const static uint32_t ConfigCheckInterval = 1000; // ms between checks for changes
+  const static uint32_t ConfigSaveDelay = 5000;     // ms a change must be stable before it is written
+  elapsedMillis ConfigTimer;
+  elapsedMillis ConfigPendingTimer;
+  uint16_t ConfigSavedCRC = 0;             // CRC of the settings in EEPROM
+  uint16_t ConfigPendingCRC = 0;           // CRC of the unsaved settings
+  int ConfigSlot = -1;                     // Slot of the port's newest record, -1 - none
+  bool ConfigRestored = false;             // begin() restored a record
+  uint32_t CONFIG_Save_Counter = 0;
+  uint32_t CONFIG_Fail_Counter = 0;        // Saves with no free slot
+  static bool J1708Core::* const ConfigFlags[];
+
+  //Parameter Cache - latest value of each (MID,PID) seen on the receive path
+  const static int ParamCacheSize = 64;    // Open-addressed table size (must be a power of 2)
+  const static int ParamCacheProbes = 8;   // Max probe distance. The oldest entry in the window is evicted when full.
+  const static int ParamMaxLength = 18;    // Max data bytes of one parameter in a 21-byte frame
+  struct ParamEntry {
+    bool used;
+    uint8_t mid;
+    uint16_t pid;                          // Page 2 PIDs (escaped with PID 255) are stored as 256-511
+    uint8_t len;
+    uint32_t timestamp;                    // millis() when the value was last updated
+    uint8_t value[ParamMaxLength];
+  };
+  ParamEntry *ParamCache = NULL;           //[ParamCacheSize]
+  bool ParamCacheOn = true;
+  uint32_t PARAM_Counter = 0;              // Parameter values written to the cache
+  uint32_t ParamCacheMaxAge = 0;           // Answer PID 128 requests from the linked port's cache if younger than this (ms). 0 - Off
+  uint32_t REQ_Answered_Counter = 0;       // PID 128 requests answered from cache
+  uint32_t REQ_Forwarded_Counter = 0;      // PID 128 requests forwarded because the value was stale or missing
+
+  //Change-only Forwarding - a frame identical to the last one forwarded for its (MID, first PID)
+  //  is not forwarded again until DedupRefresh has passed. Changed frames are forwarded at once.
+  const static int DedupSize = 64;         // Open-addressed table size (must be a power of 2)
+  const static int DedupProbes = 8;        // The least recently forwarded entry in the window is evicted when full
+  struct DedupEntry {
+    bool used;
+    uint8_t mid;
+    uint16_t pid;                          // First PID, page 2 PIDs stored as 256-511
+    uint32_t hash;                         // FNV-1a of the frame (MID to last data byte)
+    uint32_t timestamp;                    // millis() when the frame was last forwarded
+  };
+  DedupEntry *DedupTable = NULL;           //[DedupSize]
+  bool DedupOn = false;
+  uint32_t DedupRefresh = 1000;            // ms an unchanged frame is held back
+  uint32_t DEDUP_Suppressed_Counter = 0;   // Frames not forwarded because they had not changed
+  uint32_t DEDUP_Saved_Bytes = 0;          // Linked bus characters saved
+  uint32_t DedupWindowBytes = 0;           // Characters saved in the current busload window
+  float DedupSavedLoad = 0;                // Linked bus busload saved over the last busload window
+
+  //Transmit Shaping - token buckets per source MID and per priority
+  //  A queued frame is sent once neither of its buckets is in deficit, and its length in
+  //  characters is then taken from both. Frames held back do not block later frames of other
+  //  MIDs or priorities. Rates are characters per second, 0 - unlimited.
+  struct ShapeBucket {
+    int32_t tokens;                        // 1/1000 characters, negative - deficit
+    uint16_t last;                         // millis() of the last refill, low 16 bits
+    uint16_t held;                         // Frames held back by this bucket
+  };
+  struct ShapeRule {
+    uint8_t mid;
+    uint16_t rate;
+    uint16_t burst;                        // Characters
+  };
+  const static int ShapeRuleSize = 8;
+  ShapeBucket *ShapeMIDs = NULL;           //[256], FeatureShaping only
+  bool ShapeOn = false;                    // Any budget set
+  uint16_t ShapeMIDRate = 0;               // Budget of every MID without a rule
+  uint16_t ShapeMIDBurst = 0;
+  ShapeRule *ShapeRules = NULL;            //[ShapeRuleSize]
+  uint8_t N_ShapeRules = 0;
+  ShapeBucket *ShapePriority = NULL;       //[9] priorities 0 (forwarded) to 8, after ShapeMIDs
+  uint16_t *ShapePriorityRate = NULL;      //[9]
+  uint16_t *ShapePriorityBurst = NULL;     //[9]
+  uint32_t SHAPE_Held_Counter = 0;         // Frames that waited for tokens
+  uint32_t SHAPE_Bypass_Counter = 0;       // Frames sent ahead of a held frame
+  const static uint32_t ShapeSweepMillis = 30000;
+  elapsedMillis ShapeSweepTimer;           // Refills every bucket, see J1708ShapeSweep
+
+  //Loop Watchdog - gap between the starts of consecutive J1708Update calls. Each gap is blamed on the
+  //  phase that took longest since the previous call: a phase of this port, or the rest of loop()
+  //  (other ports, the sketch, printing outside the library).
+  enum watchPhase {PhaseLoop, PhaseRx, PhaseTx, PhaseParse, PhaseStats, PhaseSettings, PhaseLog, PhaseCount};
+  const static char *const PhaseNames[PhaseCount];
+  const static int WatchBuckets = 16;       // Bucket k counts gaps of 2^k to 2^(k+1)-1 us, the last one longer
+  const static int WatchEventSize = 4;
+  struct WatchEvent {
+    uint32_t time;                          // J1708Time() at the end of the gap
+    uint32_t gap;
+    uint8_t phase;
+  };
+  uint32_t *WatchHistogram = NULL;          //[WatchBuckets], FeatureWatch only
+  uint32_t WatchPolls = 0;
+  uint32_t WatchLastPoll = 0;
+  uint32_t WatchMax = 0;
+  uint8_t WatchMaxPhase = PhaseLoop;
+  uint8_t WatchPhase = PhaseLoop;           // Running now
+  uint32_t WatchPhaseStart = 0;
+  uint8_t WatchHeavy = PhaseLoop;           // Longest phase since the last poll
+  uint32_t WatchHeavyTime = 0;
+  uint32_t WatchStall = 0;                  // us, gaps at least this long are stall events (0-off)
+  WatchEvent *WatchEvents = NULL;           //[WatchEventSize] latest stall events, oldest first
+  uint8_t N_WatchEvents = 0;
+  uint32_t STALL_Counter = 0;
+
+  //Rewrite Stage - applied to frames forwarded to the linked port, so each port rewrites one direction.
+  //  Patches are keyed by the received MID. The checksum is adjusted by the bytes changed.
+  const static int RewritePatchSize = 8;
+  const static int RewritePatchBytes = 4;
+  struct RewritePatch {
+    uint8_t mid;
+    uint8_t pid;
+    uint8_t len;
+    uint8_t value[RewritePatchBytes];      // Data bytes of the PID: (data & ~mask) | (value & mask)
+    uint8_t mask[RewritePatchBytes];
+  };
+  uint8_t *RewriteMIDMap = NULL;           //[256] forwarded MID of each received MID
+  RewritePatch *RewritePatches = NULL;     //[RewritePatchSize]
+  uint8_t N_RewritePatches = 0;
+  J1708MIDSet RewritePatchMIDs;            // MIDs with at least one patch
+  bool RewriteOn = false;                  // Any translation or patch set
+  uint32_t REWRITE_Counter = 0;            // Forwarded frames changed
 
 
   // Setup Functions
-  bool begin(int port_number=3, int baud=9600, int rx_led=13, int tx_led=12);
-  void link(J1708 *_j1708Object);
+  bool begin(int port_number=3, int baud=9600, int rx_led=PinDefault, int tx_led=PinDefault);
+  void link(J1708Core *_j1708Object);
   void unlink();
 
 
   // Primary Functions
   uint8_t J1708Rx(uint8_t (&J1708RxFrame)[RxBufferSize]);
+  bool J1708RxSplit();
 
   void J1708AppendChecksum(uint8_t J1708TxData[],const uint8_t &TxFrameLength);
 
   bool J1708Tx(uint8_t J1708TxData[], const uint8_t &TxFrameLength, const uint8_t &TxFramePriority, bool AutoChecksum=true);
 
-  bool J1708Send(uint8_t J1708TxData[], const int &TxFrameLength, const int &TxFramePriority);
+  bool J1708Send(uint8_t J1708TxData[], const int &TxFrameLength, const int &TxFramePriority, bool AutoChecksum=true);
+
+  int J1708TxQFree();
+
+  int J1708TxQNext();
+
+  void J1708TxQRemove(const int &slot);
+
+  void J1708ShapeReset();
+
+  void J1708ShapeRefill(ShapeBucket &bucket, const uint16_t &rate, const uint16_t &burst, const uint16_t &now);
+
+  void J1708ShapeBudget(const uint8_t &mid, uint16_t &rate, uint16_t &burst);
+
+  void J1708ShapeSweep();
+
+  bool J1708SendAt(uint8_t J1708TxData[], const int &TxFrameLength, const int &TxFramePriority, const uint32_t &SendTime);
+
+  void J1708ServiceSchedule();
+
+  bool J1708ReplayAdd(const uint8_t J1708Message[], const uint8_t &MessageLength, const uint32_t &CaptureTime);
+
+  bool J1708ReplayAddLine(const char *line);
+
+  void J1708ReplayStart();
+
+  void J1708ReplayStop();
+
+  void J1708ReplayReset();
+
+  bool J1708ReplayService();
+
+  bool J1708GenAddECU(const uint8_t &mid, const uint8_t pids[], const uint8_t &nPids, const uint16_t &period, const uint8_t &priority=8);
+
+  void J1708GenDefault();
+
+  void J1708GenReset();
+
+  void J1708GenStart();
+
+  void J1708GenStop();
+
+  void J1708GenService();
+
+  uint8_t J1708GenBroadcast(GenECU &ecu);
+
+  bool J1708DedupSuppress(const uint8_t J1708Message[], const uint8_t &MessageLength);
+
+  void J1708RewriteReset();
+
+  void J1708Rewrite(uint8_t J1708Message[], const uint8_t &FrameLength);
+
+  void J1708FilterCompile();
+
+  void J1708Display(const uint8_t frame[], const uint8_t &FrameLength, const uint32_t &time);
+
+  void J1708SampleCheck();
+
+  void J1708SampleEnd();
+
+  bool J1708FilterAccept(const uint8_t frame[], const uint8_t &FrameLength);
+
+  void J1708ConfigBuild(J1708Config &config);
+
+  void J1708ConfigApply(const J1708Config &config);
+
+  bool J1708ConfigLoad();
+
+  bool J1708ConfigSave();
+
+  void J1708ConfigErase();
+
+  void J1708ConfigService();
+
+  void J1708CaptureAdd(const uint8_t frame[], const uint8_t &FrameLength, const uint32_t &time);
+
+  void J1708CaptureTrigger(const char *reason);
+
+  void J1708CaptureCheckErrors();
+
+  void J1708CaptureArm();
+
+  void J1708CapturePrint();
+
+  uint32_t J1708ErrorCount(const uint8_t &n);
   
   bool RTS_Handler(uint8_t TP_Data[]);
   
@@ -201,6 +764,21 @@ struct J1708 {
   bool J1708CheckChecksum(uint8_t J1708Message[],const uint8_t &FrameLength);
   
   bool J1708CheckACL(const uint8_t &mid);
+  void J1708EchoAdd(const uint8_t frame[], const uint8_t &length);
+  bool J1708EchoMatch(const uint8_t frame[], const uint8_t &length);
+  void J1708EchoExpire();
+  void J1708WatchPoll();
+  void J1708WatchEnter(const uint8_t &phase);
+  uint32_t J1708WatchPercentile(const uint8_t &percent);
+  void J1708WatchReset();
+  void J1708StatsPublish();
+  void J1708StatsFill(J1708Stats &stats);
+  bool J1708StatsRead(J1708Stats &stats);
+  bool snapshot(J1708Stats &stats, int tries=4);
+  void J1708StatsPeriodic();
+  int J1708Export(uint8_t format);
+  int J1708ExportBinary(const J1708Stats &stats, uint8_t packet[]);
+  int J1708ExportJSON(const J1708Stats &stats, char record[], int size);
   
   void UpdateNetworkStatistics();
   
@@ -213,19 +791,322 @@ struct J1708 {
   int J1708Parse();
   
   void J1708Listen();
+
+  bool J1708ListenFrame();
+
+  void J1708ListenParse();
+
+  void J1708ListenTx();
+
+  void J1708ListenPeriodic();
   
+  void J1708CacheUpdate(const uint8_t J1708Message[], const uint8_t &MessageLength);
+
+  bool J1708CacheLookup(const uint8_t &mid, const uint16_t &pid, uint8_t value[], uint8_t &len, uint32_t &age);
+
+  void J1708CacheReset();
+
+  void J1708CachePrint(int mid=-1, int pid=-1);
+
+  bool J1708AnswerRequest(const uint8_t J1708Message[], const uint8_t &MessageLength);
+
   bool J1708TransportTx(uint8_t TP_Data[], const uint16_t &nBytes, const uint8_t &D_MID);
   
   void J1708Log();
+
+  void J1708LogFrame();
+
+  void J1708PrintFrame(const uint8_t frame[], const uint8_t &FrameLength, const uint32_t &time, const uint16_t &suppressed=0);
   
   void J1708Update();
+
+  void J1708Update(const uint32_t &maxMicros);
+
+  void J1708UpdateStep(const uint8_t &step);
+
+  void J1708Defer();
+
+  void J1708DeferredPrint();
+
+  bool J1708Pending();
   
   bool J1708Settings(String &command);
+
+  bool J1708Settings(const char *command);
   
   private:
+  //Command Dispatch
+  struct CommandEntry;
+  typedef bool (J1708Core::*CommandHandler)(const J1708Args &args, const CommandEntry &entry);
+  struct CommandEntry {
+    const char *cmd;
+    const char *sub;                     // NULL matches any subcommand
+    const char *opt;                     // NULL matches any option
+    CommandHandler handler;
+    bool J1708Core::*flag;                   // Setting toggled by CmdFlag
+  };
+  static const CommandEntry Commands[];
+  bool CmdFlag(const J1708Args &args, const CommandEntry &entry);
+  bool CmdACL(const J1708Args &args, const CommandEntry &entry);
+  bool CmdSelfMID(const J1708Args &args, const CommandEntry &entry);
+  bool CmdLimit(const J1708Args &args, const CommandEntry &entry);
+  bool CmdHelp(const J1708Args &args, const CommandEntry &entry);
+  bool CmdQuery(const J1708Args &args, const CommandEntry &entry);
+  bool CmdReset(const J1708Args &args, const CommandEntry &entry);
+  bool CmdShowPreset(const J1708Args &args, const CommandEntry &entry);
+  bool CmdShowACL(const J1708Args &args, const CommandEntry &entry);
+  bool CmdShowInfo(const J1708Args &args, const CommandEntry &entry);
+  bool CmdShowStatistics(const J1708Args &args, const CommandEntry &entry);
+  bool CmdShowProfile(const J1708Args &args, const CommandEntry &entry);
+  bool CmdSendTransport(const J1708Args &args, const CommandEntry &entry);
+  bool CmdSend(const J1708Args &args, const CommandEntry &entry);
+  bool CmdReplay(const J1708Args &args, const CommandEntry &entry);
+  bool CmdReplaySpeed(const J1708Args &args, const CommandEntry &entry);
+  bool CmdGen(const J1708Args &args, const CommandEntry &entry);
+  bool CmdCapture(const J1708Args &args, const CommandEntry &entry);
+  bool CmdEEPROM(const J1708Args &args, const CommandEntry &entry);
+  bool CmdFilter(const J1708Args &args, const CommandEntry &entry);
+  bool CmdSample(const J1708Args &args, const CommandEntry &entry);
+  bool CmdDedup(const J1708Args &args, const CommandEntry &entry);
+  bool CmdRewrite(const J1708Args &args, const CommandEntry &entry);
+  bool CmdShape(const J1708Args &args, const CommandEntry &entry);
+  bool CmdWatch(const J1708Args &args, const CommandEntry &entry);
+  bool CmdExport(const J1708Args &args, const CommandEntry &entry);
+
+
+  int ParamCacheSlot(const uint8_t &mid, const uint16_t &pid, bool insert);
+
   //Object References
-  HardwareSerial *_streamRef; // The Rx/Tx Serial Port for this object.
-  J1708 *_j1708Ref;           // Used for linking to another J1708 object
+  J1708SerialPort *_streamRef = NULL; // The Rx/Tx Serial Port for this object.
+  J1708Core *_j1708Ref;       // Used for linking to another J1708 object
+  J1708Merge *_mergeRef = NULL; // Receives the frames to print when attached to a merged capture
+  uint8_t _mergeIndex = 0;
+  friend struct J1708Merge;
+
+  protected:
+  J1708Core() {}
+};
+
+// Storage for a J1708Port. Zero-length arrays take no data.
+template <typename T, int N>
+struct J1708Array {
+  T data[N] = {};
+  T *get() { return data; }
+};
+
+template <typename T>
+struct J1708Array<T,0> {
+  T *get() { return NULL; }
+};
+
+//J1708 Port
+//  TxQDepth    Tx queue depth (frames)
+//  TPBytes     largest transport message sent or received (bytes, 0-256). 0 - Transport disabled
+//  Stats       J1708StatsLevel
+//  Features    J1708Feature mask
+//  e.g. a logger that never transmits: J1708Port<0,0,StatsBusload,0>
+template <int TxQDepth=32, int TPBytes=256, int Stats=StatsPerMID, uint16_t Features=FeatureDefault, int RxBytes=192>
+struct J1708Port : J1708Core {
+  J1708Port() {
+    TxQmax = TxQDepth;
+    J1708TxQ = txQ.get();
+    J1708TxQLengths = txQLengths.get();
+    J1708TxQPriorities = txQPriorities.get();
+    J1708TxQFlags = txQFlags.get();
+    ShapeMIDs = shape.get();
+    ShapePriority = ShapeMIDs ? ShapeMIDs+256 : NULL;
+    ShapeRules = shapeRules.get();
+    ShapePriorityRate = shapeRates.get();
+    ShapePriorityBurst = shapeBursts.get();
+    EchoFrames = echo.get();
+    EchoLengths = echoLengths.get();
+    EchoTimes = echoTimes.get();
+    WatchHistogram = watch.get();
+    WatchEvents = watchEvents.get();
+    Deferred = deferred.get();
+    StatsBlock = statsBlock.get();
+    TPCapacity = TPBytes;
+    TPSegments = TPRows;
+    TP_Tx_Buffer = tpTx.get();
+    TP_Rx_Buffer = tpRx.get();
+    Q_Matrix = qMatrix.get();
+    Q_Lengths = qLengths.get();
+    MIDByteCount = midBytes.get();
+    MIDShareTracker = midShare.get();
+    ERR7_IDCounter = err7.get();
+    ParamCache = cache.get();
+    DedupTable = dedup.get();
+    J1708TxSched = sched.get();
+    J1708TxSchedLengths = schedLengths.get();
+    J1708TxSchedPriorities = schedPriorities.get();
+    J1708TxSchedTimes = schedTimes.get();
+    J1708Replay = replay.get();
+    J1708ReplayLengths = replayLengths.get();
+    J1708ReplayTimes = replayTimes.get();
+    GenECUs = gen.get();
+    CaptureRing = capture.get();
+    SampleMIDs = sample.get();
+    RewriteMIDMap = midMap.get();
+    RewritePatches = patches.get();
+    RxMemory = rxMemory.get();
+    RxMemorySize = RxBytes;
+    J1708RewriteReset();
+    PortSize = sizeof(*this);
+  }
+
+  private:
+  // Segments of TP_Default_Segment_Size (15) plus room for a smaller segment size
+  const static int TPRows = TPBytes>0 ? TPBytes/15+3 : 0;
+  const static int MIDs = Stats>=StatsPerMID ? 256 : 0;
+  const static int Sched = (Features & FeatureSchedule) ? TxSchedSize : 0;
+  const static int Replay = (Features & FeatureReplay) ? ReplaySize : 0;
+  const static int Shape = (Features & FeatureShaping) ? 1 : 0;
+  const static int Echo = (Features & FeatureEcho) ? EchoSize : 0;
+  const static int Watch = (Features & FeatureWatch) ? 1 : 0;
+
+  J1708Array<uint8_t[21], TxQDepth> txQ;
+  J1708Array<int, TxQDepth> txQLengths;
+  J1708Array<uint8_t, TxQDepth> txQPriorities;
+  J1708Array<uint8_t, TxQDepth> txQFlags;
+  J1708Array<uint8_t, TPBytes> tpTx;
+  J1708Array<uint8_t, TPBytes> tpRx;
+  J1708Array<uint8_t[21], TPRows> qMatrix;
+  J1708Array<uint8_t, TPRows> qLengths;
+  J1708Array<uint32_t, MIDs> midBytes;
+  J1708Array<float, MIDs> midShare;
+  J1708Array<uint16_t, (Features & FeatureSecurity) ? 256 : 0> err7;
+  J1708Array<ParamEntry, (Features & FeatureCache) ? ParamCacheSize : 0> cache;
+  J1708Array<DedupEntry, (Features & FeatureDedup) ? DedupSize : 0> dedup;
+  J1708Array<uint8_t[21], Sched> sched;
+  J1708Array<uint8_t, Sched> schedLengths;
+  J1708Array<uint8_t, Sched> schedPriorities;
+  J1708Array<uint32_t, Sched> schedTimes;
+  J1708Array<uint8_t[21], Replay> replay;
+  J1708Array<uint8_t, Replay> replayLengths;
+  J1708Array<uint32_t, Replay> replayTimes;
+  J1708Array<GenECU, (Features & FeatureGenerator) ? GenECUSize : 0> gen;
+  J1708Array<uint8_t, (Features & FeatureCapture) ? CaptureBytes : 0> capture;
+  J1708Array<SampleMID, (Features & FeatureSampling) ? 256 : 0> sample;
+  J1708Array<uint8_t, (Features & FeatureRewrite) ? 256 : 0> midMap;
+  J1708Array<ShapeBucket, Shape*(256+9)> shape;
+  J1708Array<ShapeRule, Shape*ShapeRuleSize> shapeRules;
+  J1708Array<uint16_t, Shape*9> shapeRates;
+  J1708Array<uint16_t, Shape*9> shapeBursts;
+  J1708Array<uint8_t[21], Echo> echo;
+  J1708Array<uint8_t, Echo> echoLengths;
+  J1708Array<uint32_t, Echo> echoTimes;
+  J1708Array<uint32_t, Watch*WatchBuckets> watch;
+  J1708Array<WatchEvent, Watch*WatchEventSize> watchEvents;
+  J1708Array<DeferredFrame, (Features & FeatureBudget) ? DeferSize : 0> deferred;
+  J1708Array<J1708Stats, (Features & FeatureSnapshot) ? 1 : 0> statsBlock;
+  J1708Array<RewritePatch, (Features & FeatureRewrite) ? RewritePatchSize : 0> patches;
+  J1708Array<uint8_t, RxBytes> rxMemory;
+};
+
+// Default port, the buffers of earlier releases. Other features are opt-in.
+typedef J1708Port<> J1708;
+// Every feature
+typedef J1708Port<32,256,StatsPerMID,FeatureAll> J1708Full;
+
+//Merged Capture - frames of several ports printed as one time-ordered stream
+//  Attached ports queue their received frames in a ring per port instead of
+//  printing them. J1708MergeUpdate() prints the earliest queued frame once no
+//  attached port can still deliver an earlier one (k-way merge on J1708Time()).
+//  Call it from loop() after the port updates.
+struct J1708Merge {
+  const static int MaxPorts = 8;
+  const static int RingSize = 8;
+
+  J1708Core *ports[MaxPorts];
+  uint8_t N_Ports = 0;
+  uint32_t MERGE_Counter = 0;          // Frames printed
+  uint32_t MERGE_Forced_Counter = 0;   // Frames printed early because a ring was full
+
+  bool attach(J1708Core *port);
+  void J1708MergePush(uint8_t index, const uint8_t frame[], const uint8_t &FrameLength, const uint32_t &time, const uint16_t &suppressed=0);
+  void J1708MergeUpdate();
+
+  private:
+  struct Frame {
+    uint32_t time;
+    uint8_t length;
+    uint16_t suppressed;                     // Sampled logging summary
+    uint8_t data[J1708Core::RxBufferSize];   // Laid out like J1708RxBuffer
+  };
+  Frame rings[MaxPorts][RingSize];
+  uint8_t head[MaxPorts] = {};
+  uint8_t count[MaxPorts] = {};
+
+  bool J1708MergeEmit(bool force);
+};
+
+//Port Group - services several ports from one loop
+//  J1708GroupUpdate() updates only the ports with pending work: received bytes,
+//  a frame being received, or frames waiting to be sent. Every SweepMillis all
+//  ports are updated for their periodic tasks (busload, network checks, timeouts).
+struct J1708Group {
+  const static int MaxPorts = 8;
+
+  J1708Core *ports[MaxPorts];
+  uint8_t N_Ports = 0;
+  uint8_t ready = 0;                 // Bit i - ports[i] was updated on the last call
+  uint32_t SweepMillis = 10;
+  uint32_t BudgetMicros = 0;         // Per port and call, J1708Update(BudgetMicros). 0 - plain J1708Update()
+  uint32_t UPDATE_Counter = 0;       // Port updates
+  uint32_t SWEEP_Counter = 0;
+
+  bool add(J1708Core *port);
+  void J1708GroupUpdate();
+
+  private:
+  elapsedMillis SweepTimer;
+};
+
+//Binary Host Protocol
+//  Packet: 0xA5 <type> <seq> <len> <payload[len]> <checksum>
+//  The checksum makes the sum of every byte after 0xA5 zero (same rule as J1708 frames).
+struct J1708Host {
+  enum packetType {
+    SEND = 0x01,        // <count> {<port> <priority> <send_time[4]> <len> <data[len]>}...   (send_time 0 - now)
+    PING = 0x02,        // Replies with TIME
+    REPLAY = 0x03,      // <port> <count> {<capture_time[4]> <len> <data[len]>}...
+    ACK  = 0x81,        // <status> <accepted> <n_ports> {<port> <tx_credits> <sched_credits> <replay_credits>}...
+    TIME = 0x82,        // <micros[4]>
+    STATS = 0x83        // <version> <port> <J1708Stats fields, see README>   (seq - publish count)
+  };
+  enum ackStatus {OK, BadPacket, BadPort, QueueFull, BadLength, UnknownType, BadPriority};
+
+  const static uint8_t Sync = 0xA5;
+  const static int MaxPorts = 8;
+  const static int MaxPayload = 255;
+  const static uint32_t PacketTimeout = 100; // ms allowed between bytes of one packet
+
+  J1708Core *ports[MaxPorts];
+  uint8_t N_Ports = 0;
+  Stream *_hostRef = &Serial;
+  uint32_t RX_Counter = 0;
+  uint32_t ERR_Counter = 0;
+
+  bool attach(J1708Core *port);
+  bool J1708HostRx(uint8_t c);
+  void J1708HostTx(uint8_t type, uint8_t seq, const uint8_t payload[], uint8_t len);
+  static int J1708HostSeal(uint8_t packet[], uint8_t type, uint8_t seq, uint8_t len);
+
+  private:
+  enum rxState {Idle, Type, Seq, Length, Payload, Checksum};
+  rxState state = Idle;
+  uint8_t rxType = 0;
+  uint8_t rxSeq = 0;
+  uint8_t rxLength = 0;
+  uint8_t rxCount = 0;
+  uint8_t rxSum = 0;
+  uint8_t rxPayload[MaxPayload];
+  elapsedMillis PacketTimer;
+
+  void HandlePacket();
+  uint8_t HandleSend(uint8_t &accepted);
+  uint8_t HandleReplay(uint8_t &accepted);
+  J1708Core *FindPort(uint8_t port_number);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,281 @@
+/*
+  benchmark.ino
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Per-frame CPU cost and loop time benchmark.
+    Port 5 generates synthetic traffic at increasing busload. Port 3 (the
+    device under test) receives it and forwards it to port 4. Results are
+    printed to Serial as one JSON object per line:
+      {"bench":"<function>",...}  cost of single calls (cycles)
+      {"bench":"load",...}        loop time and errors at one busload step
+      {"bench":"summary",...}     highest busload without ERR2/ERR3
+      {"bench":"zone",...}        profiling zones, when built with J1708_PROFILE
+    Wiring: ports 3 and 5 on the same J1708 bus, port 4 on a second bus.
+    The same sketch runs on Linux against the simulated bus (extras/host,
+    "make bench"), where costs are reported in nanoseconds.
+    Build with J1708_PROFILE defined ("make clean bench PROFILE=1") to also
+    report where the time of the busload steps went, per profiling zone.
+    Compatible with Teensy 4.0 only.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+//Librarie(s):
+#include <J1708_T4.h>
+
+#if defined(J1708_HOST)
+const char *unit = "ns";
+#else
+const char *unit = "cycles";
+#endif
+
+uint32_t cycles() {
+  return J1708Cycles();
+}
+
+J1708Full j1708_3;                // Device under test
+J1708Full j1708_4;                // Forwarding target of the device under test
+J1708Full generator;              // Synthetic traffic source
+
+//Benchmark Settings
+const float loads[] = {0.2, 0.4, 0.6, 0.8, 0.9, 1.0};
+const uint32_t stepMillis = 5000;    // Duration of each busload step
+const uint8_t frameLength = 10;      // Generated frame length, checksum included
+const int microCalls = 1000;         // Calls per single-function benchmark
+
+//Loop time histogram, bucket i counts calls taking [2^i, 2^(i+1)) units
+struct Histogram {
+  uint32_t buckets[32];
+  uint32_t calls;
+  uint64_t total;
+  uint32_t max;
+  void reset() {
+    memset(buckets, 0, sizeof(buckets));
+    calls = 0;
+    total = 0;
+    max = 0;
+  }
+  void add(uint32_t value) {
+    int i = 0;
+    while (i < 31 && (value >> (i + 1))) {
+      i++;
+    }
+    buckets[i]++;
+    calls++;
+    total += value;
+    if (value > max) {
+      max = value;
+    }
+  }
+  uint32_t percentile(float p) {
+    // Upper edge of the bucket holding the p-th percentile
+    uint32_t target = (uint32_t)(calls * p);
+    uint32_t seen = 0;
+    for (int i = 0; i < 32; i++) {
+      seen += buckets[i];
+      if (seen > target) {
+        return i < 31 ? (2u << i) - 1 : 0xFFFFFFFF;
+      }
+    }
+    return max;
+  }
+};
+
+Histogram idleUpdates;        // Device under test calls that did not complete a frame
+Histogram frameUpdates;       // Device under test calls that completed a frame
+Histogram txUpdates;          // Forwarding port calls that transmitted a frame
+
+void printResult(const char *name, Histogram &h) {
+  Serial.print("{\"bench\":\"");Serial.print(name);
+  Serial.print("\",\"unit\":\"");Serial.print(unit);
+  Serial.print("\",\"calls\":");Serial.print(h.calls);
+  Serial.print(",\"mean\":");Serial.print(h.calls ? (uint32_t)(h.total / h.calls) : 0);
+  Serial.print(",\"p99\":");Serial.print(h.percentile(0.99));
+  Serial.print(",\"max\":");Serial.print(h.max);
+  Serial.println("}");
+}
+
+void benchFunctions() {
+  Histogram h;
+  uint32_t t;
+
+  //J1708Parse on a PID 197 (RTS) frame addressed to the gateway
+  uint8_t rts[10] = {0, 0xAC, 197, 5, j1708_3.selfMID, 1, 2, 30, 0, 0};
+  j1708_3.GatewaySpecificProcessing = true;
+  h.reset();
+  for (int i = 0; i < microCalls; i++) {
+    memcpy(j1708_3.J1708RxBuffer, rts, sizeof(rts));
+    j1708_3.Loop_flag = false;
+    t = cycles();
+    j1708_3.J1708Parse();
+    h.add(cycles() - t);
+  }
+  j1708_3.GatewaySpecificProcessing = false;
+  printResult("J1708Parse", h);
+
+  //UpdateNetworkStatistics when the one second busload window closes
+  h.reset();
+  for (int i = 0; i < microCalls; i++) {
+    j1708_3.BusloadTimer = 1001;
+    t = cycles();
+    j1708_3.UpdateNetworkStatistics();
+    h.add(cycles() - t);
+  }
+  printResult("UpdateNetworkStatistics", h);
+
+  //J1708CheckNetwork with sustained high busload (per-MID flood scan)
+  h.reset();
+  for (int i = 0; i < microCalls; i++) {
+    j1708_3.ERR6_Timer = 501;
+    j1708_3.busload = 2.0;
+    j1708_3.ERR6_ConsecutiveCounter = j1708_3.ERR6_ConsecutiveMax;
+    t = cycles();
+    j1708_3.J1708CheckNetwork();
+    h.add(cycles() - t);
+  }
+  j1708_3.J1708Settings("j1708config sp3 -r -e");
+  j1708_3.busload = 0;
+  printResult("J1708CheckNetwork", h);
+
+  //J1708Settings for an on/off option and a full-length j1708send
+  h.reset();
+  for (int i = 0; i < microCalls; i++) {
+    t = cycles();
+    j1708_3.J1708Settings("j1708config sp3 -s -b 0");
+    h.add(cycles() - t);
+  }
+  printResult("J1708Settings_flag", h);
+  const char *send = "j1708send sp3 20 80.01.02.03.04.05.06.07.08.09.0a.0b.0c.0d.0e.0f.10.11.12.13";
+  h.reset();
+  for (int i = 0; i < microCalls; i++) {
+    t = cycles();
+    j1708_3.J1708Settings(send);
+    h.add(cycles() - t);
+    j1708_3.N_TxQ_Total = 0;
+    j1708_3.N_TxS = 0;
+  }
+  printResult("J1708Settings_send", h);
+}
+
+float benchLoad(float load) {
+  //Returns the measured busload, or -1 if ERR2/ERR3 occurred
+  //Generated frames per second for the requested load (903 characters/s protocol max)
+  uint32_t interval = (uint32_t)(1000000.0 * frameLength / (load * 903.0));
+  idleUpdates.reset();
+  frameUpdates.reset();
+  txUpdates.reset();
+  j1708_3.J1708Settings("j1708config sp3 -r -e");
+  j1708_3.J1708Settings("j1708config sp3 -r -c");
+  j1708_4.J1708Settings("j1708config sp4 -r -e");
+  j1708_4.J1708Settings("j1708config sp4 -r -c");
+  uint32_t sent = 0;
+  float busloadTotal = 0;
+  uint32_t busloadSamples = 0;
+  elapsedMillis step;
+  elapsedMicros period;
+  elapsedMillis sample;
+  while (step < stepMillis) {
+    if (period >= interval) {
+      period = 0;
+      uint8_t msg[frameLength] = {0x80, 84, (uint8_t)sent, 190, 0x10, 0x27, 92, (uint8_t)(sent >> 8), 0x55};
+      if (generator.J1708Send(msg, frameLength, 8)) {
+        sent++;
+      }
+    }
+    uint32_t rx = j1708_3.RX_Counter;
+    uint32_t t = cycles();
+    j1708_3.J1708Update();
+    t = cycles() - t;
+    if (j1708_3.RX_Counter != rx) {
+      frameUpdates.add(t);
+    }
+    else {
+      idleUpdates.add(t);
+    }
+    uint32_t tx = j1708_4.TX_Counter;
+    t = cycles();
+    j1708_4.J1708Update();
+    t = cycles() - t;
+    if (j1708_4.TX_Counter != tx) {
+      txUpdates.add(t);
+    }
+    generator.J1708Update();
+    if (sample >= 1000) {
+      //One busload measurement per second
+      sample = 0;
+      busloadTotal += j1708_3.busload;
+      busloadSamples++;
+    }
+  }
+  bool clean = j1708_3.ERR2_Counter == 0 && j1708_4.ERR3_Counter == 0;
+  float measured = busloadSamples ? busloadTotal / busloadSamples : 0.0;
+  Serial.print("{\"bench\":\"load\",\"unit\":\"");Serial.print(unit);
+  Serial.print("\",\"target\":");Serial.print(load);
+  Serial.print(",\"measured\":");Serial.print(measured);
+  Serial.print(",\"sent\":");Serial.print(sent);
+  Serial.print(",\"received\":");Serial.print(j1708_3.RX_Counter);
+  Serial.print(",\"forwarded\":");Serial.print(j1708_4.TX_Counter);
+  Serial.print(",\"err2\":");Serial.print(j1708_3.ERR2_Counter);
+  Serial.print(",\"err3\":");Serial.print(j1708_4.ERR3_Counter);
+  Serial.print(",\"update_mean\":");Serial.print(idleUpdates.calls ? (uint32_t)(idleUpdates.total / idleUpdates.calls) : 0);
+  Serial.print(",\"update_p99\":");Serial.print(idleUpdates.percentile(0.99));
+  Serial.print(",\"update_max\":");Serial.print(idleUpdates.max);
+  Serial.print(",\"frame_mean\":");Serial.print(frameUpdates.calls ? (uint32_t)(frameUpdates.total / frameUpdates.calls) : 0);
+  Serial.print(",\"frame_max\":");Serial.print(frameUpdates.max);
+  Serial.print(",\"tx_mean\":");Serial.print(txUpdates.calls ? (uint32_t)(txUpdates.total / txUpdates.calls) : 0);
+  Serial.print(",\"tx_max\":");Serial.print(txUpdates.max);
+  Serial.println("}");
+  return clean ? measured : -1.0;
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  j1708_3.begin(3);
+  j1708_4.begin(4);
+  generator.begin(5);
+  j1708_3.link(&j1708_4);
+
+  //Nothing is printed per frame so only library work is measured
+  j1708_3.J1708Settings("j1708config sp3 -s -n");
+  j1708_4.J1708Settings("j1708config sp4 -s -n");
+  generator.J1708Settings("j1708config sp5 -s -n");
+
+  J1708CyclesBegin();
+  benchFunctions();
+  J1708ProfileReset();
+  float maxLoad = 0;
+  for (unsigned int i = 0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+    float measured = benchLoad(loads[i]);
+    if (measured > maxLoad) {
+      maxLoad = measured;
+    }
+  }
+  Serial.print("{\"bench\":\"summary\",\"max_busload\":");Serial.print(maxLoad);Serial.println("}");
+
+#if defined(J1708_PROFILE)
+  //Zone totals cover every port and every busload step
+  for (int i = 0; i < ZoneCount; i++) {
+    J1708ProfileZone &z = J1708Profile[i];
+    Serial.print("{\"bench\":\"zone\",\"name\":\"");Serial.print(J1708ZoneNames[i]);
+    Serial.print("\",\"unit\":\"");Serial.print(unit);
+    Serial.print("\",\"calls\":");Serial.print(z.calls);
+    Serial.print(",\"mean\":");Serial.print(z.calls ? (uint32_t)(z.total / z.calls) : 0);
+    Serial.print(",\"min\":");Serial.print(z.min);
+    Serial.print(",\"max\":");Serial.print(z.max);
+    Serial.println("}");
+  }
+#endif
+}
+
+void loop() {
+}
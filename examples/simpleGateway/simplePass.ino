@@ -25,10 +25,10 @@
 
 bool stringComplete = false;  // Flag to indicate whether the string is complete
 String inputString = "";      // A String to hold incoming data
-String port;                  // Identifies which port command is directed to
 
 J1708 j1708_3;                // J1708 Object for Network Side
 J1708 j1708_4;                // J1708 Object for Host Side
+J1708Host host;               // Binary command channel on USB Serial
 
 void setup() {
   //All j1708 objects print to UART1 (Serial)
@@ -44,6 +44,10 @@ void setup() {
   //Forward filtered traffic to Serial Port 3
   j1708_4.link(&j1708_3);
 
+  //Accept binary frame batches for both ports
+  host.attach(&j1708_3);
+  host.attach(&j1708_4);
+
   //Serial command buffer
   inputString.reserve(256);
 }
@@ -56,16 +60,18 @@ void loop() {
   // Command Handling
   if (stringComplete) {
     inputString.trim();
-    if (getValue(inputString,' ',1)=="sp3"){
-      if (j1708_3.J1708Settings(inputString)){
+    J1708Args args;
+    J1708Tokenize(inputString.c_str(),args);
+    if (args.is(1,"sp3")){
+      if (j1708_3.J1708Settings(inputString.c_str())){
         Serial.println("Success!");
       }
       else{
         Serial.println("Invalid command. Try <command> -h for help.");
       }
     }
-    else if (getValue(inputString,' ',1)=="sp4"){
-      if (j1708_4.J1708Settings(inputString)){
+    else if (args.is(1,"sp4")){
+      if (j1708_4.J1708Settings(inputString.c_str())){
         Serial.println("Success!");
       }
       else{
@@ -82,6 +88,11 @@ void serialEvent() {
     // Get the new byte:
     char inChar = (char)Serial.read();
 
+    // Binary packets are handled as they arrive. Everything else is a text command.
+    if (host.J1708HostRx(inChar)) {
+      continue;
+    }
+
     // If the incoming character is a newline, set a flag so the main loop can do something about it:
     if (inChar == '\n') {
       stringComplete = true;
@@ -0,0 +1,285 @@
+/*
+  J1708_Host.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Host (Linux) implementation of the J1708_T4 hardware abstraction.
+    See J1708_Host.h.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+// Dependencies
+#include "J1708_Host.h"
+#include <stdarg.h>
+#include <time.h>
+
+J1708HostConsole Serial;
+J1708SerialPort Serial1, Serial2, Serial3, Serial4, Serial5, Serial6, Serial7, Serial8;
+J1708HostEEPROM EEPROM;
+
+// Clock
+unsigned long micros(){
+  J1708Sim &sim = J1708Sim::instance();
+  sim.advance(sim.tick);
+  return (unsigned long)sim.now;
+}
+
+unsigned long millis(){
+  return micros()/1000;
+}
+
+uint32_t J1708Cycles(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint32_t)((uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec);
+}
+
+// GPIO
+void pinMode(int pin, int mode){
+}
+
+void digitalWrite(int pin, int value){
+  if (pin>=0 && pin<64){
+    J1708Sim::instance().pins[pin] = value;
+  }
+}
+
+int digitalRead(int pin){
+  return (pin>=0 && pin<64) ? J1708Sim::instance().pins[pin] : LOW;
+}
+
+// Utility
+static uint32_t randomState = 1;
+
+long random(long howbig){
+  if (howbig<=0){
+    return 0;
+  }
+  // xorshift32 - repeatable across platforms for a given seed
+  randomState ^= randomState<<13;
+  randomState ^= randomState>>17;
+  randomState ^= randomState<<5;
+  return randomState % howbig;
+}
+
+long random(long howsmall, long howbig){
+  if (howsmall>=howbig){
+    return howsmall;
+  }
+  return howsmall + random(howbig-howsmall);
+}
+
+void randomSeed(unsigned long seed){
+  randomState = seed ? seed : 1;
+}
+
+void String::trim(){
+  size_t start = s.find_first_not_of(" \t\r\n");
+  size_t end = s.find_last_not_of(" \t\r\n");
+  s = (start==std::string::npos) ? "" : s.substr(start,end-start+1);
+}
+
+// Print
+size_t Print::write(const uint8_t *buffer, size_t size){
+  size_t n = 0;
+  for (size_t i=0; i<size; i++){
+    n += write(buffer[i]);
+  }
+  return n;
+}
+
+size_t Print::print(const char *str){
+  return write((const uint8_t *)str,strlen(str));
+}
+
+size_t Print::printf_(const char *format, ...){
+  char buf[64];
+  va_list args;
+  va_start(args,format);
+  int n = vsnprintf(buf,sizeof(buf),format,args);
+  va_end(args);
+  return n>0 ? print(buf) : 0;
+}
+
+// Console
+size_t J1708HostConsole::write(uint8_t c){
+  writes++;
+  if (microsPerByte){
+    J1708Sim::instance().advance(microsPerByte);
+  }
+  if (out){
+    fputc(c,out);
+  }
+  return 1;
+}
+
+size_t J1708HostConsole::write(const uint8_t *buffer, size_t size){
+  writes++;
+  if (microsPerByte){
+    J1708Sim::instance().advance((uint64_t)microsPerByte*size);
+  }
+  if (out){
+    fwrite(buffer,1,size,out);
+  }
+  return size;
+}
+
+int J1708HostConsole::read(){
+  if (!available()){
+    return -1;
+  }
+  int c = (uint8_t)input[inputPos++];
+  if (inputPos==input.size()){
+    input.clear();
+    inputPos = 0;
+  }
+  return c;
+}
+
+// Serial port
+J1708SerialPort::J1708SerialPort(size_t rx_buffer_size, size_t tx_buffer_size)
+  : rxBase(rx_buffer_size), rxCapacity(rx_buffer_size), txBase(tx_buffer_size), txCapacity(tx_buffer_size){
+}
+
+void J1708SerialPort::begin(uint32_t baud_rate){
+  baud = baud_rate;
+  if (bus>=0){
+    J1708SimBus &b = J1708Sim::instance().buses[bus];
+    b.charTime = (10*1000000+baud/2)/baud;
+    b.bitTime = (1000000+baud/2)/baud;
+  }
+}
+
+int J1708SerialPort::available(){
+  return rxFifo.size();
+}
+
+int J1708SerialPort::read(){
+  if (rxFifo.empty()){
+    return -1;
+  }
+  int c = rxFifo.front();
+  rxFifo.erase(rxFifo.begin());
+  return c;
+}
+
+int J1708SerialPort::peek(){
+  return rxFifo.empty() ? -1 : rxFifo.front();
+}
+
+int J1708SerialPort::availableForWrite(){
+  return txCapacity-txFifo.size();
+}
+
+size_t J1708SerialPort::write(uint8_t c){
+  if (bus<0){
+    //Not wired to anything
+    return 1;
+  }
+  J1708Sim &sim = J1708Sim::instance();
+  while (txFifo.size()>=txCapacity){
+    //Like the Teensy core, block until there is room
+    sim.advance(sim.buses[bus].charTime);
+  }
+  txFifo.push_back(c);
+  sim.startChar(*this);
+  return 1;
+}
+
+void J1708SerialPort::receive(uint8_t c){
+  if (rxFifo.size()>=rxCapacity){
+    overruns++;
+    overrunFlag = true;
+    return;
+  }
+  rxFifo.push_back(c);
+}
+
+// Simulator
+J1708Sim &J1708Sim::instance(){
+  static J1708Sim sim;
+  return sim;
+}
+
+void J1708Sim::attach(J1708SerialPort &port, int bus){
+  if (bus<0 || bus>=MaxBuses){
+    return;
+  }
+  port.bus = bus;
+  buses[bus].ports.push_back(&port);
+}
+
+void J1708Sim::startChar(J1708SerialPort &port){
+  J1708SimBus &bus = buses[port.bus];
+  if (!bus.busy){
+    //Idle line. Every port with a byte ready starts now.
+    bus.busy = true;
+    bus.slotStart = now;
+    bus.slotEnd = now + bus.charTime;
+    bus.slotValue = 0xFF;
+    bus.slotSenders = 0;
+    if (bus.slotStart - bus.lastEnd > 2*bus.bitTime || bus.bytes==0){
+      bus.frames++;
+    }
+    for (size_t i=0; i<bus.ports.size(); i++){
+      J1708SerialPort *p = bus.ports[i];
+      if (!p->txFifo.empty()){
+        bus.slotValue &= p->txFifo.front();
+        p->txFifo.erase(p->txFifo.begin());
+        p->transmitting = true;
+        bus.slotSenders++;
+      }
+    }
+  }
+  else if (!port.transmitting && now - bus.slotStart < bus.bitTime){
+    //Started within a bit of another transmitter. Both drive the line.
+    bus.slotValue &= port.txFifo.front();
+    port.txFifo.erase(port.txFifo.begin());
+    port.transmitting = true;
+    bus.slotSenders++;
+  }
+}
+
+void J1708Sim::run(J1708SimBus &bus){
+  while (bus.busy && bus.slotEnd<=now){
+    if (bus.slotSenders>1){
+      bus.collisions++;
+    }
+    for (size_t i=0; i<bus.ports.size(); i++){
+      bus.ports[i]->receive(bus.slotValue);
+      bus.ports[i]->transmitting = false;
+    }
+    bus.bytes++;
+    bus.lastEnd = bus.slotEnd;
+    bus.busy = false;
+    //Back-to-back characters start as soon as the previous one ends
+    uint64_t end = bus.slotEnd;
+    for (size_t i=0; i<bus.ports.size(); i++){
+      if (!bus.ports[i]->txFifo.empty()){
+        uint64_t saved = now;
+        now = end;
+        startChar(*bus.ports[i]);
+        now = saved;
+        break;
+      }
+    }
+  }
+}
+
+void J1708Sim::advance(uint64_t us){
+  now += us;
+  for (int i=0; i<MaxBuses; i++){
+    if (buses[i].busy){
+      run(buses[i]);
+    }
+  }
+}
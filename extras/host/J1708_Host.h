@@ -0,0 +1,256 @@
+/*
+  J1708_Host.h
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Host (Linux) implementation of the J1708_T4 hardware abstraction.
+    Provides the small part of the Arduino/Teensy API used by the library,
+    backed by a virtual clock and a simulated wired-AND J1708 bus.
+
+    Every serial port can be attached to one of several buses. Bytes are
+    put on the wire one character time (10 bits) at a time. Ports that
+    start a character within one bit time of each other collide, and the
+    bus carries the AND of their bytes. Every port on the bus, including
+    the senders, receives what was on the wire (echo).
+
+    Each read of the clock advances it by J1708Sim::tick microseconds to
+    model CPU time, so busy-wait loops in the library make progress.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#ifndef J1708_HOST_H
+#define J1708_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+// Clock
+unsigned long micros();
+unsigned long millis();
+
+class elapsedMicros {
+  public:
+  elapsedMicros() { us = micros(); }
+  operator unsigned long() const { return micros() - us; }
+  elapsedMicros &operator=(unsigned long val) { us = micros() - val; return *this; }
+  private:
+  unsigned long us;
+};
+
+class elapsedMillis {
+  public:
+  elapsedMillis() { ms = millis(); }
+  operator unsigned long() const { return millis() - ms; }
+  elapsedMillis &operator=(unsigned long val) { ms = millis() - val; return *this; }
+  private:
+  unsigned long ms;
+};
+
+// Cycle counter (monotonic nanoseconds, real time rather than virtual)
+inline void J1708CyclesBegin() {}
+uint32_t J1708Cycles();
+
+// GPIO
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+
+// Utility
+inline bool isHexadecimalDigit(int c) { return isxdigit(c) != 0; }
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+// Minimal Arduino String
+class String {
+  public:
+  String(const char *cstr = "") : s(cstr ? cstr : "") {}
+  String(const std::string &str) : s(str) {}
+  unsigned int length() const { return s.length(); }
+  char charAt(unsigned int i) const { return i < s.length() ? s[i] : 0; }
+  char operator[](unsigned int i) const { return charAt(i); }
+  String substring(unsigned int from, unsigned int to) const { return from < to && from < s.length() ? String(s.substr(from, to - from)) : String(); }
+  String substring(unsigned int from) const { return from < s.length() ? String(s.substr(from)) : String(); }
+  bool operator==(const String &rhs) const { return s == rhs.s; }
+  bool operator==(const char *rhs) const { return s == (rhs ? rhs : ""); }
+  bool operator!=(const String &rhs) const { return s != rhs.s; }
+  bool operator!=(const char *rhs) const { return !(*this == rhs); }
+  bool operator>(const String &rhs) const { return s > rhs.s; }
+  bool operator<(const String &rhs) const { return s < rhs.s; }
+  bool operator>=(const String &rhs) const { return s >= rhs.s; }
+  bool operator<=(const String &rhs) const { return s <= rhs.s; }
+  String &operator+=(char c) { s += c; return *this; }
+  String &operator+=(const char *cstr) { s += cstr; return *this; }
+  long toInt() const { return atol(s.c_str()); }
+  float toFloat() const { return (float)atof(s.c_str()); }
+  void toCharArray(char *buf, unsigned int bufsize) const { if (bufsize == 0) return; strncpy(buf, s.c_str(), bufsize - 1); buf[bufsize - 1] = '\0'; }
+  const char *c_str() const { return s.c_str(); }
+  void reserve(unsigned int size) { s.reserve(size); }
+  void trim();
+  private:
+  std::string s;
+};
+
+// Print and Stream
+class Print {
+  public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  virtual int availableForWrite() { return 4096; }
+  size_t print(const char *str);
+  size_t print(const String &str) { return print(str.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int n) { return printf_("%d", n); }
+  size_t print(unsigned int n) { return printf_("%u", n); }
+  size_t print(long n) { return printf_("%ld", n); }
+  size_t print(unsigned long n) { return printf_("%lu", n); }
+  size_t print(long long n) { return printf_("%lld", n); }
+  size_t print(unsigned long long n) { return printf_("%llu", n); }
+  size_t print(double n, int digits = 2) { return printf_("%.*f", digits, n); }
+  size_t println() { return print("\r\n"); }
+  template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+  size_t println(double n, int digits) { size_t len = print(n, digits); return len + println(); }
+  private:
+  size_t printf_(const char *format, ...);
+};
+
+class Stream : public Print {
+  public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+// USB console. Printed text goes to out (stdout by default, NULL to mute).
+// Bytes pushed with inject() are read back like keyboard input.
+class J1708HostConsole : public Stream {
+  public:
+  FILE *out = stdout;
+  uint32_t writes = 0;         // write() calls
+  uint32_t microsPerByte = 0;  // Virtual time taken by each byte written, 0 - free
+  void begin(uint32_t baud) {}
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buffer, size_t size);
+  int available() { return input.size() - inputPos; }
+  int read();
+  int peek() { return available() ? (uint8_t)input[inputPos] : -1; }
+  void inject(const char *text) { input += text; }
+  operator bool() const { return true; }
+  private:
+  std::string input;
+  size_t inputPos = 0;
+};
+
+// Serial port on a simulated bus. The receive buffer defaults to the Teensy 4.x core size.
+#define J1708_SERIAL_RX_BUFFER 64
+class J1708SerialPort : public Stream {
+  public:
+  J1708SerialPort(size_t rx_buffer_size = J1708_SERIAL_RX_BUFFER, size_t tx_buffer_size = 40);
+  void begin(uint32_t baud);
+  void end() {}
+  int available();
+  int read();
+  int peek();
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buffer, size_t size) { return Print::write(buffer, size); }
+  int availableForWrite();
+  void setRX(uint8_t pin) {}
+  void setTX(uint8_t pin, bool opendrain = false) {}
+  void addMemoryForRead(void *buffer, size_t length) { rxCapacity = rxBase + length; }
+  void addMemoryForWrite(void *buffer, size_t length) { txCapacity = txBase + length; }
+
+  int bus = -1;                // Attached bus, -1 if none
+  uint32_t baud = 9600;
+  uint32_t overruns = 0;       // Bytes dropped because the receive buffer was full
+  bool overrunFlag = false;    // Set on overrun, cleared by the reader (like LPUART STAT[OR])
+
+  // Used by the bus
+  std::vector<uint8_t> rxFifo;
+  std::vector<uint8_t> txFifo;
+  bool transmitting = false;
+  void receive(uint8_t c);
+
+  private:
+  size_t rxBase, rxCapacity, txBase, txCapacity;
+};
+
+// True once per overrun, like reading and clearing LPUART STAT[OR]
+inline bool J1708RxOverrun(J1708SerialPort &serial, int capacity) {
+  bool overrun = serial.overrunFlag;
+  serial.overrunFlag = false;
+  return overrun;
+}
+
+// Virtual clock and buses
+struct J1708SimBus {
+  std::vector<J1708SerialPort *> ports;
+  bool busy = false;           // A character is on the wire
+  uint64_t slotStart = 0;
+  uint64_t slotEnd = 0;
+  uint64_t lastEnd = 0;
+  uint8_t slotValue = 0xFF;    // Wired-AND of every byte started in this slot
+  uint8_t slotSenders = 0;
+  uint32_t charTime = 1042;    // 10 bits at 9600 baud
+  uint32_t bitTime = 104;
+  uint64_t bytes = 0;
+  uint64_t frames = 0;
+  uint64_t collisions = 0;
+};
+
+struct J1708Sim {
+  const static int MaxBuses = 4;
+  uint64_t now = 0;            // Virtual time (micros)
+  uint32_t tick = 1;           // Micros added by every clock read
+  J1708SimBus buses[MaxBuses];
+  uint8_t pins[64] = {};
+
+  static J1708Sim &instance();
+  void attach(J1708SerialPort &port, int bus);
+  void advance(uint64_t us);   // Moves the virtual clock and the buses forward
+  void startChar(J1708SerialPort &port);
+  private:
+  void run(J1708SimBus &bus);
+};
+
+// EEPROM (the Teensy 4.0 size, erased to 0xFF). Kept for the life of the
+// process, so a scenario can "reboot" by starting new ports on the same data.
+class J1708HostEEPROM {
+  public:
+  const static int Size = 1080;
+  uint8_t data[Size];
+  uint32_t writes = 0;         // Bytes actually changed
+  J1708HostEEPROM() { memset(data, 0xFF, sizeof(data)); }
+  uint8_t read(int idx) { return idx >= 0 && idx < Size ? data[idx] : 0xFF; }
+  void write(int idx, uint8_t val) { if (idx >= 0 && idx < Size) { data[idx] = val; writes++; } }
+  void update(int idx, uint8_t val) { if (read(idx) != val) write(idx, val); }
+  uint16_t length() { return Size; }
+  template <typename T> T &get(int idx, T &t) { for (size_t i = 0; i < sizeof(T); i++) ((uint8_t *)&t)[i] = read(idx + i); return t; }
+  template <typename T> const T &put(int idx, const T &t) { for (size_t i = 0; i < sizeof(T); i++) update(idx + i, ((const uint8_t *)&t)[i]); return t; }
+};
+
+extern J1708HostConsole Serial;
+extern J1708HostEEPROM EEPROM;
+extern J1708SerialPort Serial1, Serial2, Serial3, Serial4, Serial5, Serial6, Serial7, Serial8;
+
+#endif
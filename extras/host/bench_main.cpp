@@ -0,0 +1,31 @@
+/*
+  bench_main.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Host entry point for examples/benchmark/benchmark.ino.
+    Wires the sketch's ports to the simulated buses and runs setup().
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+void setup();
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  sim.attach(Serial3,0);    // Device under test
+  sim.attach(Serial5,0);    // Traffic generator
+  sim.attach(Serial4,1);    // Forwarding target
+  setup();
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*
+  sim_budget.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Budgeted updates. Gateway ports 3 and 4 are serviced by a J1708Group
+    with a budget of 100 us per port and call, while an ECU on port 5 sends
+    back to back frames. Port 3 prints every frame to a console that takes
+    10 us per character, so a printed frame does not fit in one call.
+    Printing must be deferred, yet every frame must be forwarded, and
+    printed once and in order. At most 1% of the calls may run past the
+    budget, port 3 by no more than one printed frame and port 4 (which
+    sends the forwarded frames) by no more than one character time.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708Full j1708_3;   // Gateway, network side
+J1708Full j1708_4;   // Gateway, host side
+J1708Full ecu;       // ECU on the network side
+J1708Group group;
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  FILE *out = tmpfile();
+  Serial.out = out;
+  Serial.microsPerByte = 10;   // About a 1 Mbit/s console, so a printed frame takes ~300 us
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+  sim.attach(Serial4,1);
+
+  j1708_3.begin(3);
+  j1708_4.begin(4);
+  ecu.begin(5);
+  j1708_3.link(&j1708_4);
+  j1708_3.J1708Settings("j1708config sp3 -s -C 0");
+  j1708_3.J1708Settings("j1708config sp3 -s -T 0");
+  j1708_4.J1708Settings("j1708config sp4 -s -n");
+  ecu.J1708Settings("j1708config sp5 -s -n");
+  group.add(&j1708_3);
+  group.add(&j1708_4);
+  group.BudgetMicros = 100;
+
+  uint32_t sent = 0, deferredCalls = 0;
+  while (millis()<5000){
+    group.J1708GroupUpdate();
+    deferredCalls += j1708_3.N_Deferred>0;
+    ecu.J1708Update();
+    if (ecu.N_TxQ_Total<2){
+      uint8_t msg[8] = {0x80,84,(uint8_t)sent,190,0x10,0x27,(uint8_t)(sent>>8),0};
+      sent += ecu.J1708Send(msg,8,8);
+    }
+  }
+  for (uint32_t t=millis(); millis()-t<100;){
+    group.J1708GroupUpdate();
+    ecu.J1708Update();
+  }
+
+  rewind(out);
+  char line[128];
+  uint32_t printed = 0, outOfOrder = 0;
+  int last = -1;
+  while (fgets(line,sizeof(line),out)){
+    unsigned int len, b[7];
+    if (sscanf(line,"SP3 [%u] %x %x %x %x %x %x %x",&len,&b[0],&b[1],&b[2],&b[3],&b[4],&b[5],&b[6])!=8 || b[0]!=0x80){
+      continue;
+    }
+    int seq = b[2] | b[6]<<8;
+    outOfOrder += seq!=last+1;
+    last = seq;
+    printed++;
+  }
+  fclose(out);
+
+  printf("sim_budget: %u frames sent at %.0f%% busload\n", sent, j1708_3.busload*100.0);
+  printf("  rx / forwarded / printed:   %u / %u / %u (out of order %u)\n", j1708_3.RX_Counter, j1708_3.FWD_Counter, printed, outOfOrder);
+  printf("  calls leaving prints:       %u of %u\n", deferredCalls, j1708_3.BUDGET_Calls);
+  printf("  forced prints:              %u\n", j1708_3.BUDGET_Forced_Prints);
+  printf("  port 3 exceeded / overrun:  %u calls / %u us max\n", j1708_3.BUDGET_Exceeded_Counter, j1708_3.BUDGET_Overrun_Max);
+  printf("  port 4 exceeded / overrun:  %u calls / %u us max (of %u)\n", j1708_4.BUDGET_Exceeded_Counter, j1708_4.BUDGET_Overrun_Max, j1708_4.BUDGET_Calls);
+  printf("  errors (port 3/4):          %u / %u\n", j1708_3.ERR_Counter, j1708_4.ERR_Counter);
+
+  bool ok = sent>0 && j1708_3.FWD_Counter==sent && printed==sent && outOfOrder==0 && deferredCalls>0
+            && j1708_3.N_Deferred==0 && j1708_3.ERR_Counter==0
+            && j1708_3.BUDGET_Exceeded_Counter*100<j1708_3.BUDGET_Calls && j1708_3.BUDGET_Overrun_Max<=40*Serial.microsPerByte
+            && j1708_4.BUDGET_Exceeded_Counter*100<j1708_4.BUDGET_Calls && j1708_4.BUDGET_Overrun_Max<=1042;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+/*
+  sim_capture.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Pre-trigger capture ring on a gateway port.
+    Bus 0: gateway port 3 and an ECU on port 5.
+    The ECU broadcasts numbered frames every 50 ms. Frame 30 comes from an
+    unexpected MID, which fires a MID trigger. The ring is re-armed with a
+    pattern trigger on frame 60. Each dump must hold the trigger frame,
+    the frames before it and exactly CapturePost frames after it.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708Full j1708_3;   // Gateway with the capture ring
+J1708Full ecu;       // ECU on the network side
+
+struct Dump {
+  char trigger[16];
+  uint32_t frames;       // Frame lines in the dump
+  uint32_t before;       // Frames before the trigger frame
+  uint32_t after;        // Frames after the trigger frame
+  bool found;            // Trigger frame present
+  bool ordered;
+};
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  FILE *capture = tmpfile();
+  Serial.out = capture;
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+
+  j1708_3.begin(3);
+  ecu.begin(5);
+  j1708_3.J1708Settings("j1708config sp3 -s -n");
+  j1708_3.J1708Settings("j1708capture sp3 -m 90 1");
+  J1708TimeReset();
+
+  uint32_t sent = 0;
+  elapsedMillis period;
+  while (sent<80){
+    j1708_3.J1708Update();
+    ecu.J1708Update();
+    if (period>=50){
+      period = 0;
+      uint8_t mid = sent==30 ? 0x90 : 0x80;
+      uint8_t msg[9] = {mid,84,(uint8_t)sent,190,0x10,0x27,92,0,0};
+      if (ecu.J1708Send(msg,9,4)){
+        sent++;
+      }
+    }
+    if (sent==45 && j1708_3.CaptureFrozen){
+      j1708_3.J1708Settings("j1708capture sp3 -c");
+      j1708_3.J1708Settings("j1708capture sp3 -p 80.54.3C FF.FF.FF");
+      j1708_3.J1708Settings("j1708capture sp3 -g");
+    }
+  }
+  for (uint32_t t=millis(); millis()-t<100;){
+    j1708_3.J1708Update();
+    ecu.J1708Update();
+  }
+
+  //Check the dumps
+  rewind(capture);
+  char line[128];
+  Dump dumps[4] = {};
+  int n = -1;
+  int trigger[2] = {30,60};
+  int last = -1;
+  while (fgets(line,sizeof(line),capture)){
+    unsigned int t, len, mid, pid, seq;
+    if (strncmp(line,"CAPTURE SP",10)==0){
+      n++;
+      last = -1;
+      if (n<4){
+        dumps[n].ordered = true;
+      }
+    }
+    else if (n>=0 && n<4 && sscanf(line,"Trigger:%15s",dumps[n].trigger)==1){
+    }
+    else if (n>=0 && n<2 && sscanf(line,"(%u) SP3 [%u] %x %x %x",&t,&len,&mid,&pid,&seq)==5){
+      Dump &d = dumps[n];
+      d.frames++;
+      if ((int)seq<=last){
+        d.ordered = false;
+      }
+      last = seq;
+      if ((int)seq<trigger[n]){
+        d.before++;
+      }
+      else if ((int)seq==trigger[n]){
+        d.found = true;
+      }
+      else {
+        d.after++;
+      }
+    }
+  }
+  fclose(capture);
+
+  printf("sim_capture: %u frames sent\n", sent);
+  for (int i=0; i<2; i++){
+    printf("  dump %d: trigger %s, %u frames (%u before, %u after)\n", i+1, dumps[i].trigger, dumps[i].frames, dumps[i].before, dumps[i].after);
+  }
+  printf("  triggers fired:         %u\n", j1708_3.CAPTURE_Counter);
+
+  bool ok = n==1 && j1708_3.CAPTURE_Counter==2;
+  for (int i=0; i<2 && ok; i++){
+    ok = dumps[i].found && dumps[i].ordered && dumps[i].after==j1708_3.CapturePost && dumps[i].before>=20;
+  }
+  ok = ok && strcmp(dumps[0].trigger,"MID")==0 && strcmp(dumps[1].trigger,"PATTERN")==0;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/*
+  sim_config.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Settings persisted in EEPROM across a restart.
+    Ports 3 and 4 are configured with j1708config. After the autosave delay
+    the ports are replaced by new ones, as after a power cycle, and begin()
+    must bring back the block lists and settings. Repeated saves must
+    rotate over the slots without losing the other port's record, and a
+    damaged record must fall back to the previous one.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+void run(J1708 &a, J1708 &b, uint32_t ms){
+  for (uint32_t t=millis(); millis()-t<ms;){
+    a.J1708Update();
+    b.J1708Update();
+  }
+}
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  Serial.out = NULL;
+  sim.attach(Serial3,0);
+  sim.attach(Serial4,1);
+
+  //First boot: defaults, nothing written
+  J1708 *p3 = new J1708;
+  J1708 *p4 = new J1708;
+  p3->begin(3);
+  p4->begin(4);
+  run(*p3,*p4,7000);
+  uint32_t idleWrites = EEPROM.writes;
+
+  p3->J1708Settings("j1708config sp3 -g -a 90");
+  p3->J1708Settings("j1708config sp3 -g -a 91");
+  p3->J1708Settings("j1708config sp3 -g -m 7A");
+  p3->J1708Settings("j1708config sp3 -g -b 0.7");
+  p3->J1708Settings("j1708config sp3 -s -n");
+  p4->J1708Settings("j1708config sp4 -g -a 80");
+  run(*p3,*p4,3000);
+  bool debounced = p3->CONFIG_Save_Counter==0;   //Still inside the save delay
+  run(*p3,*p4,5000);
+  uint32_t saves = p3->CONFIG_Save_Counter + p4->CONFIG_Save_Counter;
+
+  //Restart
+  delete p3;
+  delete p4;
+  p3 = new J1708;
+  p4 = new J1708;
+  p3->begin(3);
+  p4->begin(4);
+  bool restored = p3->ConfigRestored && p4->ConfigRestored
+                  && p3->selfACL.test(0x90) && p3->selfACL.test(0x91) && !p3->selfACL.test(0x80)
+                  && p3->selfMID==0x7A && p3->maxBusload>0.69 && p3->maxBusload<0.71 && !p3->ShowRxData
+                  && p4->selfACL.test(0x80) && !p4->selfACL.test(0x90) && p4->ShowRxData;
+
+  //Wear levelling: port 3 saves repeatedly, port 4's record must survive
+  uint32_t used = 0;
+  for (int i=0; i<20; i++){
+    p3->maxBusload = 0.5+i*0.01;
+    p3->J1708Settings("j1708config sp3 -E -s");
+    used |= 1ul<<p3->ConfigSlot;
+  }
+  int slots = 0;
+  for (int i=0; i<32; i++){
+    slots += (used>>i) & 1;
+  }
+
+  //Damage port 3's newest record. The previous one (maxBusload 0.68) is restored.
+  EEPROM.data[J1708_EEPROM_BASE + p3->ConfigSlot*sizeof(J1708Config) + offsetof(J1708Config,maxBusload)] ^= 0x01;
+  delete p3;
+  delete p4;
+  p3 = new J1708;
+  p4 = new J1708;
+  p3->begin(3);
+  p4->begin(4);
+  bool fallback = p3->ConfigRestored && p3->maxBusload>0.675 && p3->maxBusload<0.685 && p4->selfACL.test(0x80);
+
+  //Erase: the next start uses the defaults
+  p3->J1708Settings("j1708config sp3 -E -c");
+  delete p3;
+  p3 = new J1708;
+  p3->begin(3);
+  bool erased = !p3->ConfigRestored && !p3->selfACL.test(0x90) && p3->selfMID==120;
+
+  printf("sim_config: %d byte records\n", (int)sizeof(J1708Config));
+  printf("  writes while idle:      %u\n", idleWrites);
+  printf("  autosaves:              %u (debounced %s)\n", saves, debounced ? "yes" : "no");
+  printf("  restored after restart: %s\n", restored ? "yes" : "no");
+  printf("  slots used by 20 saves: %d\n", slots);
+  printf("  damaged record:         %s\n", fallback ? "previous record restored" : "not recovered");
+  printf("  erased:                 %s\n", erased ? "yes" : "no");
+
+  bool ok = idleWrites==0 && debounced && saves==2 && restored && slots>=4 && fallback && erased;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+/*
+  sim_dedup.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Change-only forwarding on a two-port gateway.
+    Bus 0 (network side): gateway port 3 and an ECU on port 5.
+    Bus 1 (host side):    gateway port 4.
+    The ECU repeats an unchanged broadcast at 20 Hz and a changing one at
+    10 Hz. The gateway must forward every change, the unchanged frame once
+    per refresh interval, and requests every time.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708Full j1708_3;   // Gateway, network side
+J1708Full j1708_4;   // Gateway, host side
+J1708Full ecu;       // ECU on the network side
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  Serial.out = NULL;
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+  sim.attach(Serial4,1);
+
+  j1708_3.begin(3);
+  j1708_4.begin(4);
+  ecu.begin(5);
+  j1708_3.link(&j1708_4);
+  j1708_3.J1708Settings("j1708config sp3 -g -d 1");
+  j1708_3.J1708Settings("j1708config sp3 -g -D 1000");
+
+  const uint32_t duration = 10000;        // ms of virtual time
+  uint32_t still = 0, changing = 0, requests = 0;
+  elapsedMillis fast, slow, request;
+  while (millis()<duration){
+    j1708_3.J1708Update();
+    j1708_4.J1708Update();
+    ecu.J1708Update();
+    if (fast>=50){
+      fast = 0;
+      uint8_t msg[9] = {0x80,84,60,190,0x10,0x27,92,40,0};
+      still += ecu.J1708Send(msg,9,4) ? 1 : 0;
+    }
+    if (slow>=100){
+      slow = 0;
+      uint8_t msg[6] = {0x82,96,(uint8_t)changing,100,(uint8_t)(changing>>8),0};
+      changing += ecu.J1708Send(msg,6,4) ? 1 : 0;
+    }
+    if (request>=500){
+      request = 0;
+      uint8_t msg[4] = {0x82,128,0x80,0};
+      requests += ecu.J1708Send(msg,4,8) ? 1 : 0;
+    }
+  }
+  for (uint32_t t=millis(); millis()-t<100;){
+    j1708_3.J1708Update();
+    j1708_4.J1708Update();
+    ecu.J1708Update();
+  }
+
+  uint32_t sent = still+changing+requests;
+  uint32_t expected = changing + requests + (duration+999)/1000;
+  J1708SimBus &host = sim.buses[1];
+  printf("sim_dedup: %.1f s virtual\n", duration/1000.0);
+  printf("  ECU frames sent:        %u (unchanged %u, changing %u, requests %u)\n", sent, still, changing, requests);
+  printf("  forwarded / suppressed: %u / %u (expected about %u forwarded)\n", j1708_3.FWD_Counter, j1708_3.DEDUP_Suppressed_Counter, expected);
+  printf("  host bus frames:        %llu\n", (unsigned long long)host.frames);
+  printf("  saved:                  %u bytes, %.1f%% busload\n", j1708_3.DEDUP_Saved_Bytes, j1708_3.DedupSavedLoad*100.0);
+
+  bool ok = j1708_3.FWD_Counter+j1708_3.DEDUP_Suppressed_Counter==sent && host.frames==j1708_3.FWD_Counter
+            && j1708_3.FWD_Counter>=expected-1 && j1708_3.FWD_Counter<=expected+1
+            && j1708_3.DEDUP_Saved_Bytes==9*j1708_3.DEDUP_Suppressed_Counter && j1708_3.DedupSavedLoad>0.15;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+/*
+  sim_echo.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Own-traffic echo matching. Bus 0 (network side): gateway port 3 and an
+    ECU on port 5, both sending. Bus 1 (host side): gateway port 4 and a
+    monitor on port 6. Port 3 forwards to port 4 and does not print its own
+    echoes. Every frame port 3 sends must be matched as its own echo, none of
+    them forwarded or printed, while every ECU frame is forwarded. Then the
+    gateway's loop stalls for 150 ms right after each of its transmits, so
+    the echo waits in the receive buffer well past the 50 ms echo timeout.
+    It must still be matched, not lost and forwarded.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708 j1708_3;   // Gateway, network side
+J1708 j1708_4;   // Gateway, host side
+J1708 ecu;       // ECU on the network side
+J1708 monitor;   // Host-side tool
+
+void update(){
+  j1708_3.J1708Update();
+  j1708_4.J1708Update();
+  ecu.J1708Update();
+  monitor.J1708Update();
+}
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  FILE *out = tmpfile();
+  Serial.out = out;
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+  sim.attach(Serial4,1);
+  sim.attach(Serial6,1);
+
+  j1708_3.begin(3);
+  j1708_4.begin(4);
+  ecu.begin(5);
+  monitor.begin(6);
+  j1708_3.link(&j1708_4);
+  j1708_3.J1708Settings("j1708config sp3 -s -C 0");
+  j1708_3.J1708Settings("j1708config sp3 -s -T 0");
+  j1708_3.J1708Settings("j1708config sp3 -s -o 0");
+  j1708_4.J1708Settings("j1708config sp4 -s -n");
+  ecu.J1708Settings("j1708config sp5 -s -n");
+  monitor.J1708Settings("j1708config sp6 -s -C 0");
+  monitor.J1708Settings("j1708config sp6 -s -T 0");
+  monitor.selfMode = J1708::Observer;
+
+  //Both ends send at the same pace, so frames of the ECU often land between a send and its echo
+  uint32_t sentOwn = 0, sentECU = 0;
+  elapsedMillis period;
+  while (millis()<5000){
+    update();
+    if (period>=20){
+      period = 0;
+      uint8_t own[5] = {0xAC,84,(uint8_t)sentOwn,0x55,0};
+      sentOwn += j1708_3.J1708Send(own,5,8);
+      uint8_t msg[5] = {0x80,84,(uint8_t)sentECU,0x27,0};
+      sentECU += ecu.J1708Send(msg,5,8);
+    }
+  }
+  for (uint32_t t=millis(); millis()-t<100;){
+    update();
+  }
+
+  //Loop stalls between a transmit and its echo
+  uint32_t stalled = 0;
+  for (int i=0; i<10; i++){
+    //Buffered bytes are split by their J1587 layout, so this frame must follow it
+    uint8_t own[4] = {0xAC,85,(uint8_t)sentOwn,0};
+    uint32_t tx = j1708_3.TX_Counter;
+    sentOwn += j1708_3.J1708Send(own,4,8);
+    while (j1708_3.TX_Counter==tx && millis()<10000){
+      update();
+    }
+    for (uint32_t t=millis(); millis()-t<150;){
+      //Only the other nodes keep running
+      j1708_4.J1708Update();
+      ecu.J1708Update();
+      monitor.J1708Update();
+    }
+    stalled++;
+    for (uint32_t t=millis(); millis()-t<50;){
+      update();
+    }
+  }
+
+  rewind(out);
+  char line[128];
+  uint32_t printedOwn = 0, printedECU = 0, forwardedOwn = 0, forwardedECU = 0;
+  while (fgets(line,sizeof(line),out)){
+    unsigned int port, len, mid;
+    if (sscanf(line,"SP%u [%u] %x",&port,&len,&mid)!=3){
+      continue;
+    }
+    if (port==3){
+      printedOwn += mid==0xAC;
+      printedECU += mid==0x80;
+    }
+    else if (port==6){
+      forwardedOwn += mid==0xAC;
+      forwardedECU += mid==0x80;
+    }
+  }
+  fclose(out);
+
+  printf("sim_echo: %u own and %u ECU frames sent\n", sentOwn, sentECU);
+  printf("  tx / echoes matched / lost: %u / %u / %u\n", j1708_3.TX_Counter, j1708_3.OWN_Counter, j1708_3.OWN_Lost_Counter);
+  printf("  printed own / ECU:          %u / %u\n", printedOwn, printedECU);
+  printf("  forwarded own / ECU:        %u / %u (FWD %u)\n", forwardedOwn, forwardedECU, j1708_3.FWD_Counter);
+  printf("  collisions:                 %u\n", j1708_3.ERR4_Counter+ecu.ERR4_Counter);
+  printf("  stalls before an echo:      %u\n", stalled);
+
+  //A frame that lost arbitration is dropped from the queue and never echoed
+  bool ok = sentOwn>0 && stalled==10 && j1708_3.OWN_Counter+j1708_3.ERR4_Counter==sentOwn && j1708_3.OWN_Lost_Counter==0
+            && printedOwn==0 && printedECU==sentECU && forwardedOwn==0 && forwardedECU==sentECU
+            && j1708_3.FWD_Counter==sentECU;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
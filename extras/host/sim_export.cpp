@@ -0,0 +1,142 @@
+/*
+  sim_export.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Statistics export. An ECU on port 5 sends to a monitor on port 3, with
+    every fifth frame corrupted. Port 3 exports JSON every 500 ms and port 5
+    binary STATS packets every 250 ms, into the same console stream. Every
+    record must parse, come from the right port in its own format, be
+    consistent and grow monotonically, and be written with a single call.
+    A record requested at the end must match the live counters.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708 monitor;
+J1708 ecu;
+
+uint32_t le(const uint8_t *p, int bytes){
+  uint32_t value = 0;
+  for (int i=bytes-1; i>=0; i--){
+    value = (value<<8) | p[i];
+  }
+  return value;
+}
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  FILE *out = tmpfile();
+  Serial.out = out;
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+  monitor.begin(3);
+  ecu.begin(5);
+  monitor.J1708Settings("j1708config sp3 -s -n");
+  ecu.J1708Settings("j1708config sp5 -s -n");
+  monitor.J1708Settings("j1708config sp3 -s -x j 500");
+  ecu.J1708Settings("j1708config sp5 -s -x b 250");
+
+  uint32_t sent = 0, bad = 0, calls = 0, exports = 0;
+  elapsedMillis period;
+  while (millis()<3000){
+    uint32_t before = Serial.writes;
+    uint32_t records = monitor.EXPORT_Counter+ecu.EXPORT_Counter;
+    monitor.J1708Update();
+    ecu.J1708Update();
+    if (monitor.EXPORT_Counter+ecu.EXPORT_Counter!=records){
+      exports += monitor.EXPORT_Counter+ecu.EXPORT_Counter-records;
+      calls += Serial.writes-before;
+    }
+    if (period>=10){
+      period = 0;
+      bool corrupt = sent%5==4;
+      uint8_t msg[5] = {0x80,84,(uint8_t)sent,0x27,0};
+      if (corrupt){
+        msg[4] = 1-(msg[0]+msg[1]+msg[2]+msg[3]);
+      }
+      if (ecu.J1708Send(msg,corrupt ? 5 : 4,8,!corrupt)){
+        sent++;
+        bad += corrupt;
+      }
+    }
+  }
+  for (uint32_t t=millis(); millis()-t<100;){
+    monitor.J1708Update();
+    ecu.J1708Update();
+  }
+  monitor.ExportFormat = J1708::ExportOff;
+  ecu.ExportFormat = J1708::ExportOff;
+  monitor.J1708Settings("j1708config sp3 -s -x j");
+  ecu.J1708Settings("j1708config sp5 -s -x b");
+
+  //Text and binary records share the stream
+  long size = ftell(out);
+  rewind(out);
+  uint8_t *buf = (uint8_t *)malloc(size);
+  size = fread(buf,1,size,out);
+  fclose(out);
+  uint32_t json = 0, binary = 0, broken = 0, lastRx = 0, lastTx = 0, lastJsonErr = 0;
+  for (long i=0; i<size;){
+    if (buf[i]==0xA5 && i+4<size && buf[i+1]==J1708Host::STATS){
+      uint8_t len = buf[i+3];
+      uint8_t sum = 0;
+      for (int k=1; k<len+5 && i+k<size; k++){
+        sum += buf[i+k];
+      }
+      const uint8_t *p = buf+i+4;
+      uint32_t tx = le(p+2+16,4);
+      if (sum!=0 || len!=183 || p[0]!=1 || p[1]!=5 || tx<lastTx){
+        broken++;
+      }
+      lastTx = tx;
+      binary++;
+      i += len+5;
+    }
+    else if (buf[i]=='{'){
+      const char *line = (const char *)buf+i;
+      unsigned int v, sp;
+      unsigned long seq, t, ms, rx, tx, fwd, own, lost, err, e[11];
+      int fields = sscanf(line,"{\"v\":%u,\"sp\":%u,\"seq\":%lu,\"t\":%lu,\"ms\":%lu,\"rx\":%lu,\"tx\":%lu,\"fwd\":%lu,\"own\":%lu,\"lost\":%lu,\"err\":%lu,\"errs\":[%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu]",
+                          &v,&sp,&seq,&t,&ms,&rx,&tx,&fwd,&own,&lost,&err,e,e+1,e+2,e+3,e+4,e+5,e+6,e+7,e+8,e+9,e+10);
+      unsigned long sum = 0;
+      for (int k=0; k<11; k++){
+        sum += e[k];
+      }
+      const char *end = (const char *)memchr(line,'\n',size-i);
+      if (fields!=22 || v!=1 || sp!=3 || sum!=err || rx<lastRx || end==NULL || end[-1]!='}'){
+        broken++;
+      }
+      lastRx = rx;
+      lastJsonErr = e[0];
+      json++;
+      i = end ? end-(const char *)buf+1 : size;
+    }
+    else {
+      i++;
+    }
+  }
+  free(buf);
+
+  printf("sim_export: %u frames sent, %u corrupted\n", sent, bad);
+  printf("  JSON / binary records:     %u / %u (broken %u)\n", json, binary, broken);
+  printf("  write calls per record:    %u / %u\n", calls, exports);
+  printf("  last rx / ERR1 (JSON):     %u / %u of %u / %u\n", lastRx, lastJsonErr, monitor.RX_Counter, monitor.ERR1_Counter);
+  printf("  last tx (binary):          %u of %u\n", lastTx, ecu.TX_Counter);
+
+  bool ok = broken==0 && json>=6 && binary>=12 && exports>0 && calls==exports
+            && lastRx==monitor.RX_Counter && lastRx==sent && lastJsonErr==bad && lastTx==ecu.TX_Counter;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,113 @@
+/*
+  sim_filter.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Display filters on a busy bus.
+    Bus 0: gateway port 3 and an ECU on port 5.
+    The ECU cycles through frames from four MIDs with different PIDs and
+    lengths. Each filter rule is set in turn and the printed lines must be
+    exactly the frames the rule selects.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708 j1708_3;   // Port under test
+J1708 ecu;       // Traffic source
+
+//Frames sent in turn, checksum slot last
+uint8_t frames[4][10] = {
+  {0x80,84,40,190,0x10,0x27,0},                 // MID 80, PIDs 84 and 190, length 7
+  {0x82,96,50,0},                               // MID 82, PID 96, length 4
+  {0x88,200,3,1,2,3,84,40,0},                   // MID 88, PIDs 200 (3 bytes) and 84, length 9
+  {0x80,255,10,20,0},                           // MID 80, page 2 PID 10, length 5
+};
+const uint8_t lengths[4] = {7,4,9,5};
+
+uint32_t runCase(const char *rule, FILE *out){
+  //Returns a bitmask of the frame kinds printed, 0xFF on a mismatch within a kind
+  j1708_3.J1708Settings("j1708config sp3 -s -F");
+  if (rule){
+    j1708_3.J1708Settings(rule);
+  }
+  fflush(out);
+  long start = ftell(out);
+  for (int n=0; n<40; n++){
+    ecu.J1708Send(frames[n%4],lengths[n%4],8);
+    for (uint32_t t=millis(); millis()-t<20;){
+      j1708_3.J1708Update();
+      ecu.J1708Update();
+    }
+  }
+  fflush(out);
+  fseek(out,start,SEEK_SET);
+  uint32_t counts[4] = {};
+  char line[128];
+  while (fgets(line,sizeof(line),out)){
+    unsigned int t, len, mid, b1;
+    if (sscanf(line,"(%u) SP3 [%u] %x %x",&t,&len,&mid,&b1)!=4){
+      continue;
+    }
+    for (int k=0; k<4; k++){
+      if (len==lengths[k] && mid==frames[k][0] && b1==frames[k][1]){
+        counts[k]++;
+      }
+    }
+  }
+  fseek(out,0,SEEK_END);
+  uint32_t mask = 0;
+  for (int k=0; k<4; k++){
+    if (counts[k]==10){
+      mask |= 1<<k;
+    }
+    else if (counts[k]!=0){
+      return 0xFF;
+    }
+  }
+  return mask;
+}
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  FILE *out = tmpfile();
+  Serial.out = out;
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+  j1708_3.begin(3);
+  ecu.begin(5);
+  ecu.J1708Settings("j1708config sp5 -s -n");
+  j1708_3.J1708Settings("j1708config sp3 -s -C 0");
+
+  struct {const char *rule; uint32_t expected;} cases[] = {
+    {NULL,                                   0x0F},
+    {"j1708config sp3 -s -M 80 1",           0x09},
+    {"j1708config sp3 -s -P 54 1",           0x05},   // PID 84 as the first and as a later PID
+    {"j1708config sp3 -s -P FF 1",           0x08},
+    {"j1708config sp3 -s -L 4 5",            0x0A},
+    {"j1708config sp3 -s -D 88.C8.03 FF.FF.FF", 0x04},
+    {"j1708config sp3 -s -D 80.00.28 FF.00.FF",  0x01},
+  };
+  printf("sim_filter: rule, frame kinds printed (bit n - frames[n])\n");
+  bool ok = true;
+  for (unsigned int i=0; i<sizeof(cases)/sizeof(cases[0]); i++){
+    uint32_t got = runCase(cases[i].rule,out);
+    printf("  %-40s printed %02X expected %02X\n", cases[i].rule ? cases[i].rule : "(no filter)", got, cases[i].expected);
+    ok = ok && got==cases[i].expected;
+  }
+  fclose(out);
+  printf("  frames rejected:        %u\n", j1708_3.FILTER_Rejected_Counter);
+  ok = ok && j1708_3.RX_Counter==280;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
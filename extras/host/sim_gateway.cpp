@@ -0,0 +1,81 @@
+/*
+  sim_gateway.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Simulated two-port gateway, the same setup as simplePass.ino.
+    Bus 0 (network side): gateway port 3 and an ECU on port 5.
+    Bus 1 (host side):    gateway port 4.
+    The ECU broadcasts one frame every 100 ms. The scenario runs for
+    a fixed amount of virtual time and checks that the gateway forwarded
+    every frame onto the host-side bus.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+#include <time.h>
+
+J1708 j1708_3;   // Gateway, network side
+J1708 j1708_4;   // Gateway, host side
+J1708 ecu;       // Engine ECU on the network side
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  Serial.out = NULL;                      // Silence the frame printout
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+  sim.attach(Serial4,1);
+
+  j1708_3.begin(3);
+  j1708_4.begin(4);
+  ecu.begin(5);
+  j1708_3.link(&j1708_4);
+  j1708_4.link(&j1708_3);
+
+  const uint32_t duration = 60000;        // ms of virtual time
+  uint32_t sent = 0;
+  elapsedMillis period;
+  clock_t start = clock();
+  while (millis()<duration){
+    j1708_3.J1708Update();
+    j1708_4.J1708Update();
+    ecu.J1708Update();
+    if (period>=100){
+      period = 0;
+      uint8_t msg[9] = {0x80,84,(uint8_t)sent,190,0x10,0x27,92,(uint8_t)(sent>>8),0};
+      if (ecu.J1708Send(msg,9,4)){
+        sent++;
+      }
+    }
+  }
+  //Let the last frames drain
+  for (uint32_t t=millis(); millis()-t<100;){
+    j1708_3.J1708Update();
+    j1708_4.J1708Update();
+    ecu.J1708Update();
+  }
+  double wall = (double)(clock()-start)/CLOCKS_PER_SEC;
+
+  J1708SimBus &network = sim.buses[0];
+  J1708SimBus &host = sim.buses[1];
+  printf("sim_gateway: %.1f s virtual in %.2f s wall (%.0fx)\n", duration/1000.0, wall, wall>0 ? duration/1000.0/wall : 0.0);
+  printf("  ECU frames sent:        %u\n", sent);
+  printf("  gateway rx / forwarded: %u / %u\n", j1708_3.RX_Counter, j1708_3.FWD_Counter);
+  printf("  network bus frames:     %llu (collisions %llu)\n", (unsigned long long)network.frames, (unsigned long long)network.collisions);
+  printf("  host bus frames:        %llu (collisions %llu)\n", (unsigned long long)host.frames, (unsigned long long)host.collisions);
+  printf("  errors (port 3/4):      %u / %u\n", j1708_3.ERR_Counter, j1708_4.ERR_Counter);
+
+  bool ok = sent>0 && j1708_3.FWD_Counter==sent && host.frames==sent && j1708_3.ERR_Counter==0;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
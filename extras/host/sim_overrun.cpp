@@ -0,0 +1,83 @@
+/*
+  sim_overrun.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Receive overruns during loop stalls. An ECU on port 5 sends back to back
+    frames on the bus shared by port 3 (64 byte receive buffer, RxBytes 0)
+    and port 4 (default, 256 bytes). Every 500 ms neither port is updated
+    for 150 ms, about 144 bytes of traffic. Frames buffered during a stall
+    have lost their idle gaps and must be split by their J1587 layout. Port 3
+    must count an overrun (ERR11) per stall and drop the damaged frames
+    without ERR1 or ERR2. Port 4 must receive every frame, without errors,
+    and report a maximum fill above 64 bytes.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708Port<32,256,StatsPerMID,FeatureAll,0> j1708_3;   // Serial core buffer only
+J1708 j1708_4;                                        // Default buffer
+J1708 ecu;
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  Serial.out = NULL;
+  sim.attach(Serial3,0);
+  sim.attach(Serial4,0);
+  sim.attach(Serial5,0);
+
+  j1708_3.begin(3);
+  j1708_4.begin(4);
+  ecu.begin(5);
+  j1708_3.selfMode = J1708::Observer;
+  j1708_4.selfMode = J1708::Observer;
+
+  uint32_t sent = 0, stalls = 0;
+  elapsedMillis cycle;
+  while (millis()<5000){
+    ecu.J1708Update();
+    if (cycle<150){
+      //Loop stalled in other work. Only the ECU keeps running.
+      if (ecu.N_TxQ_Total<4){
+        uint8_t msg[9] = {0x80,84,(uint8_t)sent,190,0x10,0x27,92,0x40,0};
+        sent += ecu.J1708Send(msg,9,8);
+      }
+      continue;
+    }
+    if (cycle>=500){
+      cycle = 0;
+      stalls++;
+    }
+    j1708_3.J1708Update();
+    j1708_4.J1708Update();
+  }
+  for (uint32_t t=millis(); millis()-t<100;){
+    j1708_3.J1708Update();
+    j1708_4.J1708Update();
+  }
+
+  printf("sim_overrun: %u frames sent, %u stalls of 150 ms\n", sent, stalls);
+  printf("                          64 B / 256 B buffer\n");
+  printf("  received frames:        %u / %u\n", j1708_3.RX_Counter, j1708_4.RX_Counter);
+  printf("  max fill:               %u / %u\n", j1708_3.RxFillMax, j1708_4.RxFillMax);
+  printf("  backlog splits:         %u / %u\n", j1708_3.RX_Split_Counter, j1708_4.RX_Split_Counter);
+  printf("  ERR11 / ERR1 / ERR2:    %u/%u/%u / %u/%u/%u\n", j1708_3.ERR11_Counter, j1708_3.ERR1_Counter, j1708_3.ERR2_Counter,
+         j1708_4.ERR11_Counter, j1708_4.ERR1_Counter, j1708_4.ERR2_Counter);
+
+  bool ok = sent>0 && stalls>=9 && j1708_3.ERR11_Counter>=stalls && j1708_3.ERR1_Counter==0 && j1708_3.ERR2_Counter==0
+            && j1708_3.RX_Counter>sent/2 && j1708_4.RX_Counter==sent && j1708_4.ERR_Counter==0 && j1708_4.RX_Split_Counter>0
+            && j1708_4.RxFillMax>64 && j1708_4.RxFillMax<j1708_4.RxCapacity;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+/*
+  sim_rewrite.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    MID translation and byte patches on the forwarding path.
+    Bus 0 (network side): gateway port 3 and an ECU on port 5.
+    Bus 1 (host side):    gateway port 4 and a monitor on port 6.
+    Port 3 forwards MID 0x80 as 0xA0 and overwrites the low byte of PID 190
+    (engine speed). The monitor must see every frame rewritten, with a valid
+    checksum, while untouched MIDs pass unchanged.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708Full j1708_3;   // Gateway, network side
+J1708Full j1708_4;   // Gateway, host side
+J1708Full ecu;       // ECU on the network side
+J1708Full monitor;   // Host-side tool
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  FILE *out = tmpfile();
+  Serial.out = out;
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+  sim.attach(Serial4,1);
+  sim.attach(Serial6,1);
+
+  j1708_3.begin(3);
+  j1708_4.begin(4);
+  ecu.begin(5);
+  monitor.begin(6);
+  j1708_3.link(&j1708_4);
+  j1708_3.J1708Settings("j1708config sp3 -s -n");
+  j1708_4.J1708Settings("j1708config sp4 -s -n");
+  ecu.J1708Settings("j1708config sp5 -s -n");
+  monitor.J1708Settings("j1708config sp6 -s -C 0");
+  monitor.J1708Settings("j1708config sp6 -s -T 0");
+  monitor.selfMode = J1708::Observer;
+  j1708_3.J1708Settings("j1708config sp3 -g -t 80 A0");
+  j1708_3.J1708Settings("j1708config sp3 -g -w 80 BE 55.00 FF.00");
+
+  uint32_t sent = 0;
+  elapsedMillis period;
+  while (millis()<5000){
+    j1708_3.J1708Update();
+    j1708_4.J1708Update();
+    ecu.J1708Update();
+    monitor.J1708Update();
+    if (period>=50){
+      period = 0;
+      //MID 80: PID 84, PID 190 (2 bytes). MID 88: the same PIDs, not rewritten.
+      uint8_t mid = sent%2 ? 0x88 : 0x80;
+      uint8_t msg[7] = {mid,84,(uint8_t)sent,190,(uint8_t)(sent*7),0x27,0};
+      if (ecu.J1708Send(msg,7,4)){
+        sent++;
+      }
+    }
+  }
+  for (uint32_t t=millis(); millis()-t<100;){
+    j1708_3.J1708Update();
+    j1708_4.J1708Update();
+    ecu.J1708Update();
+    monitor.J1708Update();
+  }
+
+  rewind(out);
+  char line[128];
+  uint32_t translated = 0, untouched = 0, wrong = 0;
+  while (fgets(line,sizeof(line),out)){
+    unsigned int len, b[6];
+    if (sscanf(line,"SP6 [%u] %x %x %x %x %x %x",&len,&b[0],&b[1],&b[2],&b[3],&b[4],&b[5])!=7 || len!=7){
+      continue;
+    }
+    if (b[0]==0xA0 && b[3]==190 && b[4]==0x55 && b[5]==0x27){
+      translated++;
+    }
+    else if (b[0]==0x88 && b[3]==190 && b[4]==((b[2]*7)&0xFF)){
+      untouched++;
+    }
+    else {
+      wrong++;
+    }
+  }
+  fclose(out);
+
+  printf("sim_rewrite: %u frames sent\n", sent);
+  printf("  rewritten / untouched:  %u / %u (wrong %u)\n", translated, untouched, wrong);
+  printf("  monitor rx / ERR1:      %u / %u\n", monitor.RX_Counter, monitor.ERR1_Counter);
+  printf("  rewrite counter:        %u\n", j1708_3.REWRITE_Counter);
+
+  bool ok = sent>0 && translated==(sent+1)/2 && untouched==sent/2 && wrong==0 && monitor.ERR1_Counter==0
+            && j1708_3.REWRITE_Counter==translated;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,130 @@
+/*
+  sim_sampling.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Adaptive sampled logging.
+    Bus 0: logging port 3 and a traffic generator on port 5.
+    The generator holds the bus above the sampling threshold for 20 s, then
+    stops, and a single ECU keeps sending one frame every 100 ms. While
+    loaded, port 3 must print at most one frame per MID per interval, and
+    full output must come back once the load drops. Every received frame
+    must be either printed or counted in a "+N" or "OFF" summary.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708Full j1708_3;   // Logging port
+J1708Full gen;       // Traffic generator
+J1708Group group;
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  FILE *out = tmpfile();
+  Serial.out = out;
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+
+  j1708_3.begin(3);
+  gen.begin(5);
+  group.add(&j1708_3);
+  group.add(&gen);
+  gen.J1708Settings("j1708config sp5 -s -n");
+  gen.J1708Settings("j1708config sp5 -s -S 0");
+  j1708_3.J1708Settings("j1708config sp3 -s -C 0");
+  j1708_3.J1708Settings("j1708config sp3 -s -B 0.5");
+  j1708_3.J1708Settings("j1708config sp3 -s -I 500");
+  gen.J1708Settings("j1708gen sp5 -d");
+  gen.J1708Settings("j1708gen sp5 -l 0.7");
+  gen.J1708Settings("j1708gen sp5 -g");
+
+  const uint32_t loaded = 20000;          // ms of high busload
+  const uint32_t duration = 30000;
+  uint32_t sent = 0;
+  long quietStart = -1;
+  elapsedMillis period;
+  while (millis()<duration){
+    group.J1708GroupUpdate();
+    if (millis()>=loaded && gen.GenOn){
+      gen.J1708Settings("j1708gen sp5 -x");
+    }
+    if (millis()>=loaded && period>=100 && gen.N_TxQ_Total==0){
+      period = 0;
+      if (quietStart<0){
+        fflush(out);
+        quietStart = ftell(out);
+      }
+      uint8_t msg[6] = {0x8C,84,(uint8_t)sent,92,(uint8_t)(sent>>8),0};
+      if (gen.J1708Send(msg,6,4)){
+        sent++;
+      }
+    }
+  }
+  for (uint32_t t=millis(); millis()-t<100;){
+    group.J1708GroupUpdate();
+  }
+
+  //Account for every received frame
+  fflush(out);
+  rewind(out);
+  char line[256];
+  uint32_t lines = 0, summarized = 0, on = 0, off = 0, quietLines = 0, maxPerMID = 0;
+  uint32_t perMID[256] = {};
+  uint32_t window = 0;                    // Start of the current 1 s window
+  while (fgets(line,sizeof(line),out)){
+    unsigned int t, len, mid;
+    if (strncmp(line,"SAMPLING SP3 ON",15)==0){
+      on++;
+    }
+    else if (strncmp(line,"SAMPLING SP3 OFF",16)==0){
+      off++;
+      for (char *p=strchr(line,':'); p && (p=strchr(p,'+')); p++){
+        summarized += atoi(p+1);
+      }
+    }
+    else if (sscanf(line,"(%u) SP3 [%u] %x",&t,&len,&mid)==3){
+      lines++;
+      char *plus = strstr(line,"+");
+      if (plus){
+        summarized += atoi(plus+1);
+      }
+      if (ftell(out)>quietStart && quietStart>=0){
+        quietLines++;
+      }
+      else if (on>off){
+        //Sampled: at most two frames per MID in any 1 s window (500 ms interval)
+        if (t-window>=1000000){
+          window = t;
+          memset(perMID,0,sizeof(perMID));
+        }
+        if (++perMID[mid]>maxPerMID){
+          maxPerMID = perMID[mid];
+        }
+      }
+    }
+  }
+  fclose(out);
+
+  printf("sim_sampling: %.1f s virtual, %.1f s loaded\n", duration/1000.0, loaded/1000.0);
+  printf("  frames received:        %u\n", j1708_3.RX_Counter);
+  printf("  lines printed:          %u (+%u summarized)\n", lines, summarized);
+  printf("  sampling on / off:      %u / %u\n", on, off);
+  printf("  most lines per MID/s:   %u\n", maxPerMID);
+  printf("  quiet frames printed:   %u of %u\n", quietLines, sent);
+
+  bool ok = on==1 && off==1 && lines+summarized==j1708_3.RX_Counter && lines<j1708_3.RX_Counter/4
+            && maxPerMID<=3 && sent>0 && quietLines>=sent-30;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
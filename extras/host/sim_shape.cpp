@@ -0,0 +1,154 @@
+/*
+  sim_shape.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Per-MID transmit shaping. Two identical senders each carry two
+    applications: MID 0x80 queues a burst of 6 frames every 500 ms, MID 0x88
+    one frame every 100 ms. Bus 0: port 3 with MID 0x80 limited to 100
+    characters/s, monitored by port 5. Bus 1: port 4 without shaping,
+    monitored by port 6. MID 0x80 must be paced to its budget on bus 0 while
+    MID 0x88 waits at most half as long as behind the unshaped bursts.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708Full j1708_3;   // Shaped sender
+J1708Full j1708_4;   // Unshaped sender
+J1708Full monitor_5; // Tool on bus 0
+J1708Full monitor_6; // Tool on bus 1
+
+void update(){
+  j1708_3.J1708Update();
+  j1708_4.J1708Update();
+  monitor_5.J1708Update();
+  monitor_6.J1708Update();
+}
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  FILE *out = tmpfile();
+  Serial.out = out;
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+  sim.attach(Serial4,1);
+  sim.attach(Serial6,1);
+
+  J1708Full *senders[2] = {&j1708_3, &j1708_4};
+  j1708_3.begin(3);
+  j1708_4.begin(4);
+  monitor_5.begin(5);
+  monitor_6.begin(6);
+  j1708_3.J1708Settings("j1708config sp3 -s -n");
+  j1708_4.J1708Settings("j1708config sp4 -s -n");
+  monitor_5.J1708Settings("j1708config sp5 -s -C 0");
+  monitor_6.J1708Settings("j1708config sp6 -s -C 0");
+  monitor_5.selfMode = J1708::Observer;
+  monitor_6.selfMode = J1708::Observer;
+  j1708_3.J1708Settings("j1708shape sp3 -m 80 100 8");
+
+  const int Critical = 50;
+  uint32_t queuedAt[Critical] = {};
+  uint32_t chatty = 0, critical = 0, dropped = 0;
+  elapsedMillis burst, period;
+  burst = 500;
+  while (millis()<5000){
+    update();
+    if (burst>=500){
+      burst = 0;
+      for (int i=0; i<6; i++){
+        uint8_t msg[7] = {0x80,84,(uint8_t)chatty,190,0x00,0x27,0};
+        chatty++;
+        for (J1708Full *sender : senders){
+          dropped += !sender->J1708Send(msg,7,8);
+        }
+      }
+    }
+    if (period>=100 && critical<Critical){
+      period = 0;
+      uint8_t msg[4] = {0x88,91,(uint8_t)critical,0};
+      queuedAt[critical] = micros();
+      for (J1708Full *sender : senders){
+        dropped += !sender->J1708Send(msg,4,8);
+      }
+      critical++;
+    }
+  }
+  for (uint32_t t=millis(); millis()-t<1000;){
+    update();
+  }
+
+  //Index 0: shaped bus (SP5), 1: unshaped bus (SP6)
+  rewind(out);
+  char line[128];
+  uint32_t chattySeen[2] = {}, criticalSeen[2] = {}, maxLatency[2] = {};
+  uint32_t window[2] = {}, inWindow[2] = {}, maxInWindow[2] = {};
+  while (fgets(line,sizeof(line),out)){
+    unsigned int port, len, b[3];
+    unsigned long time;
+    if (sscanf(line,"(%lu) SP%u [%u] %x %x %x",&time,&port,&len,&b[0],&b[1],&b[2])!=6 || (port!=5 && port!=6)){
+      continue;
+    }
+    int bus = port==5 ? 0 : 1;
+    if (b[0]==0x88 && b[2]<Critical){
+      criticalSeen[bus]++;
+      uint32_t latency = time-queuedAt[b[2]];
+      maxLatency[bus] = latency>maxLatency[bus] ? latency : maxLatency[bus];
+    }
+    else if (b[0]==0x80){
+      chattySeen[bus]++;
+      //Characters of MID 0x80 in each 100 ms window
+      if (time/100000!=window[bus]){
+        window[bus] = time/100000;
+        inWindow[bus] = 0;
+      }
+      inWindow[bus] += len;
+      maxInWindow[bus] = inWindow[bus]>maxInWindow[bus] ? inWindow[bus] : maxInWindow[bus];
+    }
+  }
+  fclose(out);
+  Serial.out = NULL;
+  uint32_t held = j1708_3.SHAPE_Held_Counter;
+
+  //A bucket left in deficit for longer than its 16-bit clock wraps must come back full
+  for (int i=0; i<4; i++){
+    uint8_t msg[7] = {0x80,84,(uint8_t)i,190,0x00,0x27,0};
+    j1708_3.J1708Send(msg,7,8);
+  }
+  while (j1708_3.SHAPE_Held_Counter==held){
+    update();
+  }
+  sim.advance(65536000+5000);
+  uint32_t before = j1708_3.TX_Counter;
+  for (uint32_t t=millis(); millis()-t<20;){
+    update();
+  }
+  uint32_t afterIdle = j1708_3.TX_Counter-before;
+
+  printf("sim_shape: %u chatty and %u critical frames queued per port (dropped %u)\n", chatty, critical, dropped);
+  printf("                          shaped / unshaped\n");
+  printf("  seen chatty:            %u / %u\n", chattySeen[0], chattySeen[1]);
+  printf("  seen critical:          %u / %u\n", criticalSeen[0], criticalSeen[1]);
+  printf("  chatty chars per 100ms: %u / %u (budget 100, burst 8)\n", maxInWindow[0], maxInWindow[1]);
+  printf("  critical max latency:   %u / %u us\n", maxLatency[0], maxLatency[1]);
+  printf("  held / bypassed:        %u / %u\n", held, j1708_3.SHAPE_Bypass_Counter);
+  printf("  sent 20ms after a 65s idle: %u\n", afterIdle);
+
+  bool ok = dropped==0 && chattySeen[0]==chatty && chattySeen[1]==chatty && criticalSeen[0]==critical && criticalSeen[1]==critical
+            //10 characters per 100 ms plus a burst of 8, in whole 7-character frames
+            && maxInWindow[0]<=21 && maxLatency[0]*2<maxLatency[1]
+            && held>0 && j1708_3.SHAPE_Bypass_Counter>0 && afterIdle>0 && j1708_4.SHAPE_Held_Counter==0;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
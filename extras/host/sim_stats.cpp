@@ -0,0 +1,121 @@
+/*
+  sim_stats.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Statistics snapshots read from another thread. An ECU on port 5 sends a
+    mix of good frames and frames with a bad checksum to a monitor on port 3.
+    While the main thread runs J1708Update, a second thread takes snapshots
+    as fast as it can. Every snapshot must be consistent: the error total
+    equals the sum of the ERRn counts, and nothing runs backwards between
+    two snapshots. The last snapshot must match the live counters, and a
+    transmit alone must be published well before the periodic refresh.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+#include <atomic>
+#include <thread>
+
+J1708Full monitor;
+J1708Full ecu;
+
+std::atomic<bool> done(false);
+uint32_t reads = 0, misses = 0, torn = 0, published = 0;
+
+void reader(){
+  J1708Stats last = {};
+  while (!done){
+    J1708Stats stats;
+    if (!monitor.snapshot(stats)){
+      misses++;
+      continue;
+    }
+    reads++;
+    uint32_t sum = 0;
+    for (int n=1; n<=11; n++){
+      sum += stats.err[n];
+    }
+    if (sum!=stats.errors || stats.sequence<last.sequence || stats.rx<last.rx
+        || stats.errors<last.errors || stats.uptime<last.uptime || stats.time<last.time){
+      torn++;
+    }
+    published = stats.sequence;
+    last = stats;
+  }
+}
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  Serial.out = NULL;
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+  monitor.begin(3);
+  ecu.begin(5);
+  ecu.J1708Settings("j1708config sp5 -s -n");
+
+  std::thread thread(reader);
+  uint32_t sent = 0, bad = 0;
+  elapsedMillis period;
+  while (millis()<3000){
+    monitor.J1708Update();
+    ecu.J1708Update();
+    if (period>=10){
+      period = 0;
+      //Every fourth frame carries a wrong checksum
+      bool corrupt = sent%4==3;
+      uint8_t msg[5] = {0x80,84,(uint8_t)sent,0x27,0};
+      if (corrupt){
+        msg[4] = 1-(msg[0]+msg[1]+msg[2]+msg[3]);
+      }
+      if (ecu.J1708Send(msg,corrupt ? 5 : 4,8,!corrupt)){
+        sent++;
+        bad += corrupt;
+      }
+    }
+  }
+  for (uint32_t t=millis(); millis()-t<100;){
+    monitor.J1708Update();
+    ecu.J1708Update();
+  }
+  monitor.J1708StatsPublish();
+  done = true;
+  thread.join();
+
+  J1708Stats stats;
+  bool final = monitor.snapshot(stats);
+  uint32_t liveRx = monitor.RX_Counter, liveErrors = monitor.ERR_Counter;
+
+  //A transmit alone (TX_Counter up, queue down) must publish well before the periodic refresh
+  ecu.J1708StatsPublish();
+  uint8_t msg[5] = {0x80,84,0,0x27,0};
+  ecu.J1708Send(msg,5,8);
+  for (uint32_t t=millis(); millis()-t<30;){
+    monitor.J1708Update();
+    ecu.J1708Update();
+  }
+  J1708Stats ecuStats;
+  bool txSeen = ecu.snapshot(ecuStats) && ecuStats.tx==ecu.TX_Counter && ecuStats.tx==sent+1;
+
+  printf("sim_stats: %u frames sent, %u with a bad checksum\n", sent, bad);
+  printf("  snapshots / missed / torn: %u / %u / %u\n", reads, misses, torn);
+  printf("  publishes seen:            %u of %u\n", published, stats.sequence);
+  printf("  rx / errors (snapshot):    %u / %u\n", stats.rx, stats.errors);
+  printf("  rx / errors (live):        %u / %u\n", liveRx, liveErrors);
+  printf("  ECU tx published in 30 ms: %s\n", txSeen ? "yes" : "no");
+
+  bool ok = final && txSeen && reads>0 && torn==0 && bad>0 && stats.err[1]==bad
+            && stats.rx==liveRx && stats.errors==liveErrors && stats.rx==sent;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+/*
+  sim_watch.cpp
+  Written by David Nnaji @ Colorado State University, April 21st, 2022
+
+  Github:
+    https://github.com/davidnnaji
+    Do you find this library useful? Let me know online!
+
+  Description:
+    Loop-stall watchdog. Port 3 sends a frame every 50 ms on a bus shared
+    with a monitor on port 5.
+    Part 1: stall threshold 900 us. J1708Tx waits about one character time
+    for the echo of the MID, so every send must be a stall event blamed on tx.
+    Part 2: threshold 5 ms, and the sketch itself blocks for 20 ms every
+    500 ms. Each block must be a stall event blamed on the loop, while the
+    99th percentile gap stays short.
+    Returns 0 on success, 1 otherwise.
+
+  Liscense:
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+*/
+
+#include <J1708_T4.h>
+
+J1708Full j1708_3;
+J1708Full monitor;
+
+uint32_t run(uint32_t duration, bool block){
+  J1708Sim &sim = J1708Sim::instance();
+  uint32_t sent = 0;
+  elapsedMillis period, blocked;
+  for (uint32_t start=millis(); millis()-start<duration;){
+    j1708_3.J1708Update();
+    monitor.J1708Update();
+    if (period>=50){
+      period = 0;
+      uint8_t msg[5] = {0x80,84,(uint8_t)sent,0x27,0};
+      sent += j1708_3.J1708Send(msg,5,8);
+    }
+    if (block && blocked>=500){
+      blocked = 0;
+      sim.advance(20000);
+    }
+  }
+  return sent;
+}
+
+int main(){
+  J1708Sim &sim = J1708Sim::instance();
+  Serial.out = NULL;
+  sim.attach(Serial3,0);
+  sim.attach(Serial5,0);
+  j1708_3.begin(3);
+  monitor.begin(5);
+  monitor.selfMode = J1708::Observer;
+
+  //Part 1: transmit waits
+  j1708_3.J1708Settings("j1708config sp3 -s -w 900");
+  uint32_t sent = run(2000,false);
+  uint32_t txStalls = j1708_3.STALL_Counter;
+  bool txBlamed = j1708_3.N_WatchEvents>0;
+  for (int i=0; i<j1708_3.N_WatchEvents; i++){
+    txBlamed &= j1708_3.WatchEvents[i].phase==J1708Core::PhaseTx;
+  }
+  printf("sim_watch: %u frames sent\n", sent);
+  printf("  tx stalls:              %u (last %s)\n", txStalls, J1708Core::PhaseNames[j1708_3.WatchEvents[0].phase]);
+  printf("  max / p99 gap:          %u (%s) / %u us\n", j1708_3.WatchMax, J1708Core::PhaseNames[j1708_3.WatchMaxPhase], j1708_3.J1708WatchPercentile(99));
+
+  //Part 2: the sketch blocks
+  j1708_3.J1708Settings("j1708config sp3 -r -z");
+  j1708_3.J1708Settings("j1708config sp3 -s -w 5000");
+  run(5000,true);
+  bool loopBlamed = j1708_3.N_WatchEvents>0;
+  for (int i=0; i<j1708_3.N_WatchEvents; i++){
+    loopBlamed &= j1708_3.WatchEvents[i].phase==J1708Core::PhaseLoop && j1708_3.WatchEvents[i].gap>=20000;
+  }
+  uint32_t p99 = j1708_3.J1708WatchPercentile(99);
+  printf("  loop stalls:            %u (last %s)\n", j1708_3.STALL_Counter, J1708Core::PhaseNames[j1708_3.WatchEvents[0].phase]);
+  printf("  max / p99 gap:          %u (%s) / %u us\n", j1708_3.WatchMax, J1708Core::PhaseNames[j1708_3.WatchMaxPhase], p99);
+
+  //The frame queued last may still be waiting for the bus
+  bool ok = sent>0 && txStalls+1>=sent && txStalls<=sent && txBlamed && j1708_3.STALL_Counter>=9 && j1708_3.STALL_Counter<=10 && loopBlamed
+            && j1708_3.WatchMaxPhase==J1708Core::PhaseLoop && p99<1024;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}